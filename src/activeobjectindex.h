@@ -0,0 +1,167 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ACTIVEOBJECTINDEX_HEADER
+#define ACTIVEOBJECTINDEX_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include "constants.h"
+#include "util/numeric.h"
+#include <map>
+#include <vector>
+
+/*
+	Spatial index of active objects.
+
+	The objects are bucketed by the MapBlock their position is in.
+	Positions are not watched; update() has to be called when an
+	object may have moved.
+
+	The objects that have been inserted or have changed blocks are
+	recorded until takeMoved() is called, so the objects that come into
+	someone's view can be found without looking at all of them.
+*/
+
+class ActiveObjectIndex
+{
+public:
+	void insert(u16 id, v3f pos)
+	{
+		remove(id);
+		v3s16 cell = getCell(pos);
+		m_objects[id] = cell;
+		m_cells[cell].push_back(id);
+		m_moved.push_back(id);
+	}
+
+	// Does nothing if id is not in the index
+	void update(u16 id, v3f pos)
+	{
+		std::map<u16, v3s16>::iterator i = m_objects.find(id);
+		if(i == m_objects.end())
+			return;
+		v3s16 cell = getCell(pos);
+		if(cell == i->second)
+			return;
+		removeFromCell(id, i->second);
+		i->second = cell;
+		m_cells[cell].push_back(id);
+		m_moved.push_back(id);
+	}
+
+	void remove(u16 id)
+	{
+		std::map<u16, v3s16>::iterator i = m_objects.find(id);
+		if(i == m_objects.end())
+			return;
+		removeFromCell(id, i->second);
+		m_objects.erase(i);
+	}
+
+	void clear()
+	{
+		m_objects.clear();
+		m_cells.clear();
+		m_moved.clear();
+	}
+
+	u32 size() const
+	{
+		return m_objects.size();
+	}
+
+	/*
+		Adds to ids the objects that may be within radius from pos:
+		those in the blocks that the bounding box of the sphere touches.
+		The caller checks the actual distances.
+	*/
+	void getObjectsNear(v3f pos, f32 radius, std::vector<u16> &ids) const
+	{
+		f32 cell_size = MAP_BLOCKSIZE * BS;
+		f32 d = 2 * radius / cell_size + 2;
+		if(d * d * d > m_cells.size())
+		{
+			// Cheaper to go through all the objects
+			for(std::map<u16, v3s16>::const_iterator
+					i = m_objects.begin(); i != m_objects.end(); ++i)
+				ids.push_back(i->first);
+			return;
+		}
+		v3f r(radius, radius, radius);
+		v3s16 minc = getCell(pos - r);
+		v3s16 maxc = getCell(pos + r);
+		v3s16 c;
+		for(c.X = minc.X; c.X <= maxc.X; c.X++)
+		for(c.Y = minc.Y; c.Y <= maxc.Y; c.Y++)
+		for(c.Z = minc.Z; c.Z <= maxc.Z; c.Z++)
+		{
+			std::map<v3s16, std::vector<u16> >::const_iterator i =
+					m_cells.find(c);
+			if(i == m_cells.end())
+				continue;
+			ids.insert(ids.end(), i->second.begin(), i->second.end());
+		}
+	}
+
+	/*
+		Replaces the contents of ids with the objects inserted or moved
+		to another block since the last call. May contain duplicates
+		and objects removed since.
+	*/
+	void takeMoved(std::vector<u16> &ids)
+	{
+		ids.clear();
+		ids.swap(m_moved);
+	}
+
+	static v3s16 getCell(v3f pos)
+	{
+		return getContainerPos(floatToInt(pos, BS), MAP_BLOCKSIZE);
+	}
+
+private:
+	void removeFromCell(u16 id, v3s16 cell)
+	{
+		std::map<v3s16, std::vector<u16> >::iterator i = m_cells.find(cell);
+		if(i == m_cells.end())
+			return;
+		std::vector<u16> &v = i->second;
+		for(u32 k=0; k<v.size(); k++)
+		{
+			if(v[k] != id)
+				continue;
+			// Order doesn't matter; fill the hole with the last one
+			v[k] = v.back();
+			v.pop_back();
+			break;
+		}
+		if(v.empty())
+			m_cells.erase(i);
+	}
+
+	// The block of each object
+	std::map<u16, v3s16> m_objects;
+	// The objects in each block; only blocks that have some
+	std::map<v3s16, std::vector<u16> > m_cells;
+	// Inserted or moved objects; see takeMoved()
+	std::vector<u16> m_moved;
+};
+
+#endif
+
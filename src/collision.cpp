@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "collision.h"
 #include "mapblock.h"
 #include "map.h"
+#include "mapcursor.h"
 #include "nodedef.h"
 #include "gamedef.h"
 #include "log.h"
@@ -230,14 +231,17 @@ collisionMoveResult collisionMoveSimple(Map *map, IGameDef *gamedef,
 	s16 max_y = MYMAX(oldpos_i.Y, newpos_i.Y) + (box_0.MaxEdge.Y / BS) + 1;
 	s16 max_z = MYMAX(oldpos_i.Z, newpos_i.Z) + (box_0.MaxEdge.Z / BS) + 1;
 
+	MapCursor cursor(map);
 	for(s16 x = min_x; x <= max_x; x++)
 	for(s16 y = min_y; y <= max_y; y++)
 	for(s16 z = min_z; z <= max_z; z++)
 	{
 		v3s16 p(x,y,z);
-		try{
+		bool is_valid_position;
+		MapNode n = cursor.getNode(p, &is_valid_position);
+		if(is_valid_position)
+		{
 			// Object collides into walkable nodes
-			MapNode n = map->getNode(p);
 			const ContentFeatures &f = gamedef->getNodeDefManager()->get(n);
 			if(f.walkable == false)
 				continue;
@@ -258,7 +262,7 @@ collisionMoveResult collisionMoveSimple(Map *map, IGameDef *gamedef,
 				node_positions.push_back(p);
 			}
 		}
-		catch(InvalidPositionException &e)
+		else
 		{
 			// Collide with unloaded nodes
 			aabb3f box = getNodeBox(p, BS);
@@ -1613,18 +1613,34 @@ class GenericCAO : public ClientActiveObject
 			
 			expireVisuals();
 		}
-		else if(cmd == GENERIC_CMD_UPDATE_POSITION)
+		else if(cmd == GENERIC_CMD_UPDATE_POSITION ||
+				cmd == GENERIC_CMD_UPDATE_POSITION_COMPACT)
 		{
 			// Not sent by the server if this object is an attachment.
 			// We might however get here if the server notices the object being detached before the client.
-			m_position = readV3F1000(is);
-			m_velocity = readV3F1000(is);
-			m_acceleration = readV3F1000(is);
-			if(fabs(m_prop.automatic_rotate) < 0.001)
-				m_yaw = readF1000(is);
-			bool do_interpolate = readU8(is);
-			bool is_end_position = readU8(is);
-			float update_interval = readF1000(is);
+			bool do_interpolate;
+			bool is_end_position;
+			float update_interval;
+			if(cmd == GENERIC_CMD_UPDATE_POSITION_COMPACT)
+			{
+				f32 yaw;
+				gob_read_update_position_compact(is, m_position,
+						m_velocity, m_acceleration, yaw, do_interpolate,
+						is_end_position, update_interval);
+				if(fabs(m_prop.automatic_rotate) < 0.001)
+					m_yaw = yaw;
+			}
+			else
+			{
+				m_position = readV3F1000(is);
+				m_velocity = readV3F1000(is);
+				m_acceleration = readV3F1000(is);
+				if(fabs(m_prop.automatic_rotate) < 0.001)
+					m_yaw = readF1000(is);
+				do_interpolate = readU8(is);
+				is_end_position = readU8(is);
+				update_interval = readF1000(is);
+			}
 
 			// Place us a bit higher if we're physical, to not sink into
 			// the ground due to sucky collision detection...
@@ -166,6 +166,8 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("enable_mapgen_debug_info", "false");
 	settings->setDefault("active_object_send_range_blocks", "3");
 	settings->setDefault("active_block_range", "2");
+	settings->setDefault("abm_time_budget", "0.05");
+	settings->setDefault("num_abm_threads", "");
 	//settings->setDefault("max_simultaneous_block_sends_per_client", "1");
 	// This causes frametime jitter on client side, or does it?
 	settings->setDefault("max_simultaneous_block_sends_per_client", "4");
@@ -175,7 +177,12 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("time_send_interval", "5");
 	settings->setDefault("time_speed", "72");
 	settings->setDefault("server_unload_unused_data_timeout", "29");
+	settings->setDefault("server_map_memory_budget", "0");
 	settings->setDefault("server_map_save_interval", "5.3");
+	settings->setDefault("server_map_save_async", "true");
+	settings->setDefault("server_map_save_queue_limit", "4096");
+	settings->setDefault("sqlite_block_keys", "linear");
+	settings->setDefault("server_map_prefetch_size", "2");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.1");
 	settings->setDefault("ignore_world_load_errors", "false");
@@ -188,6 +195,8 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_diskonly", "");
 	settings->setDefault("emergequeue_limit_generate", "");
 	settings->setDefault("num_emerge_threads", "1");
+	settings->setDefault("mapgen_column_cache_size", "32");
+	settings->setDefault("mapgen_chunk_threads", "");
 	
 	// physics stuff
 	settings->setDefault("movement_acceleration_default", "3");
@@ -206,6 +215,7 @@ void set_default_settings(Settings *settings)
 	//liquid stuff
 	settings->setDefault("liquid_finite", "false");
 	settings->setDefault("liquid_update", "1.0");
+	settings->setDefault("liquid_update_time_budget", "0.05");
 	settings->setDefault("liquid_relax", "1");
 	settings->setDefault("liquid_fast_flood", "1");
 
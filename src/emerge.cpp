@@ -49,6 +49,8 @@ EmergeManager::EmergeManager(IGameDef *gamedef, BiomeDefManager *bdef) {
 
 	this->biomedef = bdef ? bdef : new BiomeDefManager(gamedef);
 	this->params   = NULL;
+	this->column_cache = new MapgenColumnCache(
+		g_settings->getU16("mapgen_column_cache_size"));
 	
 	mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
 
@@ -72,18 +74,39 @@ EmergeManager::EmergeManager(IGameDef *gamedef, BiomeDefManager *bdef) {
 	qlimit_generate = g_settings->get("emergequeue_limit_generate").empty() ?
 		nthreads + 1 :
 		g_settings->getU16("emergequeue_limit_generate");
+	// Leave some room for the players moving back and forth
+	cancel_distance = MYMAX(g_settings->getS16("max_block_send_distance"),
+		g_settings->getS16("max_block_generate_distance")) + 2;
 	
 	for (int i = 0; i != nthreads; i++)
 		emergethread.push_back(new EmergeThread((Server *)gamedef, i));
+	
+	int nworkers;
+	if (g_settings->get("mapgen_chunk_threads").empty()) {
+		int nprocs = porting::getNumberOfProcessors();
+		// use the procs that the emerge threads leave idle
+		nworkers = nprocs - 1 - nthreads;
+	} else {
+		// the emerge thread itself counts as one
+		nworkers = (int)g_settings->getU16("mapgen_chunk_threads") - 1;
+	}
+	if (nworkers < 0)
+		nworkers = 0;
+	this->worker_pool = nworkers ? new MapgenWorkerPool(nworkers) : NULL;
 		
-	infostream << "EmergeManager: using " << nthreads << " threads" << std::endl;
+	infostream << "EmergeManager: using " << nthreads << " threads, "
+		<< nworkers << " mapgen worker threads" << std::endl;
 }
 
 
 EmergeManager::~EmergeManager() {
-	for (unsigned int i = 0; i != emergethread.size(); i++) {
+	// Stop all of them before waking any, since any thread can take
+	// any of the signals
+	for (unsigned int i = 0; i != emergethread.size(); i++)
 		emergethread[i]->setRun(false);
-		emergethread[i]->qevent.signal();
+	for (unsigned int i = 0; i != emergethread.size(); i++)
+		queue_event.signal();
+	for (unsigned int i = 0; i != emergethread.size(); i++) {
 		emergethread[i]->stop();
 		delete emergethread[i];
 		delete mapgen[i];
@@ -91,6 +114,8 @@ EmergeManager::~EmergeManager() {
 	
 	delete biomedef;
 	delete params;
+	delete column_cache;
+	delete worker_pool;
 }
 
 
@@ -119,7 +144,6 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 	BlockEmergeData *bedata;
 	u16 count;
 	u8 flags = 0;
-	int idx = 0;
 	
 	if (allow_generate)
 		flags |= BLOCK_EMERGE_ALLOWGEN;
@@ -149,25 +173,98 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 		blocks_enqueued.insert(std::make_pair(p, bedata));
 		
 		peer_queue_count[peer_id] = count + 1;
-		
-		// insert into the EmergeThread queue with the least items
-		int lowestitems = emergethread[0]->blockqueue.size();
-		for (unsigned int i = 1; i != emergethread.size(); i++) {
-			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
-				idx = i;
-				lowestitems = nitems;
+	}
+	// Any idle thread may take it
+	queue_event.signal();
+	
+	return true;
+}
+
+
+bool EmergeManager::popBlockEmerge(v3s16 *pos, u8 *flags) {
+	JMutexAutoLock queuelock(queuemutex);
+
+	/*
+		The queue is short (see qlimit_total), so it is simply searched
+		every time; that way the players moving meanwhile is taken into
+		account without keeping anything sorted.
+	*/
+	std::map<v3s16, BlockEmergeData *>::iterator nearest = blocks_enqueued.end();
+	s32 nearest_d = 0;
+	u32 cancelled = 0;
+	for (std::map<v3s16, BlockEmergeData *>::iterator
+			iter = blocks_enqueued.begin(); iter != blocks_enqueued.end();) {
+		BlockEmergeData *bedata = iter->second;
+		// Requests not made by a player and those of players whose
+		// position is not known yet go first
+		s32 d = 0;
+		std::map<u16, v3s16>::iterator ppos =
+			peer_positions.find(bedata->peer_requested);
+		if (bedata->peer_requested != PEER_ID_INEXISTENT &&
+				ppos != peer_positions.end()) {
+			v3s16 dp = iter->first - ppos->second;
+			d = MYMAX(MYMAX(abs(dp.X), abs(dp.Y)), abs(dp.Z));
+			if (d > cancel_distance) {
+				// The player has gone away; it will ask again if it comes back
+				peer_queue_count[bedata->peer_requested]--;
+				delete bedata;
+				blocks_enqueued.erase(iter++);
+				cancelled++;
+				continue;
 			}
 		}
-		
-		emergethread[idx]->blockqueue.push(p);
+		if (nearest == blocks_enqueued.end() || d < nearest_d) {
+			nearest = iter;
+			nearest_d = d;
+		}
+		++iter;
 	}
-	emergethread[idx]->qevent.signal();
+	if (cancelled != 0)
+		g_profiler->add("Emerge: stale requests cancelled", cancelled);
+
+	if (nearest == blocks_enqueued.end())
+		return false;
+
+	BlockEmergeData *bedata = nearest->second;
+	*pos = nearest->first;
+	*flags = bedata->flags;
+	blocks_emerging.insert(nearest->first);
+	
+	peer_queue_count[bedata->peer_requested]--;
+
+	delete bedata;
+	blocks_enqueued.erase(nearest);
 	
 	return true;
 }
 
 
+void EmergeManager::setPeerPositions(const std::map<u16, v3s16> &positions) {
+	JMutexAutoLock queuelock(queuemutex);
+	peer_positions = positions;
+	g_profiler->avg("Emerge: queue length", blocks_enqueued.size());
+}
+
+
+void EmergeManager::finishBlockEmerge(v3s16 p) {
+	JMutexAutoLock queuelock(queuemutex);
+	blocks_emerging.erase(p);
+}
+
+
+bool EmergeManager::isBlockEmerging(v3s16 p) {
+	JMutexAutoLock queuelock(queuemutex);
+	return blocks_enqueued.find(p) != blocks_enqueued.end() ||
+		blocks_emerging.find(p) != blocks_emerging.end();
+}
+
+
+u32 EmergeManager::getQueueLength() {
+	JMutexAutoLock queuelock(queuemutex);
+	return blocks_enqueued.size();
+}
+
+
 int EmergeManager::getGroundLevelAtPoint(v2s16 p) {
 	if (mapgen.size() == 0 || !mapgen[0]) {
 		errorstream << "EmergeManager: getGroundLevelAtPoint() called"
@@ -267,48 +364,44 @@ void EmergeManager::registerMapgen(std::string mgname, MapgenFactory *mgfactory)
 
 ////////////////////////////// Emerge Thread ////////////////////////////////// 
 
-bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
-	std::map<v3s16, BlockEmergeData *>::iterator iter;
-	JMutexAutoLock queuelock(emerge->queuemutex);
-
-	if (blockqueue.empty())
-		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
-	
-	*pos = p;
-	
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end()) 
-		return false; //uh oh, queue and map out of sync!!
-
-	BlockEmergeData *bedata = iter->second;
-	*flags = bedata->flags;
-	
-	emerge->peer_queue_count[bedata->peer_requested]--;
-
-	delete bedata;
-	emerge->blocks_enqueued.erase(iter);
-	
-	return true;
-}
-
-
 bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b, 
 									BlockMakeData *data, bool allow_gen) {
 	v2s16 p2d(p.X, p.Z);
-	//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
-	JMutexAutoLock envlock(m_server->m_env_mutex); 
-	
-	// Load sector if it isn't loaded
-	if (map->getSectorNoGenerateNoEx(p2d) == NULL)
-		map->loadSectorMeta(p2d);
+	{
+		//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
+		ProfiledMutexAutoLock envlock(m_server->m_env_mutex, g_profiler,
+				"EmergeThread: envlock wait (ms)");
+
+		// Load sector if it isn't loaded
+		if (map->getSectorNoGenerateNoEx(p2d) == NULL)
+			map->loadSectorMeta(p2d);
+
+		MapBlock *block = map->getBlockNoCreateNoEx(p);
+		bool hit = (block && !block->isDummy() && block->isGenerated());
+		g_profiler->avg("ServerMap: block cache hit rate", hit ? 1 : 0);
+		if (hit) {
+			*b = block;
+			return false;
+		}
+	}
 
-	// Attempt to load block
+	// Read the block from the database without holding the envlock,
+	// so that the environment step goes on meanwhile
+	EMERGE_DBG_OUT("not in memory, attempting to load from disk");
+	std::string blockdata;
+	bool found = map->readBlockData(p, &blockdata);
+
+	ProfiledMutexAutoLock envlock(m_server->m_env_mutex, g_profiler,
+			"EmergeThread: envlock wait (ms)");
+
+	// Attempt to load block, unless someone else did it meanwhile;
+	// what is in memory is newer than what was read
 	MapBlock *block = map->getBlockNoCreateNoEx(p);
 	if (!block || block->isDummy() || !block->isGenerated()) {
-		EMERGE_DBG_OUT("not in memory, attempting to load from disk");
-		block = map->loadBlock(p);
+		if (found)
+			block = map->loadBlockFromData(p, &blockdata);
+		else
+			block = map->loadBlockFromFiles(p);
 	}
 
 	// If could not load and allowed to generate,
@@ -341,14 +434,16 @@ void *EmergeThread::Thread() {
 	
 	while (getRun())
 	try {
-		if (!popBlockEmerge(&p, &flags)) {
-			qevent.wait();
+		if (!emerge->popBlockEmerge(&p, &flags)) {
+			emerge->queue_event.wait();
 			continue;
 		}
 
 		last_tried_pos = p;
-		if (blockpos_over_limit(p))
+		if (blockpos_over_limit(p)) {
+			emerge->finishBlockEmerge(p);
 			continue;
+		}
 
 		bool allow_generate = flags & BLOCK_EMERGE_ALLOWGEN;
 		EMERGE_DBG_OUT("p=" PP(p) " allow_generate=" << allow_generate);
@@ -366,15 +461,28 @@ void *EmergeThread::Thread() {
 				ScopeProfiler sp(g_profiler, "EmergeThread: Mapgen::makeChunk", SPT_AVG);
 				TimeTaker t("mapgen::make_block()");
 
+				// Split the chunk across the workers only if no other
+				// blocks are waiting, or it would slow them down
+				mapgen->workers = (emerge->getQueueLength() == 0) ?
+					emerge->worker_pool : NULL;
 				mapgen->makeChunk(&data);
 
 				if (enable_mapgen_debug_info == false)
 					t.stop(true); // Hide output
 			}
 
+			{
+				// Copy the chunk into blocks now, so that the envlock is
+				// held only for swapping them into the map
+				ScopeProfiler sp(g_profiler, "EmergeThread: prepare "
+						"Mapgen::makeChunk result", SPT_AVG);
+				map->prepareBlockMake(&data);
+			}
+
 			{
 				//envlock: usually 0ms, but can take either 30 or 400ms to acquire
-				JMutexAutoLock envlock(m_server->m_env_mutex); 
+				ProfiledMutexAutoLock envlock(m_server->m_env_mutex, g_profiler,
+						"EmergeThread: envlock wait (ms)");
 				ScopeProfiler sp(g_profiler, "EmergeThread: after "
 						"Mapgen::makeChunk (envlock)", SPT_AVG);
 
@@ -427,6 +535,8 @@ void *EmergeThread::Thread() {
 				client->SetBlocksNotSent(modified_blocks);
 			}
 		}
+
+		emerge->finishBlockEmerge(p);
 	}
 	catch (VersionMismatchException &e) {
 		std::ostringstream err;
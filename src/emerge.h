@@ -2,6 +2,7 @@
 #define EMERGE_HEADER
 
 #include <map>
+#include <set>
 #include <queue>
 #include "util/thread.h"
 
@@ -18,6 +19,8 @@ class Biome;
 class BiomeDefManager;
 class EmergeThread;
 class ManualMapVoxelManipulator;
+class MapgenColumnCache;
+class MapgenWorkerPool;
 
 #include "server.h"
 
@@ -57,15 +60,28 @@ class EmergeManager {
 	u16 qlimit_total;
 	u16 qlimit_diskonly;
 	u16 qlimit_generate;
+	// Requests farther than this from the requesting player are dropped
+	s16 cancel_distance;
 	
 	//block emerge queue data structures
 	JMutex queuemutex;
 	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
 	std::map<u16, u16> peer_queue_count;
+	// Popped blocks that an EmergeThread is still working on
+	std::set<v3s16> blocks_emerging;
+	// Block positions of the players of the peers
+	std::map<u16, v3s16> peer_positions;
+	// Signaled once for each queued block
+	Event queue_event;
 
 	//biome manager
 	BiomeDefManager *biomedef;
 
+	// 2D data of chunk columns, shared by the mapgens
+	MapgenColumnCache *column_cache;
+	// Helps the mapgens with a single chunk while the queue is empty
+	MapgenWorkerPool *worker_pool;
+
 	EmergeManager(IGameDef *gamedef, BiomeDefManager *bdef);
 	~EmergeManager();
 
@@ -74,6 +90,19 @@ class EmergeManager {
 						MapgenParams *mgparams);
 	MapgenParams *createMapgenParams(std::string mgname);
 	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	/*
+		Takes the queued block that is nearest to the player that
+		requested it, dropping the requests of players that have gone
+		far away. Returns false if nothing is queued.
+	*/
+	bool popBlockEmerge(v3s16 *pos, u8 *flags);
+	void setPeerPositions(const std::map<u16, v3s16> &positions);
+	// Called by the EmergeThread when it is done with a popped block
+	void finishBlockEmerge(v3s16 p);
+	// True if the block is queued or being emerged
+	bool isBlockEmerging(v3s16 p);
+	// Number of blocks waiting for an EmergeThread
+	u32 getQueueLength();
 	
 	void registerMapgen(std::string name, MapgenFactory *mgfactory);
 	MapgenParams *getParamsFromSettings(Settings *settings);
@@ -96,9 +125,6 @@ class EmergeThread : public SimpleThread
 	int id;
 	
 public:
-	Event qevent;
-	std::queue<v3s16> blockqueue;
-	
 	EmergeThread(Server *server, int ethreadid):
 		SimpleThread(),
 		m_server(server),
@@ -120,7 +146,6 @@ class EmergeThread : public SimpleThread
 		}
 	}
 
-	bool popBlockEmerge(v3s16 *pos, u8 *flags);
 	bool getBlockOrStartGen(v3s16 p, MapBlock **b, 
 							BlockMakeData *data, bool allow_generate);
 };
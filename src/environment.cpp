@@ -20,12 +20,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <bitset>
 #include "environment.h"
 #include "filesys.h"
 #include "porting.h"
 #include "collision.h"
 #include "content_mapnode.h"
 #include "mapblock.h"
+#include "mapcursor.h"
 #include "serverobject.h"
 #include "content_sao.h"
 #include "mapgen.h"
@@ -44,6 +46,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "daynightratio.h"
 #include "map.h"
 #include "util/serialize.h"
+#include "util/thread.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -316,6 +319,88 @@ void ActiveBlockList::update(std::list<v3s16> &active_positions,
 	}
 }
 
+/*
+	The ActiveBlockModifiers of an environment with their node names
+	resolved to content ids. Resolving names (groups in particular) is
+	slow, so this is kept until the ABMs or the node definitions change.
+*/
+class ABMTable
+{
+public:
+	struct Entry
+	{
+		ABMWithState *abm;
+		std::vector<content_t> trigger_contents;
+		bool has_required_neighbors;
+		std::bitset<MAX_CONTENT+1> required_neighbors;
+	};
+
+	ABMTable(std::list<ABMWithState> &abms, INodeDefManager *ndef):
+		m_ndef_revision(ndef->getRevision())
+	{
+		// ABMs triggered by each content, in the order of abms
+		std::vector<std::vector<u16> > by_content(MAX_CONTENT+1);
+
+		for(std::list<ABMWithState>::iterator
+				i = abms.begin(); i != abms.end(); ++i){
+			ActiveBlockModifier *abm = i->abm;
+			Entry entry;
+			entry.abm = &*i;
+			// Trigger neighbors
+			std::set<content_t> ids;
+			std::set<std::string> required_neighbors_s
+					= abm->getRequiredNeighbors();
+			for(std::set<std::string>::iterator
+					j = required_neighbors_s.begin();
+					j != required_neighbors_s.end(); j++)
+			{
+				ndef->getIds(*j, ids);
+			}
+			entry.has_required_neighbors = !required_neighbors_s.empty();
+			for(std::set<content_t>::iterator
+					k = ids.begin(); k != ids.end(); k++)
+				entry.required_neighbors.set(*k);
+			// Trigger contents
+			ids.clear();
+			std::set<std::string> contents_s = abm->getTriggerContents();
+			for(std::set<std::string>::iterator
+					j = contents_s.begin(); j != contents_s.end(); j++)
+			{
+				ndef->getIds(*j, ids);
+			}
+			entry.trigger_contents.assign(ids.begin(), ids.end());
+			for(std::set<content_t>::iterator
+					k = ids.begin(); k != ids.end(); k++)
+				by_content[*k].push_back(entries.size());
+			entries.push_back(entry);
+		}
+
+		// Flatten by_content
+		trigger_start.resize(MAX_CONTENT+2);
+		for(u32 c=0; c<=MAX_CONTENT; c++)
+		{
+			trigger_start[c] = triggers.size();
+			triggers.insert(triggers.end(),
+					by_content[c].begin(), by_content[c].end());
+		}
+		trigger_start[MAX_CONTENT+1] = triggers.size();
+	}
+
+	bool isOutdated(INodeDefManager *ndef)
+	{
+		return ndef->getRevision() != m_ndef_revision;
+	}
+
+	std::vector<Entry> entries;
+	// The entries triggered by content c are triggers[trigger_start[c]]
+	// to triggers[trigger_start[c+1]-1]
+	std::vector<u32> trigger_start;
+	std::vector<u16> triggers;
+
+private:
+	u32 m_ndef_revision;
+};
+
 /*
 	ServerEnvironment
 */
@@ -328,7 +413,12 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, lua_State *L,
 	m_emerger(emerger),
 	m_random_spawn_timer(3),
 	m_send_recommended_timer(0),
-	m_active_block_interval_overload_skip(0),
+	m_abm_table(NULL),
+	m_abm_handler(NULL),
+	m_abm_collector(NULL),
+	m_abm_batch_size(1),
+	m_abm_pass_next(0),
+	m_abm_pass_time(0),
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
 	m_recommended_send_interval(0.1)
@@ -347,6 +437,10 @@ ServerEnvironment::~ServerEnvironment()
 	// Drop/delete map
 	m_map->drop();
 
+	endABMPass();
+	stopABMCollector();
+	delete m_abm_table;
+
 	// Delete ActiveBlockModifiers
 	for(std::list<ABMWithState>::iterator
 			i = m_abms.begin(); i != m_abms.end(); ++i){
@@ -612,29 +706,28 @@ void ServerEnvironment::loadMeta(const std::string &savedir)
 	}
 }
 
-struct ActiveABM
-{
-	ActiveBlockModifier *abm;
-	int chance;
-	std::set<content_t> required_neighbors;
-};
-
 class ABMHandler
 {
 private:
 	ServerEnvironment *m_env;
-	std::map<content_t, std::list<ActiveABM> > m_aabms;
+	ABMTable &m_table;
+	// Chance of each entry of m_table for this run, 0 if not triggered
+	std::vector<int> m_chances;
+	// Contents that trigger some ABM in this run
+	std::bitset<MAX_CONTENT+1> m_trigger_contents;
 public:
-	ABMHandler(std::list<ABMWithState> &abms,
+	ABMHandler(ABMTable &table,
 			float dtime_s, ServerEnvironment *env,
 			bool use_timers):
-		m_env(env)
+		m_env(env),
+		m_table(table),
+		m_chances(table.entries.size(), 0)
 	{
 		if(dtime_s < 0.001)
 			return;
-		INodeDefManager *ndef = env->getGameDef()->ndef();
-		for(std::list<ABMWithState>::iterator
-				i = abms.begin(); i != abms.end(); ++i){
+		for(u32 n=0; n<table.entries.size(); n++){
+			ABMTable::Entry &entry = table.entries[n];
+			ABMWithState *i = entry.abm;
 			ActiveBlockModifier *abm = i->abm;
 			float trigger_interval = abm->getTriggerInterval();
 			if(trigger_interval < 0.001)
@@ -644,8 +737,10 @@ class ABMHandler
 				i->timer += dtime_s;
 				if(i->timer < trigger_interval)
 					continue;
-				i->timer -= trigger_interval;
-				actual_interval = trigger_interval;
+				// Catch up on all intervals that have passed
+				actual_interval = floor(i->timer / trigger_interval)
+						* trigger_interval;
+				i->timer -= actual_interval;
 			}
 			float intervals = actual_interval / trigger_interval;
 			if(intervals == 0)
@@ -653,49 +748,54 @@ class ABMHandler
 			float chance = abm->getTriggerChance();
 			if(chance == 0)
 				chance = 1;
-			ActiveABM aabm;
-			aabm.abm = abm;
-			aabm.chance = chance / intervals;
-			if(aabm.chance == 0)
-				aabm.chance = 1;
-			// Trigger neighbors
-			std::set<std::string> required_neighbors_s
-					= abm->getRequiredNeighbors();
-			for(std::set<std::string>::iterator
-					i = required_neighbors_s.begin();
-					i != required_neighbors_s.end(); i++)
-			{
-				ndef->getIds(*i, aabm.required_neighbors);
-			}
-			// Trigger contents
-			std::set<std::string> contents_s = abm->getTriggerContents();
-			for(std::set<std::string>::iterator
-					i = contents_s.begin(); i != contents_s.end(); i++)
-			{
-				std::set<content_t> ids;
-				ndef->getIds(*i, ids);
-				for(std::set<content_t>::const_iterator k = ids.begin();
-						k != ids.end(); k++)
-				{
-					content_t c = *k;
-					std::map<content_t, std::list<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::list<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
-				}
-			}
+			m_chances[n] = chance / intervals;
+			if(m_chances[n] == 0)
+				m_chances[n] = 1;
+			for(u32 k=0; k<entry.trigger_contents.size(); k++)
+				m_trigger_contents.set(entry.trigger_contents[k]);
 		}
 	}
-	void apply(MapBlock *block)
+
+	// A node that an ABM is to be triggered on
+	struct Trigger
 	{
-		if(m_aabms.empty())
+		u16 entry; // Index in m_table.entries
+		v3s16 p;
+		MapNode n;
+		u32 active_object_count;
+		u32 active_object_count_wider;
+	};
+
+	/*
+		Finds the triggers of the nodes of a block, rolling the chances
+		with a generator seeded by seed.
+
+		Only reads the map, so several threads can collect different
+		blocks at once as long as nothing changes the map meanwhile.
+	*/
+	void collect(MapBlock *block, u32 seed, std::vector<Trigger> &triggers)
+	{
+		if(m_trigger_contents.none())
 			return;
 
-		ServerMap *map = &m_env->getServerMap();
+		// Skip blocks that contain nothing any ABM acts on
+		{
+			std::vector<content_t> contents;
+			block->getContents(contents);
+			bool found = false;
+			for(u32 i=0; i<contents.size() && !found; i++)
+				found = m_trigger_contents.test(contents[i]);
+			if(!found)
+				return;
+		}
+
+		MapCursor cursor(&m_env->getServerMap());
+		PseudoRandom pr(seed);
+
+		// Object counts are the same for all nodes of the block
+		bool have_object_counts = false;
+		u32 active_object_count = 0;
+		u32 active_object_count_wider = 0;
 
 		v3s16 p0;
 		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
@@ -704,21 +804,23 @@ class ABMHandler
 		{
 			MapNode n = block->getNodeNoEx(p0);
 			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
-
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
+			if(!m_trigger_contents.test(c))
 				continue;
+			v3s16 p = p0 + block->getPosRelative();
 
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
+			for(u32 k = m_table.trigger_start[c];
+					k < m_table.trigger_start[c+1]; k++)
 			{
-				if(myrand() % i->chance != 0)
+				u16 entry_i = m_table.triggers[k];
+				int chance = m_chances[entry_i];
+				if(chance == 0)
 					continue;
+				if(pr.next() % chance != 0)
+					continue;
+				ABMTable::Entry &entry = m_table.entries[entry_i];
 
 				// Check neighbors
-				if(!i->required_neighbors.empty())
+				if(entry.has_required_neighbors)
 				{
 					v3s16 p1;
 					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
@@ -727,51 +829,377 @@ class ABMHandler
 					{
 						if(p1 == p)
 							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
+						MapNode n = cursor.getNodeNoEx(p1);
+						if(entry.required_neighbors.test(n.getContent()))
 							goto neighbor_found;
-						}
 					}
 					// No required neighbor found
 					continue;
 				}
 neighbor_found:
 
-				// Find out how many objects the block contains
-				u32 active_object_count = block->m_static_objects.m_active.size();
-				// Find out how many objects this and all the neighbors contain
-				u32 active_object_count_wider = 0;
-				u32 wider_unknown_count = 0;
-				for(s16 x=-1; x<=1; x++)
-				for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
+				if(!have_object_counts)
 				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block->getPos() + v3s16(x,y,z));
-					if(block2==NULL){
-						wider_unknown_count = 0;
-						continue;
+					// Find out how many objects the block contains
+					active_object_count = block->m_static_objects.m_active.size();
+					// Find out how many objects this and all the neighbors contain
+					u32 wider_unknown_count = 0;
+					for(s16 x=-1; x<=1; x++)
+					for(s16 y=-1; y<=1; y++)
+					for(s16 z=-1; z<=1; z++)
+					{
+						MapBlock *block2 = cursor.getBlock(
+								block->getPos() + v3s16(x,y,z));
+						if(block2==NULL){
+							wider_unknown_count = 0;
+							continue;
+						}
+						active_object_count_wider +=
+								block2->m_static_objects.m_active.size()
+								+ block2->m_static_objects.m_stored.size();
 					}
-					active_object_count_wider +=
-							block2->m_static_objects.m_active.size()
-							+ block2->m_static_objects.m_stored.size();
+					// Extrapolate
+					u32 wider_known_count = 3*3*3 - wider_unknown_count;
+					active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
+					have_object_counts = true;
 				}
-				// Extrapolate
-				u32 wider_known_count = 3*3*3 - wider_unknown_count;
-				active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
-				
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
+
+				Trigger t;
+				t.entry = entry_i;
+				t.p = p;
+				t.n = n;
+				t.active_object_count = active_object_count;
+				t.active_object_count_wider = active_object_count_wider;
+				triggers.push_back(t);
 			}
 		}
 	}
+
+	/*
+		Calls the ABMs of the triggers in order. A trigger is dropped if
+		an earlier callback has replaced its node.
+	*/
+	void dispatch(const std::vector<Trigger> &triggers)
+	{
+		Map *map = &m_env->getMap();
+		for(u32 i=0; i<triggers.size(); i++)
+		{
+			const Trigger &t = triggers[i];
+			MapNode n = map->getNodeNoEx(t.p);
+			if(n.getContent() != t.n.getContent())
+				continue;
+			// Call all the trigger variations
+			ActiveBlockModifier *abm = m_table.entries[t.entry].abm->abm;
+			abm->trigger(m_env, t.p, n);
+			abm->trigger(m_env, t.p, n,
+					t.active_object_count, t.active_object_count_wider);
+		}
+	}
+
+	void apply(MapBlock *block)
+	{
+		std::vector<Trigger> triggers;
+		collect(block, makeSeed(), triggers);
+		dispatch(triggers);
+	}
+
+	// Seeds are taken on the server thread, so the triggers don't
+	// depend on which thread collects a block
+	static u32 makeSeed()
+	{
+		return (u32)myrand() << 15 ^ (u32)myrand();
+	}
+};
+
+/*
+	Collects the ABM triggers of a batch of blocks in several threads.
+
+	The server thread takes part in the work and waits until the whole
+	batch is done; it holds the environment lock meanwhile, so the map
+	doesn't change under the workers. The workers don't touch anything
+	else, and Lua is only called later in ABMHandler::dispatch().
+*/
+
+class ABMCollector;
+
+class ABMCollectThread : public SimpleThread
+{
+public:
+	ABMCollectThread(ABMCollector *collector):
+		SimpleThread(),
+		m_collector(collector)
+	{}
+
+	void * Thread();
+
+private:
+	ABMCollector *m_collector;
+};
+
+class ABMCollector
+{
+public:
+	// num_threads includes the calling thread
+	ABMCollector(u32 num_threads):
+		m_handler(NULL),
+		m_blocks(NULL),
+		m_seeds(NULL),
+		m_results(NULL),
+		m_next(0)
+	{
+		m_mutex.Init();
+		for(u32 i=1; i<num_threads; i++)
+		{
+			ABMCollectThread *t = new ABMCollectThread(this);
+			t->Start();
+			m_threads.push_back(t);
+		}
+	}
+
+	~ABMCollector()
+	{
+		// Stop all of them before waking any, since any thread can take
+		// any of the signals
+		for(u32 i=0; i<m_threads.size(); i++)
+			m_threads[i]->setRun(false);
+		for(u32 i=0; i<m_threads.size(); i++)
+			m_start_event.signal();
+		for(u32 i=0; i<m_threads.size(); i++)
+		{
+			m_threads[i]->stop();
+			delete m_threads[i];
+		}
+	}
+
+	// Collects the triggers of blocks[i] into results[i]
+	void collect(ABMHandler *handler, const std::vector<MapBlock*> &blocks,
+			const std::vector<u32> &seeds,
+			std::vector<std::vector<ABMHandler::Trigger> > &results)
+	{
+		results.resize(blocks.size());
+		if(blocks.empty())
+			return;
+		m_handler = handler;
+		m_blocks = &blocks;
+		m_seeds = &seeds;
+		m_results = &results;
+		m_next = 0;
+
+		// Only wake up threads that have something to do
+		u32 woken = MYMIN(m_threads.size(), blocks.size() - 1);
+		for(u32 i=0; i<woken; i++)
+			m_start_event.signal();
+		work();
+		for(u32 i=0; i<woken; i++)
+			m_done_event.wait();
+
+		m_handler = NULL;
+		m_blocks = NULL;
+		m_seeds = NULL;
+		m_results = NULL;
+	}
+
+private:
+	// Collects blocks of the current batch until none is left
+	void work()
+	{
+		for(;;)
+		{
+			u32 i;
+			{
+				JMutexAutoLock lock(m_mutex);
+				if(m_next >= m_blocks->size())
+					return;
+				i = m_next++;
+			}
+			m_handler->collect((*m_blocks)[i], (*m_seeds)[i],
+					(*m_results)[i]);
+		}
+	}
+
+	friend class ABMCollectThread;
+
+	std::vector<ABMCollectThread*> m_threads;
+	// Signaled once per thread to be woken up
+	Event m_start_event;
+	// Signaled by a thread when it has finished with the batch
+	Event m_done_event;
+
+	// The current batch
+	ABMHandler *m_handler;
+	const std::vector<MapBlock*> *m_blocks;
+	const std::vector<u32> *m_seeds;
+	std::vector<std::vector<ABMHandler::Trigger> > *m_results;
+	// Index of the next block to collect; guarded by m_mutex
+	JMutex m_mutex;
+	u32 m_next;
 };
 
+void * ABMCollectThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("ABMCollectThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	for(;;)
+	{
+		m_collector->m_start_event.wait();
+		if(!getRun())
+			break;
+		m_collector->work();
+		m_collector->m_done_event.signal();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
+
+void ServerEnvironment::stepActiveBlockModifiers(float dtime)
+{
+	const float abm_interval = 1.0;
+
+	m_abm_pass_time += dtime;
+	if(m_abm_handler == NULL)
+	{
+		if(m_abm_pass_time < abm_interval)
+			return;
+
+		// Less than 100% if the last pass took longer than the interval
+		g_profiler->avg("SEnv: ABM coverage (%)",
+				100.0 * abm_interval / m_abm_pass_time);
+
+		// Initialize handling of ActiveBlockModifiers for the time
+		// since the last pass
+		m_abm_handler = new ABMHandler(getABMTable(), m_abm_pass_time,
+				this, true);
+		m_abm_pass_blocks.assign(m_active_blocks.m_list.begin(),
+				m_active_blocks.m_list.end());
+		m_abm_pass_next = 0;
+		m_abm_pass_time = 0;
+	}
+
+	ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg", SPT_AVG);
+
+	float budget = g_settings->getFloat("abm_time_budget");
+	u32 budget_ms = budget > 0 ? MYMAX(budget * 1000, 1) : 0;
+	u32 start_ms = porting::getTimeMs();
+
+	if(m_abm_collector == NULL)
+	{
+		u32 nthreads;
+		if(g_settings->get("num_abm_threads").empty())
+		{
+			int nprocs = porting::getNumberOfProcessors();
+			// Leave the emerge and other threads some room
+			nthreads = (nprocs > 2) ? nprocs / 2 : 1;
+		}
+		else
+		{
+			nthreads = g_settings->getU16("num_abm_threads");
+		}
+		if(nthreads < 1)
+			nthreads = 1;
+		infostream<<"ServerEnvironment: collecting ABM triggers in "
+				<<nthreads<<" threads"<<std::endl;
+		m_abm_collector = new ABMCollector(nthreads);
+		m_abm_batch_size = nthreads * 4;
+	}
+
+	std::vector<MapBlock*> blocks;
+	std::vector<u32> seeds;
+	std::vector<std::vector<ABMHandler::Trigger> > triggers;
+
+	u32 count = 0;
+	while(m_abm_pass_next < m_abm_pass_blocks.size())
+	{
+		if(budget_ms != 0 && porting::getTimeMs() - start_ms >= budget_ms)
+			break;
+
+		// Take the next batch of blocks
+		blocks.clear();
+		seeds.clear();
+		while(m_abm_pass_next < m_abm_pass_blocks.size() &&
+				blocks.size() < m_abm_batch_size)
+		{
+			v3s16 p = m_abm_pass_blocks[m_abm_pass_next++];
+
+			// The block may have been deactivated after the pass started
+			if(!m_active_blocks.contains(p))
+				continue;
+
+			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+			if(block==NULL)
+				continue;
+
+			// Set current time as timestamp
+			block->setTimestampNoChangedFlag(m_game_time);
+
+			blocks.push_back(block);
+			seeds.push_back(ABMHandler::makeSeed());
+		}
+
+		/* Handle ActiveBlockModifiers */
+		{
+			ScopeProfiler sp(g_profiler, "SEnv: ABM collect avg", SPT_AVG);
+			m_abm_collector->collect(m_abm_handler, blocks, seeds, triggers);
+		}
+		u32 trigger_count = 0;
+		for(u32 i=0; i<triggers.size(); i++)
+		{
+			trigger_count += triggers[i].size();
+			m_abm_handler->dispatch(triggers[i]);
+			triggers[i].clear();
+		}
+		g_profiler->avg("SEnv: ABM triggers per batch", trigger_count);
+		count += blocks.size();
+	}
+
+	g_profiler->avg("SEnv: ABM blocks handled", count);
+	g_profiler->avg("SEnv: ABM backlog (blocks)",
+			m_abm_pass_blocks.size() - m_abm_pass_next);
+
+	if(m_abm_pass_next == m_abm_pass_blocks.size())
+		endABMPass();
+}
+
+void ServerEnvironment::stopABMCollector()
+{
+	delete m_abm_collector;
+	m_abm_collector = NULL;
+}
+
+void ServerEnvironment::endABMPass()
+{
+	delete m_abm_handler;
+	m_abm_handler = NULL;
+	m_abm_pass_blocks.clear();
+	m_abm_pass_next = 0;
+}
+
+ABMTable & ServerEnvironment::getABMTable()
+{
+	// A running pass keeps using the table it started with
+	if(m_abm_table != NULL && m_abm_handler == NULL &&
+			m_abm_table->isOutdated(m_gamedef->ndef()))
+	{
+		delete m_abm_table;
+		m_abm_table = NULL;
+	}
+	if(m_abm_table == NULL)
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: ABM table rebuild", SPT_AVG);
+		m_abm_table = new ABMTable(m_abms, m_gamedef->ndef());
+	}
+	return *m_abm_table;
+}
+
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Get time difference
@@ -809,13 +1237,17 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	}
 
 	/* Handle ActiveBlockModifiers */
-	ABMHandler abmhandler(m_abms, dtime_s, this, false);
+	ABMHandler abmhandler(getABMTable(), dtime_s, this, false);
 	abmhandler.apply(block);
 }
 
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
 {
 	m_abms.push_back(ABMWithState(abm));
+	// Rebuild the table with the new ABM
+	endABMPass();
+	delete m_abm_table;
+	m_abm_table = NULL;
 }
 
 bool ServerEnvironment::setNode(v3s16 p, const MapNode &n)
@@ -857,15 +1289,22 @@ bool ServerEnvironment::removeNode(v3s16 p)
 	return true;
 }
 
+void ServerEnvironment::updateActiveObjectPosition(ServerActiveObject *obj)
+{
+	m_active_object_index.update(obj->getId(), obj->getBasePosition());
+}
+
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
 	std::set<u16> objects;
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	std::vector<u16> near_ids;
+	m_active_object_index.getObjectsNear(pos, radius, near_ids);
+	for(u32 i=0; i<near_ids.size(); i++)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+		u16 id = near_ids[i];
+		ServerActiveObject* obj = getActiveObject(id);
+		if(obj == NULL)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
@@ -921,6 +1360,7 @@ void ServerEnvironment::clearAllObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 
 	std::list<v3s16> loadable_blocks;
@@ -1147,49 +1587,7 @@ void ServerEnvironment::step(float dtime)
 		}
 	}
 	
-	const float abm_interval = 1.0;
-	if(m_active_block_modifier_interval.step(dtime, abm_interval))
-	do{ // breakable
-		if(m_active_block_interval_overload_skip > 0){
-			ScopeProfiler sp(g_profiler, "SEnv: ABM overload skips");
-			m_active_block_interval_overload_skip--;
-			break;
-		}
-		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
-		TimeTaker timer("modify in active blocks");
-		
-		// Initialize handling of ActiveBlockModifiers
-		ABMHandler abmhandler(m_abms, abm_interval, this, true);
-
-		for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
-		{
-			v3s16 p = *i;
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
-		}
-
-		u32 time_ms = timer.stop(true);
-		u32 max_time_ms = 200;
-		if(time_ms > max_time_ms){
-			infostream<<"WARNING: active block modifiers took "
-					<<time_ms<<"ms (longer than "
-					<<max_time_ms<<"ms)"<<std::endl;
-			m_active_block_interval_overload_skip = (time_ms / max_time_ms) + 1;
-		}
-	}while(0);
+	stepActiveBlockModifiers(dtime);
 	
 	/*
 		Step script environment (run global on_step())
@@ -1229,6 +1627,7 @@ void ServerEnvironment::step(float dtime)
 				continue;
 			// Step object
 			obj->step(dtime, send_recommended);
+			m_active_object_index.update(i->first, obj->getBasePosition());
 			// Read messages from object
 			while(!obj->m_messages_out.empty())
 			{
@@ -1337,30 +1736,56 @@ bool ServerEnvironment::addActiveObjectAsStatic(ServerActiveObject *obj)
 }
 #endif
 
+static bool isInObjectView(ServerActiveObject *object,
+		v3s16 center, s16 radius)
+{
+	v3s16 d = ActiveObjectIndex::getCell(object->getBasePosition()) - center;
+	return (s32)d.X*d.X + (s32)d.Y*d.Y + (s32)d.Z*d.Z
+			<= (s32)radius*radius;
+}
+
 /*
 	Finds out what new objects have been added to
-	inside a radius around a position
+	inside a view
 */
-void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
+void ServerEnvironment::getAddedActiveObjects(v3s16 center, s16 radius,
+		std::set<u16> &current_objects,
+		std::set<u16> &added_objects)
+{
+	std::vector<u16> ids;
+	m_active_object_index.getObjectsNear(
+			intToFloat(center * MAP_BLOCKSIZE
+			+ v3s16(1,1,1) * (MAP_BLOCKSIZE / 2), BS),
+			(radius + 1) * MAP_BLOCKSIZE * BS, ids);
+	// Players may have unlimited transfer distance
+	for(std::list<Player*>::iterator i = m_players.begin();
+			i != m_players.end(); ++i)
+	{
+		PlayerSAO *sao = (*i)->getPlayerSAO();
+		if(sao != NULL && sao->unlimitedTransferDistance())
+			ids.push_back(sao->getId());
+	}
+	getAddedActiveObjects(center, radius, ids, current_objects,
+			added_objects);
+}
+
+void ServerEnvironment::getAddedActiveObjects(v3s16 center, s16 radius,
+		const std::vector<u16> &moved,
 		std::set<u16> &current_objects,
 		std::set<u16> &added_objects)
 {
-	v3f pos_f = intToFloat(pos, BS);
-	f32 radius_f = radius * BS;
 	/*
-		Go through the object list,
+		Go through the candidates,
 		- discard m_removed objects,
-		- discard objects that are too far away,
+		- discard objects that are out of view,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(u32 i=0; i<moved.size(); i++)
 	{
-		u16 id = i->first;
+		u16 id = moved[i];
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if(object == NULL)
 			continue;
 		// Discard if removed
@@ -1368,8 +1793,7 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 			continue;
 		if(object->unlimitedTransferDistance() == false){
 			// Discard if too far
-			f32 distance_f = object->getBasePosition().getDistanceFrom(pos_f);
-			if(distance_f > radius_f)
+			if(!isInObjectView(object, center, radius))
 				continue;
 		}
 		// Discard if already on current_objects
@@ -1384,21 +1808,19 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 
 /*
 	Finds out what objects have been removed from
-	inside a radius around a position
+	inside a view
 */
-void ServerEnvironment::getRemovedActiveObjects(v3s16 pos, s16 radius,
+void ServerEnvironment::getRemovedActiveObjects(v3s16 center, s16 radius,
 		std::set<u16> &current_objects,
 		std::set<u16> &removed_objects)
 {
-	v3f pos_f = intToFloat(pos, BS);
-	f32 radius_f = radius * BS;
 	/*
 		Go through current_objects; object is removed if:
 		- object is not found in m_active_objects (this is actually an
 		  error condition; objects should be set m_removed=true and removed
 		  only after all clients have been informed about removal), or
 		- object has m_removed=true, or
-		- object is too far away
+		- object is out of view
 	*/
 	for(std::set<u16>::iterator
 			i = current_objects.begin();
@@ -1424,9 +1846,7 @@ void ServerEnvironment::getRemovedActiveObjects(v3s16 pos, s16 radius,
 		if(object->unlimitedTransferDistance())
 			continue;
 
-		f32 distance_f = object->getBasePosition().getDistanceFrom(pos_f);
-
-		if(distance_f >= radius_f)
+		if(!isInObjectView(object, center, radius))
 		{
 			removed_objects.insert(id);
 			continue;
@@ -1436,6 +1856,11 @@ void ServerEnvironment::getRemovedActiveObjects(v3s16 pos, s16 radius,
 	}
 }
 
+void ServerEnvironment::takeMovedActiveObjects(std::vector<u16> &moved)
+{
+	m_active_object_index.takeMoved(moved);
+}
+
 ActiveObjectMessage ServerEnvironment::getActiveObjectMessage()
 {
 	if(m_active_object_messages.empty())
@@ -1480,6 +1905,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects[object->getId()] = object;
+	m_active_object_index.insert(object->getId(), object->getBasePosition());
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1588,6 +2014,7 @@ void ServerEnvironment::removeRemovedObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
@@ -1895,6 +2322,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
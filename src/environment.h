@@ -32,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <set>
 #include <list>
+#include <vector>
 #include "irrlichttypes_extrabloated.h"
 #include "player.h"
 #include <ostream>
@@ -40,10 +41,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "mapnode.h"
 #include "mapblock.h"
+#include "activeobjectindex.h"
 
 class ServerEnvironment;
 class ActiveBlockModifier;
 class ServerActiveObject;
+class ABMTable;
+class ABMHandler;
+class ABMCollector;
 typedef struct lua_State lua_State;
 class ITextureSource;
 class IGameDef;
@@ -226,6 +231,10 @@ class ServerEnvironment : public Environment
 
 	ServerActiveObject* getActiveObject(u16 id);
 
+	// Tells the environment that the object may have moved.
+	// Called by ServerActiveObject::setBasePosition().
+	void updateActiveObjectPosition(ServerActiveObject *obj);
+
 	/*
 		Add an active object to the environment.
 		Environment handles deletion of object.
@@ -245,21 +254,41 @@ class ServerEnvironment : public Environment
 	*/
 	//bool addActiveObjectAsStatic(ServerActiveObject *object);
 	
+	/*
+		The view of a client is the blocks within radius blocks of the
+		block center. Objects are sent to the client while they are in
+		a block of its view.
+	*/
+
 	/*
 		Find out what new objects have been added to
-		inside a radius around a position
+		inside a view
 	*/
-	void getAddedActiveObjects(v3s16 pos, s16 radius,
+	void getAddedActiveObjects(v3s16 center, s16 radius,
+			std::set<u16> &current_objects,
+			std::set<u16> &added_objects);
+
+	/*
+		Same, but only looks at the objects in moved (see
+		takeMovedActiveObjects()). Enough if the view hasn't changed
+		since all the objects in it were added.
+	*/
+	void getAddedActiveObjects(v3s16 center, s16 radius,
+			const std::vector<u16> &moved,
 			std::set<u16> &current_objects,
 			std::set<u16> &added_objects);
 
 	/*
 		Find out what new objects have been removed from
-		inside a radius around a position
+		inside a view
 	*/
-	void getRemovedActiveObjects(v3s16 pos, s16 radius,
+	void getRemovedActiveObjects(v3s16 center, s16 radius,
 			std::set<u16> &current_objects,
 			std::set<u16> &removed_objects);
+
+	// Takes the objects that have been added or have changed blocks
+	// since the last call
+	void takeMovedActiveObjects(std::vector<u16> &moved);
 	
 	/*
 		Get the next message emitted by some active object.
@@ -338,6 +367,24 @@ class ServerEnvironment : public Environment
 	*/
 	void deactivateFarObjects(bool force_delete);
 
+	/*
+		Run active block modifiers in active blocks.
+
+		A pass goes through all active blocks once. It is spread over
+		steps so that one step doesn't spend more than abm_time_budget
+		on it. A pass starts at most once per abm_interval; the ABMs
+		catch up on the time that passes go over.
+
+		The blocks are handled in batches: the triggers of a batch are
+		collected by num_abm_threads threads, then the ABMs are called
+		on the server thread in block order.
+	*/
+	void stepActiveBlockModifiers(float dtime);
+	void endABMPass();
+	void stopABMCollector();
+	// Returns m_abm_table, building it first if needed
+	ABMTable & getABMTable();
+
 	/*
 		Member variables
 	*/
@@ -352,6 +399,9 @@ class ServerEnvironment : public Environment
 	IBackgroundBlockEmerger *m_emerger;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// Positions of the active objects; updated after the objects
+	// are stepped and when one is moved from outside its step
+	ActiveObjectIndex m_active_object_index;
 	// Outgoing network message buffer for active objects
 	Queue<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -361,9 +411,20 @@ class ServerEnvironment : public Environment
 	// List of active blocks
 	ActiveBlockList m_active_blocks;
 	IntervalLimiter m_active_blocks_management_interval;
-	IntervalLimiter m_active_block_modifier_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
-	int m_active_block_interval_overload_skip;
+	// m_abms with node names resolved, NULL if not built
+	ABMTable *m_abm_table;
+	// The ABM pass being run, NULL if none
+	ABMHandler *m_abm_handler;
+	// Threads that collect ABM triggers, NULL until the first pass
+	ABMCollector *m_abm_collector;
+	// Number of blocks collected at once
+	u32 m_abm_batch_size;
+	// Blocks of the pass and the index of the next one
+	std::vector<v3s16> m_abm_pass_blocks;
+	u32 m_abm_pass_next;
+	// Time from the start of the last pass
+	float m_abm_pass_time;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
@@ -20,6 +20,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "genericobject.h"
 #include <sstream>
 #include "util/serialize.h"
+#include "util/numeric.h"
+#include "debug.h"
+#include <cmath>
 
 std::string gob_cmd_set_properties(const ObjectProperties &prop)
 {
@@ -65,6 +68,109 @@ std::string gob_cmd_update_position(
 	return os.str();
 }
 
+#define GOB_COMPACT_INTERPOLATE 0x01
+#define GOB_COMPACT_MOVEMENT_END 0x02
+#define GOB_COMPACT_VELOCITY 0x04
+#define GOB_COMPACT_ACCELERATION 0x08
+
+// Velocity and acceleration are sent in steps of 0.1
+static void writeV3Compact(std::ostream &os, v3f v)
+{
+	writeS16(os, rangelim(myround(v.X * 10), -32767, 32767));
+	writeS16(os, rangelim(myround(v.Y * 10), -32767, 32767));
+	writeS16(os, rangelim(myround(v.Z * 10), -32767, 32767));
+}
+
+static v3f readV3Compact(std::istream &is)
+{
+	v3f v;
+	v.X = readS16(is) / 10.0;
+	v.Y = readS16(is) / 10.0;
+	v.Z = readS16(is) / 10.0;
+	return v;
+}
+
+std::string gob_cmd_update_position_compact(const std::string &full)
+{
+	std::istringstream is(full, std::ios::binary);
+	u8 cmd = readU8(is);
+	assert(cmd == GENERIC_CMD_UPDATE_POSITION);
+	v3f position = readV3F1000(is);
+	v3f velocity = readV3F1000(is);
+	v3f acceleration = readV3F1000(is);
+	f32 yaw = readF1000(is);
+	bool do_interpolate = readU8(is);
+	bool is_movement_end = readU8(is);
+	f32 update_interval = readF1000(is);
+
+	u8 flags = 0;
+	if(do_interpolate)
+		flags |= GOB_COMPACT_INTERPOLATE;
+	if(is_movement_end)
+		flags |= GOB_COMPACT_MOVEMENT_END;
+	if(velocity != v3f(0,0,0))
+		flags |= GOB_COMPACT_VELOCITY;
+	if(acceleration != v3f(0,0,0))
+		flags |= GOB_COMPACT_ACCELERATION;
+
+	std::ostringstream os(std::ios::binary);
+	// command
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_COMPACT);
+	writeU8(os, flags);
+	writeV3F1000(os, position);
+	if(flags & GOB_COMPACT_VELOCITY)
+		writeV3Compact(os, velocity);
+	if(flags & GOB_COMPACT_ACCELERATION)
+		writeV3Compact(os, acceleration);
+	// yaw in 1/65536 turns; wrapped as an integer, since a yaw just
+	// below 0 or 360 would round to 65536
+	s32 turn = myround(fmod(yaw, 360) / 360 * 65536);
+	writeU16(os, (u16)(((turn % 65536) + 65536) % 65536));
+	// update interval in milliseconds
+	writeU16(os, rangelim(myround(update_interval * 1000), 0, 65535));
+	return os.str();
+}
+
+void gob_read_update_position_compact(std::istream &is,
+	v3f &position,
+	v3f &velocity,
+	v3f &acceleration,
+	f32 &yaw,
+	bool &do_interpolate,
+	bool &is_movement_end,
+	f32 &update_interval
+){
+	u8 flags = readU8(is);
+	do_interpolate = flags & GOB_COMPACT_INTERPOLATE;
+	is_movement_end = flags & GOB_COMPACT_MOVEMENT_END;
+	position = readV3F1000(is);
+	velocity = v3f(0,0,0);
+	if(flags & GOB_COMPACT_VELOCITY)
+		velocity = readV3Compact(is);
+	acceleration = v3f(0,0,0);
+	if(flags & GOB_COMPACT_ACCELERATION)
+		acceleration = readV3Compact(is);
+	yaw = readU16(is) * 360.0 / 65536;
+	update_interval = readU16(is) / 1000.0;
+}
+
+bool gob_cmd_is_superseded_by_same(u8 cmd)
+{
+	switch(cmd){
+	case GENERIC_CMD_SET_PROPERTIES:
+	case GENERIC_CMD_UPDATE_POSITION:
+	case GENERIC_CMD_SET_TEXTURE_MOD:
+	case GENERIC_CMD_SET_SPRITE:
+	case GENERIC_CMD_UPDATE_ARMOR_GROUPS:
+	case GENERIC_CMD_SET_ANIMATION:
+	case GENERIC_CMD_SET_ATTACHMENT:
+		return true;
+	default:
+		// Punches are events, bone positions are per bone
+		return false;
+	}
+}
+
 std::string gob_cmd_set_texture_mod(const std::string &mod)
 {
 	std::ostringstream os(std::ios::binary);
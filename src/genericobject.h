@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define GENERIC_CMD_SET_ANIMATION 6
 #define GENERIC_CMD_SET_BONE_POSITION 7
 #define GENERIC_CMD_SET_ATTACHMENT 8
+#define GENERIC_CMD_UPDATE_POSITION_COMPACT 9
 
 #include "object_properties.h"
 std::string gob_cmd_set_properties(const ObjectProperties &prop);
@@ -48,6 +49,31 @@ std::string gob_cmd_update_position(
 	f32 update_interval
 );
 
+/*
+	GENERIC_CMD_UPDATE_POSITION with the velocity, acceleration, yaw and
+	update interval quantized and zero vectors left out. The server
+	converts the messages made by gob_cmd_update_position() to this for
+	the clients that understand it (protocol version 17 and later).
+*/
+std::string gob_cmd_update_position_compact(const std::string &full);
+// Reads the parameters; the command has already been read from is
+void gob_read_update_position_compact(std::istream &is,
+	v3f &position,
+	v3f &velocity,
+	v3f &acceleration,
+	f32 &yaw,
+	bool &do_interpolate,
+	bool &is_movement_end,
+	f32 &update_interval
+);
+
+/*
+	Returns true if a message of the command replaces everything that
+	earlier messages of the same command have set, so that those don't
+	have to be sent if the later one is.
+*/
+bool gob_cmd_is_superseded_by_same(u8 cmd);
+
 std::string gob_cmd_set_texture_mod(const std::string &mod);
 
 std::string gob_cmd_set_sprite(
@@ -0,0 +1,182 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LIQUIDQUEUE_HEADER
+#define LIQUIDQUEUE_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include "constants.h"
+#include "util/numeric.h"
+#include "util/container.h"
+#include <map>
+#include <list>
+#include "debug.h"
+
+/*
+	Queue of transforming liquid nodes, partitioned by MapBlock.
+
+	Nodes are taken from one block at a time, at most QUANTUM in a row,
+	and the blocks take turns. A big flood in one place then can't
+	keep the liquids elsewhere from flowing.
+
+	Between beginUpdate() and endUpdate(), only the nodes that were
+	queued before the update can be popped. Nodes pushed during it wait
+	for the next update, so each node is handled at most once per update
+	and liquids flow at most one node per update.
+*/
+
+class LiquidQueue
+{
+public:
+	LiquidQueue():
+		m_size(0),
+		m_taken(0),
+		m_updating(false)
+	{}
+
+	/*
+		Does nothing if p is already queued.
+		Return value:
+			true: p added
+			false: p already exists
+	*/
+	bool push_back(v3s16 p)
+	{
+		v3s16 blockpos = getContainerPos(p, MAP_BLOCKSIZE);
+		if(m_updating)
+		{
+			std::map<v3s16, UniqueQueue<v3s16> >::iterator i =
+					m_regions.find(blockpos);
+			if(i != m_regions.end() && i->second.contains(p))
+				return false;
+			return m_next.push_back(p);
+		}
+		return pushRegion(blockpos, p);
+	}
+
+	void beginUpdate()
+	{
+		queueNext();
+		m_updating = true;
+	}
+
+	// Queues the nodes pushed during the update
+	void endUpdate()
+	{
+		m_updating = false;
+		queueNext();
+	}
+
+	// Pops a node queued before the update; updateSize() must be nonzero
+	v3s16 pop_front()
+	{
+		assert(m_size != 0);
+		v3s16 blockpos = m_turns.front();
+		std::map<v3s16, UniqueQueue<v3s16> >::iterator i =
+				m_regions.find(blockpos);
+		assert(i != m_regions.end());
+		v3s16 p = i->second.pop_front();
+		m_size--;
+		m_taken++;
+		if(i->second.size() == 0)
+		{
+			m_regions.erase(i);
+			m_turns.pop_front();
+			m_taken = 0;
+		}
+		else if(m_taken >= QUANTUM)
+		{
+			// Next block's turn
+			m_turns.pop_front();
+			m_turns.push_back(blockpos);
+			m_taken = 0;
+		}
+		return p;
+	}
+
+	// Number of queued nodes, including the ones for the next update
+	u32 size() const
+	{
+		return m_size + m_next.size();
+	}
+
+	// Number of nodes the current update can still pop
+	u32 updateSize() const
+	{
+		return m_size;
+	}
+
+	// Number of blocks that have queued nodes
+	u32 getRegionCount() const
+	{
+		return m_regions.size();
+	}
+
+	// Number of queued nodes in the block that has the most
+	u32 getLongestRegion()
+	{
+		u32 longest = 0;
+		for(std::map<v3s16, UniqueQueue<v3s16> >::iterator
+				i = m_regions.begin(); i != m_regions.end(); ++i)
+			longest = MYMAX(longest, i->second.size());
+		return longest;
+	}
+
+private:
+	bool pushRegion(v3s16 blockpos, v3s16 p)
+	{
+		std::map<v3s16, UniqueQueue<v3s16> >::iterator i =
+				m_regions.find(blockpos);
+		if(i == m_regions.end())
+		{
+			i = m_regions.insert(std::make_pair(blockpos,
+					UniqueQueue<v3s16>())).first;
+			m_turns.push_back(blockpos);
+		}
+		if(!i->second.push_back(p))
+			return false;
+		m_size++;
+		return true;
+	}
+
+	void queueNext()
+	{
+		while(m_next.size() != 0)
+		{
+			v3s16 p = m_next.pop_front();
+			pushRegion(getContainerPos(p, MAP_BLOCKSIZE), p);
+		}
+	}
+
+	static const u32 QUANTUM = 64;
+
+	// Queued nodes of each block; only blocks with queued nodes
+	std::map<v3s16, UniqueQueue<v3s16> > m_regions;
+	// The blocks in the order of their turns; the first one is current
+	std::list<v3s16> m_turns;
+	u32 m_size;
+	// Nodes taken in a row from the current block
+	u32 m_taken;
+	// Nodes pushed during the current update
+	UniqueQueue<v3s16> m_next;
+	bool m_updating;
+};
+
+#endif
+
@@ -75,6 +75,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "subgame.h"
 #include "quicktune.h"
 #include "serverlist.h"
+#include "mapdatabase.h"
+#include "pregenerate.h"
+#include "noise.h"
 
 /*
 	Settings.
@@ -815,6 +818,16 @@ int main(int argc, char *argv[])
 			_("Set logfile path ('' = no logging)"))));
 	allowed_options.insert(std::make_pair("gameid", ValueSpec(VALUETYPE_STRING,
 			_("Set gameid (\"--gameid list\" prints available ones)"))));
+	allowed_options.insert(std::make_pair("migrate", ValueSpec(VALUETYPE_STRING,
+			_("Migrate the map database of the world to another backend"))));
+	allowed_options.insert(std::make_pair("migrate-keys", ValueSpec(VALUETYPE_STRING,
+			_("Convert the keys of map.sqlite to another layout (linear, morton)"))));
+	allowed_options.insert(std::make_pair("benchmark-map-format", ValueSpec(VALUETYPE_STRING,
+			_("Benchmark map block serialization on N blocks of the world (0 = all)"))));
+	allowed_options.insert(std::make_pair("benchmark-noise", ValueSpec(VALUETYPE_FLAG,
+			_("Benchmark the noise maps used by the map generators"))));
+	allowed_options.insert(std::make_pair("pregenerate", ValueSpec(VALUETYPE_STRING,
+			_("Generate the map between two positions (\"x,y,z x,y,z\") and exit"))));
 #ifndef SERVER
 	allowed_options.insert(std::make_pair("speedtests", ValueSpec(VALUETYPE_FLAG,
 			_("Run speed tests"))));
@@ -1019,6 +1032,12 @@ int main(int argc, char *argv[])
 	{
 		run_tests();
 	}
+
+	if(cmd_args.getFlag("benchmark-noise"))
+	{
+		benchmarkNoise(dstream);
+		return 0;
+	}
 	
 	/*
 		Game parameters
@@ -1174,6 +1193,56 @@ int main(int argc, char *argv[])
 		}
 		verbosestream<<_("Using world path")<<" ["<<world_path<<"]"<<std::endl;
 
+		// If migrating the map database, do it and exit
+		if(cmd_args.exists("migrate"))
+		{
+			std::string migrate_to = cmd_args.get("migrate");
+			if(!getWorldExists(world_path))
+			{
+				errorstream<<"World at ["<<world_path<<"] does not exist"
+						<<std::endl;
+				return 1;
+			}
+			return migrateMapDatabase(world_path, migrate_to) ? 0 : 1;
+		}
+		if(cmd_args.exists("migrate-keys"))
+		{
+			if(!getWorldExists(world_path))
+			{
+				errorstream<<"World at ["<<world_path<<"] does not exist"
+						<<std::endl;
+				return 1;
+			}
+			return migrateMapDatabaseKeys(world_path,
+					cmd_args.get("migrate-keys")) ? 0 : 1;
+		}
+		if(cmd_args.exists("benchmark-map-format"))
+		{
+			if(!getWorldExists(world_path))
+			{
+				errorstream<<"World at ["<<world_path<<"] does not exist"
+						<<std::endl;
+				return 1;
+			}
+			u32 max_blocks = mystoi(cmd_args.get("benchmark-map-format"),
+					0, 0x7fffffff);
+			return benchmarkMapBlockFormat(world_path, max_blocks) ? 0 : 1;
+		}
+		v3s16 pregenerate_minp, pregenerate_maxp;
+		bool pregenerate = cmd_args.exists("pregenerate");
+		if(pregenerate)
+		{
+			if(!MapPregenerator::parseArea(cmd_args.get("pregenerate"),
+					&pregenerate_minp, &pregenerate_maxp))
+			{
+				errorstream<<"Invalid area \""<<cmd_args.get("pregenerate")
+						<<"\"; expected \"x,y,z x,y,z\""<<std::endl;
+				return 1;
+			}
+			// Use all the processors unless configured otherwise
+			g_settings->setDefault("num_emerge_threads", "");
+		}
+
 		// We need a gamespec.
 		SubgameSpec gamespec;
 		verbosestream<<_("Determining gameid/gamespec")<<std::endl;
@@ -1219,6 +1288,15 @@ int main(int argc, char *argv[])
 
 		// Create server
 		Server server(world_path, configpath, gamespec, false);
+
+		// If pregenerating the map, do it without networking and exit
+		if(pregenerate)
+		{
+			MapPregenerator pregenerator(&server, pregenerate_minp,
+					pregenerate_maxp);
+			return pregenerator.run(kill) ? 0 : 1;
+		}
+
 		server.start(port);
 		
 		// Run server
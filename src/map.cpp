@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "mapsector.h"
 #include "mapblock.h"
+#include "mapcursor.h"
 #include "main.h"
 #include "filesys.h"
 #include "voxel.h"
@@ -35,24 +36,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "rollback_interface.h"
 #include "emerge.h"
 #include "mapgen_v6.h"
+#include "mapsaver.h"
+#include "mapdatabase.h"
+#include <algorithm>
+#include <vector>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
 /*
-	SQLite format specification:
-	- Initially only replaces sectors/ and sectors2/
+	Blocks are stored through a MapDatabase (see mapdatabase.h).
 
-	If map.sqlite does not exist in the save dir
+	If the database does not exist in the save dir
 	or the block was not found in the database
 	the map will try to load from sectors folder.
-	In either case, map.sqlite will be created
+	In either case, the database will be created
 	and all future saves will save there.
-
-	Structure of map.sqlite:
-	Tables:
-		blocks
-			(PK) INT pos
-			BLOB data
 */
 
 /*
@@ -137,12 +135,7 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
+	return m_block_index.get(p3d);
 }
 
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
@@ -215,7 +208,9 @@ void Map::setNode(v3s16 p, MapNode & n)
 
 
 /*
-	Goes recursively through the neighbours of the node.
+	Goes through the neighbours of the nodes, and on through the
+	neighbours of the neighbours that get altered. The nodes are
+	handled breadth-first from a queue.
 
 	Alters only transparent nodes.
 
@@ -238,164 +233,65 @@ void Map::unspreadLight(enum LightBank bank,
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.size() == 0)
-		return;
-
-	u32 blockchangecount = 0;
-
-	std::map<v3s16, u8> unlighted_nodes;
+	// Nodes whose light was set to 0, with the light they had
+	std::vector<std::pair<v3s16, u8> > queue(
+			from_nodes.begin(), from_nodes.end());
 
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
+	MapCursor cursor(this);
+	// The block last added to modified_blocks
+	MapBlock *modified_last = NULL;
 
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	for(u32 head = 0; head < queue.size(); head++)
 	{
-		v3s16 pos = j->first;
-		v3s16 blockpos = getNodeBlockPos(pos);
+		v3s16 pos = queue[head].first;
+		u8 oldlight = queue[head].second;
 
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if(block->isDummy())
+		if(cursor.getBlock(getNodeBlockPos(pos)) == NULL)
 			continue;
 
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j->second;
-
 		// Loop through 6 neighbors
 		for(u16 i=0; i<6; i++)
 		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
+			v3s16 n2pos = pos + g_6dirs[i];
 
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
+			MapBlock *block = cursor.getBlock(blockpos);
+			if(block == NULL)
+				continue;
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
-
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
-
-				bool changed = false;
-
-				//TODO: Optimize output by optimizing light_sources?
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			MapNode n2 = block->getNodeNoCheck(relpos);
 
-				/*
-					If the neighbor is dimmer than what was specified
-					as oldlight (the light of the previous node)
-				*/
-				if(n2.getLight(bank, nodemgr) < oldlight)
-				{
-					/*
-						And the neighbor is transparent and it has some light
-					*/
-					if(nodemgr->get(n2).light_propagates
-							&& n2.getLight(bank, nodemgr) != 0)
-					{
-						/*
-							Set light to 0 and add to queue
-						*/
-
-						u8 current_light = n2.getLight(bank, nodemgr);
-						n2.setLight(bank, 0, nodemgr);
-						block->setNode(relpos, n2);
-
-						unlighted_nodes[n2pos] = current_light;
-						changed = true;
-
-						/*
-							Remove from light_sources if it is there
-							NOTE: This doesn't happen nearly at all
-						*/
-						/*if(light_sources.find(n2pos))
-						{
-							infostream<<"Removed from light_sources"<<std::endl;
-							light_sources.remove(n2pos);
-						}*/
-					}
+			/*
+				If the neighbor is dimmer than what was specified
+				as oldlight (the light of the previous node), and it is
+				transparent and has some light, set its light to 0 and
+				add it to the queue
+			*/
+			u8 light2 = n2.getLight(bank, nodemgr);
+			if(light2 >= oldlight)
+			{
+				light_sources.insert(n2pos);
+				continue;
+			}
+			if(light2 == 0 || !nodemgr->get(n2).light_propagates)
+				continue;
 
-					/*// DEBUG
-					if(light_sources.find(n2pos) != NULL)
-						light_sources.remove(n2pos);*/
-				}
-				else{
-					light_sources.insert(n2pos);
-				}
+			n2.setLight(bank, 0, nodemgr);
+			block->setNodeNoCheck(relpos, n2);
+			queue.push_back(std::make_pair(n2pos, light2));
 
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
-					{
-						modified_blocks[blockpos] = block;
-					}
-					block_checked_in_modified = true;
-				}
-			}
-			catch(InvalidPositionException &e)
+			if(block != modified_last)
 			{
-				continue;
+				modified_blocks[blockpos] = block;
+				modified_last = block;
 			}
 		}
 	}
-
-	/*infostream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
 }
 
 /*
@@ -413,8 +309,11 @@ void Map::unLightNeighbors(enum LightBank bank,
 }
 
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Lights neighbors of from_nodes, and on through the neighbours that
+	get brighter. The nodes are handled breadth-first from a queue.
+
+	A node can be queued again when it gets brighter after it was
+	handled; it is then handled again with its new light.
 */
 void Map::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes,
@@ -422,143 +321,70 @@ void Map::spreadLight(enum LightBank bank,
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.size() == 0)
-		return;
-
-	u32 blockchangecount = 0;
+	std::vector<v3s16> queue(from_nodes.begin(), from_nodes.end());
 
-	std::set<v3s16> lighted_nodes;
+	MapCursor cursor(this);
+	// The block last added to modified_blocks
+	MapBlock *modified_last = NULL;
 
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(std::set<v3s16>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	for(u32 head = 0; head < queue.size(); head++)
 	{
-		v3s16 pos = *j;
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
+		v3s16 pos = queue[head];
 
-		if(block->isDummy())
+		bool is_valid_position;
+		MapNode n = cursor.getNode(pos, &is_valid_position);
+		if(!is_valid_position)
 			continue;
 
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
-
 		u8 oldlight = n.getLight(bank, nodemgr);
 		u8 newlight = diminish_light(oldlight);
 
 		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++){
+		for(u16 i=0; i<6; i++)
+		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
+			v3s16 n2pos = pos + g_6dirs[i];
 
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
+			MapBlock *block = cursor.getBlock(blockpos);
+			if(block == NULL)
+				continue;
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			MapNode n2 = block->getNodeNoCheck(relpos);
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
-
-				bool changed = false;
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos);
-					changed = true;
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(n2.getLight(bank, nodemgr) < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						block->setNode(relpos, n2);
-						lighted_nodes.insert(n2pos);
-						changed = true;
-					}
-				}
+			u8 light2 = n2.getLight(bank, nodemgr);
 
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
-					{
-						modified_blocks[blockpos] = block;
-					}
-					block_checked_in_modified = true;
-				}
-			}
-			catch(InvalidPositionException &e)
+			/*
+				If the neighbor is brighter than the current node,
+				add to queue (it will light up this node on its turn)
+			*/
+			if(light2 > undiminish_light(oldlight))
 			{
+				queue.push_back(n2pos);
 				continue;
 			}
-		}
-	}
+			/*
+				If the neighbor is dimmer than how much light this node
+				would spread on it, light it and add to queue
+			*/
+			if(light2 >= newlight || !nodemgr->get(n2).light_propagates)
+				continue;
 
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
+			n2.setLight(bank, newlight, nodemgr);
+			block->setNodeNoCheck(relpos, n2);
+			queue.push_back(n2pos);
 
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, modified_blocks);
+			if(block != modified_last)
+			{
+				modified_blocks[blockpos] = block;
+				modified_last = block;
+			}
+		}
+	}
 }
 
 /*
@@ -914,6 +740,8 @@ void Map::updateLighting(std::map<v3s16, MapBlock*> & a_blocks,
 	{
 		MapBlock *block = i->second;
 		block->expireDayNightDiff();
+		// Lighting expands uniform blocks; most end up uniform again
+		block->tryMakeUniform();
 	}
 }
 
@@ -1423,18 +1251,49 @@ bool Map::getDayNightDiff(v3s16 blockpos)
 /*
 	Updates usage timers
 */
+bool Map::unloadBlock(MapSector *sector, MapBlock *block,
+		Profiler &modprofiler)
+{
+	bool saved = false;
+
+	// Save if modified
+	if(block->getModified() != MOD_STATE_CLEAN
+			&& mapType() == MAPTYPE_SERVER)
+	{
+		modprofiler.add(block->getModifiedReason(), 1);
+		saveBlock(block);
+		saved = true;
+	}
+
+	// Delete from memory
+	sector->deleteBlock(block);
+
+	return saved;
+}
+
 void Map::timerUpdate(float dtime, float unload_timeout,
-		std::list<v3s16> *unloaded_blocks)
+		std::list<v3s16> *unloaded_blocks, u32 memory_budget_mb)
 {
 	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
 
+	/*
+		Blocks used during the last seconds are never evicted to meet
+		the memory budget. This covers the active blocks, whose usage
+		timers are reset every second, and blocks being sent.
+	*/
+	const u32 min_evict_age = 5;
+
 	// Profile modified reasons
 	Profiler modprofiler;
 
 	std::list<v2s16> sector_deletion_queue;
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
+	u32 evicted_blocks_count = 0;
 	u32 block_count_all = 0;
+	u64 resident_bytes = 0;
+	// Blocks that may be evicted, keyed by usage timer
+	std::vector<std::pair<u32, MapBlock*> > evictable;
 
 	beginSave();
 	for(std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
@@ -1458,17 +1317,8 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 			{
 				v3s16 p = block->getPos();
 
-				// Save if modified
-				if(block->getModified() != MOD_STATE_CLEAN
-						&& save_before_unloading)
-				{
-					modprofiler.add(block->getModifiedReason(), 1);
-					saveBlock(block);
+				if(unloadBlock(sector, block, modprofiler))
 					saved_blocks_count++;
-				}
-
-				// Delete from memory
-				sector->deleteBlock(block);
 
 				if(unloaded_blocks)
 					unloaded_blocks->push_back(p);
@@ -1479,6 +1329,14 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 			{
 				all_blocks_deleted = false;
 				block_count_all++;
+				resident_bytes += block->getMemoryUsage();
+
+				if(memory_budget_mb != 0 && block->refGet() == 0
+						&& block->getUsageTimer() >= min_evict_age)
+				{
+					evictable.push_back(std::make_pair(
+							block->getUsageTimer(), block));
+				}
 			}
 		}
 
@@ -1486,12 +1344,72 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 		{
 			sector_deletion_queue.push_back(si->first);
 		}
+		else
+		{
+			resident_bytes += sizeof(*sector);
+		}
+	}
+
+	/*
+		Evict the least recently used blocks until the rest fit in
+		the memory budget
+	*/
+	u64 budget_bytes = (u64)memory_budget_mb * 1024 * 1024;
+	if(memory_budget_mb != 0 && resident_bytes > budget_bytes)
+	{
+		// Longest unused first
+		std::sort(evictable.rbegin(), evictable.rend());
+
+		std::set<v2s16> evicted_sectors;
+		for(std::vector<std::pair<u32, MapBlock*> >::iterator
+				i = evictable.begin();
+				i != evictable.end() && resident_bytes > budget_bytes; ++i)
+		{
+			MapBlock *block = i->second;
+			v3s16 p = block->getPos();
+			v2s16 p2d(p.X, p.Z);
+			MapSector *sector = getSectorNoGenerateNoEx(p2d);
+			assert(sector);
+
+			resident_bytes -= block->getMemoryUsage();
+
+			if(unloadBlock(sector, block, modprofiler))
+				saved_blocks_count++;
+
+			if(unloaded_blocks)
+				unloaded_blocks->push_back(p);
+
+			evicted_blocks_count++;
+			deleted_blocks_count++;
+			block_count_all--;
+			evicted_sectors.insert(p2d);
+		}
+
+		// Delete the sectors that were left empty
+		for(std::set<v2s16>::iterator i = evicted_sectors.begin();
+				i != evicted_sectors.end(); ++i)
+		{
+			std::list<MapBlock*> blocks;
+			m_sectors[*i]->getBlocks(blocks);
+			if(blocks.empty())
+			{
+				sector_deletion_queue.push_back(*i);
+				resident_bytes -= sizeof(*m_sectors[*i]);
+			}
+		}
 	}
 	endSave();
 
 	// Finally delete the empty sectors
 	deleteSectors(sector_deletion_queue);
 
+	std::string profiler_prefix = save_before_unloading ?
+			"ServerMap: " : "ClientMap: ";
+	g_profiler->avg(profiler_prefix + "resident blocks (MiB)",
+			(float)resident_bytes / (1024 * 1024));
+	g_profiler->add(profiler_prefix + "blocks evicted",
+			evicted_blocks_count);
+
 	if(deleted_blocks_count != 0)
 	{
 		PrintInfo(infostream); // ServerMap/ClientMap:
@@ -1499,6 +1417,9 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 				<<" blocks from memory";
 		if(save_before_unloading)
 			infostream<<", of which "<<saved_blocks_count<<" were written";
+		if(evicted_blocks_count != 0)
+			infostream<<", "<<evicted_blocks_count<<" evicted to stay within"
+					<<" the memory budget";
 		infostream<<", "<<block_count_all<<" blocks in memory";
 		infostream<<"."<<std::endl;
 		if(saved_blocks_count != 0){
@@ -1609,6 +1530,25 @@ s32 Map::transforming_liquid_size() {
         return m_transforming_liquid.size();
 }
 
+u32 Map::getLiquidTimeBudget()
+{
+	float budget = g_settings->getFloat("liquid_update_time_budget");
+	if(budget <= 0)
+		return 0;
+	return MYMAX(budget * 1000, 1);
+}
+
+void Map::profileLiquids(u32 transformed_count)
+{
+	g_profiler->avg("Map: liquid nodes transformed", transformed_count);
+	g_profiler->avg("Map: liquid queue length",
+			m_transforming_liquid.size());
+	g_profiler->avg("Map: liquid queue blocks",
+			m_transforming_liquid.getRegionCount());
+	g_profiler->avg("Map: liquid queue longest block",
+			m_transforming_liquid.getLongestRegion());
+}
+
 const v3s16 g_7dirs[7] =
 {
 	// +right, +top, +back
@@ -1634,6 +1574,8 @@ void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 
 	u32 loopcount = 0;
 	u32 initial_size = m_transforming_liquid.size();
+	u32 start_ms = porting::getTimeMs();
+	u32 budget_ms = getLiquidTimeBudget();
 
 	u8 relax = g_settings->getS16("liquid_relax");
 	bool fast_flood = g_settings->getS16("liquid_fast_flood");
@@ -1648,10 +1590,19 @@ void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 	// List of MapBlocks that will require a lighting update (due to lava)
 	std::map<v3s16, MapBlock*> lighting_modified_blocks;
 
-	while(m_transforming_liquid.size() > 0)
+	// Setting nodes does not load or unload blocks
+	MapCursor cursor(this);
+
+	// Nodes queued from here on are left for the next update
+	m_transforming_liquid.beginUpdate();
+
+	while(m_transforming_liquid.updateSize() > 0)
 	{
 		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size || loopcount >= 1000)
+		if(loopcount >= initial_size)
+			break;
+		if(budget_ms != 0 && loopcount % 64 == 0 && loopcount != 0
+				&& porting::getTimeMs() - start_ms >= budget_ms)
 			break;
 		loopcount++;
 		/*
@@ -1681,7 +1632,7 @@ void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 			}
 			v3s16 npos = p0 + dirs[i];
 
-			neighbors[i].n = getNodeNoEx(npos);
+			neighbors[i].n = cursor.getNodeNoEx(npos);
 			neighbors[i].t = nt;
 			neighbors[i].p = npos;
 			neighbors[i].l = 0;
@@ -1885,7 +1836,7 @@ void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 			}
 
 			v3s16 blockpos = getNodeBlockPos(p0);
-			MapBlock *block = getBlockNoCreateNoEx(blockpos);
+			MapBlock *block = cursor.getBlock(blockpos);
 			if(block != NULL) {
 				modified_blocks[blockpos] = block;
 				// If node emits light, MapBlock requires lighting update
@@ -1905,7 +1856,9 @@ void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 		m_transforming_liquid.push_back(must_reflow.pop_front());
 	while (must_reflow_second.size() > 0)
 		m_transforming_liquid.push_back(must_reflow_second.pop_front());
+	m_transforming_liquid.endUpdate();
 	updateLighting(lighting_modified_blocks, modified_blocks);
+	profileLiquids(loopcount);
 }
 
 void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
@@ -1920,6 +1873,8 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 
 	u32 loopcount = 0;
 	u32 initial_size = m_transforming_liquid.size();
+	u32 start_ms = porting::getTimeMs();
+	u32 budget_ms = getLiquidTimeBudget();
 
 	/*if(initial_size != 0)
 		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
@@ -1930,10 +1885,19 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	// List of MapBlocks that will require a lighting update (due to lava)
 	std::map<v3s16, MapBlock*> lighting_modified_blocks;
 
-	while(m_transforming_liquid.size() != 0)
+	// Setting nodes does not load or unload blocks
+	MapCursor cursor(this);
+
+	// Nodes queued from here on are left for the next update
+	m_transforming_liquid.beginUpdate();
+
+	while(m_transforming_liquid.updateSize() != 0)
 	{
 		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size || loopcount >= 10000)
+		if(loopcount >= initial_size)
+			break;
+		if(budget_ms != 0 && loopcount % 64 == 0 && loopcount != 0
+				&& porting::getTimeMs() - start_ms >= budget_ms)
 			break;
 		loopcount++;
 
@@ -1942,7 +1906,7 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 		*/
 		v3s16 p0 = m_transforming_liquid.pop_front();
 
-		MapNode n0 = getNodeNoEx(p0);
+		MapNode n0 = cursor.getNodeNoEx(p0);
 
 		/*
 			Collect information about current node
@@ -1992,7 +1956,7 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 					break;
 			}
 			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
+			NodeNeighbor nb = {cursor.getNodeNoEx(npos), nt, npos};
 			switch (nodemgr->get(nb.n.getContent()).liquid_type) {
 				case LIQUID_NONE:
 					if (nb.n.getContent() == CONTENT_AIR) {
@@ -2146,7 +2110,7 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 		}
 
 		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
+		MapBlock *block = cursor.getBlock(blockpos);
 		if(block != NULL) {
 			modified_blocks[blockpos] =  block;
 			// If node emits light, MapBlock requires lighting update
@@ -2178,7 +2142,9 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 	while (must_reflow.size() > 0)
 		m_transforming_liquid.push_back(must_reflow.pop_front());
+	m_transforming_liquid.endUpdate();
 	updateLighting(lighting_modified_blocks, modified_blocks);
+	profileLiquids(loopcount);
 }
 
 NodeMetadata* Map::getNodeMetadata(v3s16 p)
@@ -2295,8 +2261,10 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 	m_seed(0),
 	m_map_metadata_changed(true),
 	m_database(NULL),
-	m_database_read(NULL),
-	m_database_write(NULL)
+	m_saver(NULL),
+	m_prefetch_size(0),
+	m_prefetch_save_counter(0),
+	m_bytes_written(0)
 {
 	verbosestream<<__FUNCTION_NAME<<std::endl;
 
@@ -2330,6 +2298,30 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
 
+	std::string backend = getWorldMapDatabaseBackend(m_savedir);
+	m_database = createMapDatabase(backend, m_savedir);
+	if(m_database == NULL)
+	{
+		errorstream<<"ServerMap: Unknown map database backend \""
+				<<backend<<"\", using "<<MAPDATABASE_DEFAULT_BACKEND
+				<<std::endl;
+		m_database = createMapDatabase(MAPDATABASE_DEFAULT_BACKEND,
+				m_savedir);
+	}
+	infostream<<"ServerMap: Using map database backend "<<backend
+			<<std::endl;
+
+	m_prefetch_mutex.Init();
+	m_bytes_written_mutex.Init();
+	m_prefetch_size = g_settings->getS16("server_map_prefetch_size");
+
+	if(g_settings->getBool("server_map_save_async"))
+	{
+		m_saver = new MapSaveThread(this,
+				g_settings->getU16("server_map_save_queue_limit"));
+		m_saver->Start();
+	}
+
 	try
 	{
 		// If directory exists, check contents and load if possible
@@ -2415,15 +2407,20 @@ ServerMap::~ServerMap()
 				<<", exception: "<<e.what()<<std::endl;
 	}
 
+	/*
+		Write out everything still queued before closing the database
+	*/
+	if(m_saver)
+	{
+		m_saver->stop();
+		delete m_saver;
+		m_saver = NULL;
+	}
+
 	/*
 		Close database if it was opened
 	*/
-	if(m_database_read)
-		sqlite3_finalize(m_database_read);
-	if(m_database_write)
-		sqlite3_finalize(m_database_write);
-	if(m_database)
-		sqlite3_close(m_database);
+	delete m_database;
 
 #if 0
 	/*
@@ -2553,6 +2550,11 @@ bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos)
 	return true;
 }
 
+void ServerMap::prepareBlockMake(BlockMakeData *data)
+{
+	data->vmanip->prepareBlitBack(m_gamedef);
+}
+
 MapBlock* ServerMap::finishBlockMake(BlockMakeData *data,
 		std::map<v3s16, MapBlock*> &changed_blocks)
 {
@@ -2588,7 +2590,7 @@ MapBlock* ServerMap::finishBlockMake(BlockMakeData *data,
 		NOTE: blitBackAll adds nearly everything to changed_blocks
 	*/
 	{
-		// 70ms @cs=8
+		// 70ms @cs=8, unless prepared by prepareBlockMake()
 		//TimeTaker timer("finishBlockMake() blitBackAll");
 		data->vmanip->blitBackAll(&changed_blocks);
 	}
@@ -2664,15 +2666,12 @@ MapBlock* ServerMap::finishBlockMake(BlockMakeData *data,
 	{
 		MapBlock *block = i->second;
 		assert(block);
-		/*
-			Update day/night difference cache of the MapBlocks
-		*/
-		block->expireDayNightDiff();
 		/*
 			Set block as modified
+			(blitBackAll has updated their day/night difference cache)
 		*/
 		block->raiseModified(MOD_STATE_WRITE_NEEDED,
-				"finishBlockMake expireDayNightDiff");
+				"finishBlockMake");
 	}
 
 	/*
@@ -2973,7 +2972,9 @@ MapBlock * ServerMap::emergeBlock(v3s16 p, bool create_blank)
 
 	{
 		MapBlock *block = getBlockNoCreateNoEx(p);
-		if(block && block->isDummy() == false)
+		bool hit = (block && block->isDummy() == false);
+		g_profiler->avg("ServerMap: block cache hit rate", hit ? 1 : 0);
+		if(hit)
 			return block;
 	}
 
@@ -3061,79 +3062,8 @@ s16 ServerMap::findGroundLevel(v2s16 p2d)
 	//return (s16)level;
 }
 
-void ServerMap::createDatabase() {
-	int e;
-	assert(m_database);
-	e = sqlite3_exec(m_database,
-		"CREATE TABLE IF NOT EXISTS `blocks` ("
-			"`pos` INT NOT NULL PRIMARY KEY,"
-			"`data` BLOB"
-		");"
-	, NULL, NULL, NULL);
-	if(e == SQLITE_ABORT)
-		throw FileNotGoodException("Could not create database structure");
-	else
-		infostream<<"ServerMap: Database structure was created";
-}
-
-void ServerMap::verifyDatabase() {
-	if(m_database)
-		return;
-
-	{
-		std::string dbp = m_savedir + DIR_DELIM + "map.sqlite";
-		bool needs_create = false;
-		int d;
-
-		/*
-			Open the database connection
-		*/
-
-		createDirs(m_savedir);
-
-		if(!fs::PathExists(dbp))
-			needs_create = true;
-
-		d = sqlite3_open_v2(dbp.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot open database file");
-		}
-
-		if(needs_create)
-			createDatabase();
-
-		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-
-		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare write statement");
-		}
-
-		d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-
-		infostream<<"ServerMap: Database opened"<<std::endl;
-	}
-}
-
 bool ServerMap::loadFromFolders() {
-	if(!m_database && !fs::PathExists(m_savedir + DIR_DELIM + "map.sqlite"))
-		return true;
-	return false;
-}
-
-sqlite3_int64 ServerMap::getBlockAsInteger(const v3s16 pos) {
-	return (sqlite3_int64)pos.Z*16777216 +
-		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
+	return !m_database->exists();
 }
 
 void ServerMap::createDirs(std::string path)
@@ -3242,7 +3172,7 @@ void ServerMap::save(ModifiedState save_level)
 	u32 block_count = 0;
 	u32 block_count_all = 0; // Number of blocks in memory
 
-	// Don't do anything with sqlite unless something is really saved
+	// Don't do anything with the database unless something is really saved
 	bool save_started = false;
 
 	for(std::map<v2s16, MapSector*>::iterator i = m_sectors.begin();
@@ -3307,32 +3237,6 @@ void ServerMap::save(ModifiedState save_level)
 	}
 }
 
-static s32 unsignedToSigned(s32 i, s32 max_positive)
-{
-	if(i < max_positive)
-		return i;
-	else
-		return i - 2*max_positive;
-}
-
-// modulo of a negative number does not work consistently in C
-static sqlite3_int64 pythonmodulo(sqlite3_int64 i, sqlite3_int64 mod)
-{
-	if(i >= 0)
-		return i % mod;
-	return mod - ((-i) % mod);
-}
-
-v3s16 ServerMap::getIntegerAsBlock(sqlite3_int64 i)
-{
-	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - x) / 4096;
-	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - y) / 4096;
-	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	return v3s16(x,y,z);
-}
-
 void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
 {
 	if(loadFromFolders()){
@@ -3341,18 +3245,18 @@ void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
 	}
 
 	{
-		verifyDatabase();
+		flushSaves();
 
-		while(sqlite3_step(m_database_list) == SQLITE_ROW)
-		{
-			sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
-			v3s16 p = getIntegerAsBlock(block_i);
-			//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
-			dst.push_back(p);
-		}
+		m_database->listAllLoadableBlocks(dst);
 	}
 }
 
+void ServerMap::flushSaves()
+{
+	if(m_saver)
+		m_saver->flush();
+}
+
 void ServerMap::saveMapMeta()
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3606,15 +3510,24 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 #endif
 
 void ServerMap::beginSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+	// The save thread wraps each of its batches in a transaction
+	if(m_saver)
+		return;
+	beginDatabaseSave();
 }
 
 void ServerMap::endSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: endSave() failed, map might not have saved.";
+	if(m_saver)
+		return;
+	endDatabaseSave();
+}
+
+void ServerMap::beginDatabaseSave() {
+	m_database->beginSave();
+}
+
+void ServerMap::endDatabaseSave() {
+	m_database->endSave();
 }
 
 void ServerMap::saveBlock(MapBlock *block)
@@ -3631,6 +3544,34 @@ void ServerMap::saveBlock(MapBlock *block)
 		return;
 	}
 
+	// Whatever was prefetched of the block is outdated now
+	{
+		JMutexAutoLock lock(m_prefetch_mutex);
+		m_prefetched.erase(block->getPos());
+		m_prefetch_save_counter++;
+	}
+
+	if(m_saver)
+	{
+		/*
+			Only take a snapshot here; serialization, compression and
+			writing happen in the save thread. The block is clean from
+			now on from the point of view of the server.
+		*/
+		m_saver->queueBlock(block->createSnapshot());
+		block->resetModified();
+		return;
+	}
+
+	// We just wrote it to the disk so clear modified flag
+	if(writeBlock(block))
+		block->resetModified();
+}
+
+bool ServerMap::writeBlock(MapBlock *block)
+{
+	DSTACK(__FUNCTION_NAME);
+
 	// Format used for writing
 	u8 version = SER_FMT_VER_HIGHEST;
 	// Get destination
@@ -3653,8 +3594,6 @@ void ServerMap::saveBlock(MapBlock *block)
 		[1] data
 	*/
 
-	verifyDatabase();
-
 	std::ostringstream o(std::ios_base::binary);
 
 	o.write((char*)&version, 1);
@@ -3663,31 +3602,18 @@ void ServerMap::saveBlock(MapBlock *block)
 	block->serialize(o, version, true);
 
 	// Write block to database
-
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
-
-	bool success = true;
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK) {
-		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-		success = false;
-	}
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) { // TODO this mught not be the right length
-		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-		success = false;
-	}
-	int written = sqlite3_step(m_database_write);
-	if(written != SQLITE_DONE) {
-		errorstream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
-				<<sqlite3_errmsg(m_database)<<std::endl;
-		success = false;
+	std::string data = o.str();
+	{
+		JMutexAutoLock lock(m_bytes_written_mutex);
+		m_bytes_written += data.size();
 	}
-	// Make ready for later reuse
-	sqlite3_reset(m_database_write);
+	return m_database->saveBlock(p3d, data);
+}
 
-	// We just wrote it to the disk so clear modified flag
-	if (success)
-		block->resetModified();
+u64 ServerMap::getBytesWritten()
+{
+	JMutexAutoLock lock(m_bytes_written_mutex);
+	return m_bytes_written;
 }
 
 void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load)
@@ -3835,44 +3761,130 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 	}
 }
 
+bool ServerMap::loadBlockData(v3s16 blockpos, std::string *data)
+{
+	{
+		JMutexAutoLock lock(m_prefetch_mutex);
+		std::map<v3s16, std::string>::iterator n =
+				m_prefetched.find(blockpos);
+		if(n != m_prefetched.end())
+		{
+			data->swap(n->second);
+			m_prefetched.erase(n);
+			g_profiler->add("ServerMap: prefetch hits", 1);
+			return true;
+		}
+	}
+
+	if(m_prefetch_size < 2 || !m_database->canLoadBlockRange())
+		return m_database->loadBlock(blockpos, data);
+
+	/*
+		Read the whole aligned cube containing the block; the emerge
+		queue is likely to ask for the neighbours next. With Morton
+		keys this is one sequential range of the database.
+	*/
+	v3s16 minp = getContainerPos(blockpos, m_prefetch_size) * m_prefetch_size;
+	v3s16 maxp = minp + v3s16(1,1,1) * (m_prefetch_size - 1);
+
+	/*
+		This may run without the environment lock (see
+		EmergeThread::getBlockOrStartGen), so the map can't be looked
+		at. Neighbours that are saved while they are being read are
+		caught by the save counter instead.
+	*/
+	u32 save_counter;
+	{
+		JMutexAutoLock lock(m_prefetch_mutex);
+		save_counter = m_prefetch_save_counter;
+	}
+
+	// Don't read outdated versions of the neighbours either
+	if(m_saver)
+		m_saver->waitForArea(minp, maxp);
+
+	std::map<v3s16, std::string> blocks;
+	m_database->loadBlockRange(minp, maxp, blocks);
+
+	g_profiler->add("ServerMap: prefetch queries", 1);
+
+	bool found = false;
+	JMutexAutoLock lock(m_prefetch_mutex);
+	bool keep_neighbours = (save_counter == m_prefetch_save_counter);
+	// Don't let blocks that are never asked for pile up
+	if(m_prefetched.size() > 4096)
+		m_prefetched.clear();
+	for(std::map<v3s16, std::string>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		if(i->first == blockpos)
+		{
+			data->swap(i->second);
+			found = true;
+			continue;
+		}
+		if(keep_neighbours)
+			m_prefetched[i->first].swap(i->second);
+	}
+	return found;
+}
+
 MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 {
 	DSTACK(__FUNCTION_NAME);
 
-	v2s16 p2d(blockpos.X, blockpos.Z);
+	std::string data;
+	if(readBlockData(blockpos, &data))
+		return loadBlockFromData(blockpos, &data);
 
-	if(!loadFromFolders()) {
-		verifyDatabase();
+	// Not found in database, try the files
+	return loadBlockFromFiles(blockpos);
+}
 
-		if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
-			infostream<<"WARNING: Could not bind block position for load: "
-				<<sqlite3_errmsg(m_database)<<std::endl;
-		if(sqlite3_step(m_database_read) == SQLITE_ROW) {
-			/*
-				Make sure sector is loaded
-			*/
-			MapSector *sector = createSector(p2d);
+bool ServerMap::readBlockData(v3s16 blockpos, std::string *data)
+{
+	// Don't read an outdated version of a block that is still queued
+	if(m_saver)
+		m_saver->waitForBlock(blockpos);
 
-			/*
-				Load block
-			*/
-			const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
-			size_t len = sqlite3_column_bytes(m_database_read, 0);
+	if(loadFromFolders())
+		return false;
+
+	try {
+		return loadBlockData(blockpos, data);
+	}
+	catch(SerializationError &e)
+	{
+		if(!g_settings->getBool("ignore_world_load_errors"))
+			throw;
+		errorstream<<"Ignoring block load error. Duck and cover! "
+				<<"(ignore_world_load_errors)"<<std::endl;
+	}
+	return false;
+}
 
-			std::string datastr(data, len);
+MapBlock* ServerMap::loadBlockFromData(v3s16 blockpos, std::string *data)
+{
+	v2s16 p2d(blockpos.X, blockpos.Z);
 
-			loadBlock(&datastr, blockpos, sector, false);
+	/*
+		Make sure sector is loaded
+	*/
+	MapSector *sector = createSector(p2d);
 
-			sqlite3_step(m_database_read);
-			// We should never get more than 1 row, so ok to reset
-			sqlite3_reset(m_database_read);
+	/*
+		Load block
+	*/
+	loadBlock(data, blockpos, sector, false);
 
-			return getBlockNoCreateNoEx(blockpos);
-		}
-		sqlite3_reset(m_database_read);
+	return getBlockNoCreateNoEx(blockpos);
+}
 
-		// Not found in database, try the files
-	}
+MapBlock* ServerMap::loadBlockFromFiles(v3s16 blockpos)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v2s16 p2d(blockpos.X, blockpos.Z);
 
 	// The directory layout we're going to load from.
 	//  1 - original sectors/xxxxzzzz/
@@ -4101,6 +4113,10 @@ ManualMapVoxelManipulator::ManualMapVoxelManipulator(Map *map):
 
 ManualMapVoxelManipulator::~ManualMapVoxelManipulator()
 {
+	for(std::map<v3s16, MapBlock*>::iterator
+			i = m_prepared_blocks.begin();
+			i != m_prepared_blocks.end(); ++i)
+		delete i->second;
 }
 
 void ManualMapVoxelManipulator::emerge(VoxelArea a, s32 caller_id)
@@ -4186,6 +4202,24 @@ void ManualMapVoxelManipulator::initialEmerge(
 	}
 }
 
+void ManualMapVoxelManipulator::prepareBlitBack(IGameDef *gamedef)
+{
+	for(std::map<v3s16, u8>::iterator
+			i = m_loaded_blocks.begin();
+			i != m_loaded_blocks.end(); ++i)
+	{
+		v3s16 p = i->first;
+		bool existed = !(i->second & VMANIP_BLOCK_DATA_INEXIST);
+		if(existed == false || m_prepared_blocks.count(p) != 0)
+			continue;
+
+		MapBlock *block = new MapBlock(NULL, p, gamedef);
+		block->copyFrom(*this);
+		block->actuallyUpdateDayNightDiff();
+		m_prepared_blocks[p] = block;
+	}
+}
+
 void ManualMapVoxelManipulator::blitBackAll(
 		std::map<v3s16, MapBlock*> * modified_blocks)
 {
@@ -4207,7 +4241,17 @@ void ManualMapVoxelManipulator::blitBackAll(
 			continue;
 		}
 
-		block->copyFrom(*this);
+		std::map<v3s16, MapBlock*>::iterator j = m_prepared_blocks.find(p);
+		if(j != m_prepared_blocks.end())
+		{
+			// The detached block gets the old nodes, to be freed later
+			block->swapNodes(*j->second);
+		}
+		else
+		{
+			block->copyFrom(*this);
+			block->expireDayNightDiff();
+		}
 
 		if(modified_blocks)
 			(*modified_blocks)[p] = block;
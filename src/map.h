@@ -37,10 +37,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "modifiedstate.h"
 #include "util/container.h"
 #include "nodetimer.h"
-
-extern "C" {
-	#include "sqlite3.h"
-}
+#include "mapblockindex.h"
+#include "liquidqueue.h"
 
 class ClientMap;
 class MapSector;
@@ -51,6 +49,9 @@ class IGameDef;
 class IRollbackReportSink;
 class EmergeManager;
 class BlockMakeData;
+class MapSaveThread;
+class MapDatabase;
+class Profiler;
 
 
 /*
@@ -275,9 +276,13 @@ class Map /*: public NodeContainer*/
 	/*
 		Updates usage timers and unloads unused blocks and sectors.
 		Saves modified blocks before unloading on MAPTYPE_SERVER.
+		If memory_budget_mb is not 0 and the loaded blocks use more
+		memory than that, the least recently used unreferenced blocks
+		are unloaded until they fit.
 	*/
 	void timerUpdate(float dtime, float unload_timeout,
-			std::list<v3s16> *unloaded_blocks=NULL);
+			std::list<v3s16> *unloaded_blocks=NULL,
+			u32 memory_budget_mb=0);
 
 	// Deletes sectors and their blocks from memory
 	// Takes cache into account
@@ -331,6 +336,16 @@ class Map /*: public NodeContainer*/
 	s32 transforming_liquid_size();
 
 protected:
+	// Time transformLiquids may take in ms, 0 = no limit; each call
+	// still handles every queued node at most once
+	u32 getLiquidTimeBudget();
+	// Records the liquid queue and the work done to the profiler
+	void profileLiquids(u32 transformed_count);
+
+	// Saves the block if needed and deletes it from its sector.
+	// Returns true if the block was saved.
+	bool unloadBlock(MapSector *sector, MapBlock *block,
+			Profiler &modprofiler);
 
 	std::ostream &m_dout; // A bit deprecated, could be removed
 
@@ -344,8 +359,15 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	/*
+		All blocks of all sectors by position, for fast lookups.
+		The sectors own the blocks and keep this up to date.
+	*/
+	friend class MapSector;
+	MapBlockIndex m_block_index;
+
 	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	LiquidQueue m_transforming_liquid;
 };
 
 /*
@@ -378,8 +400,12 @@ class ServerMap : public Map
 
 	/*
 		Blocks are generated by using these and makeBlock().
+
+		prepareBlockMake() is optional; it moves work from
+		finishBlockMake() to be done without the environment lock.
 	*/
 	bool initBlockMake(BlockMakeData *data, v3s16 blockpos);
+	void prepareBlockMake(BlockMakeData *data);
 	MapBlock *finishBlockMake(BlockMakeData *data,
 			std::map<v3s16, MapBlock*> &changed_blocks);
 
@@ -417,24 +443,23 @@ class ServerMap : public Map
 	/*
 		Database functions
 	*/
-	// Create the database structure
-	void createDatabase();
-	// Verify we can read/write to the database
-	void verifyDatabase();
-	// Get an integer suitable for a block
-	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
-	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
-
-	// Returns true if the database file does not exist
+	// Returns true if the database does not exist
 	bool loadFromFolders();
 
 	// Call these before and after saving of blocks
+	// (no-ops when blocks are saved by the MapSaveThread)
 	void beginSave();
 	void endSave();
 
+	// Transaction control for the database itself
+	void beginDatabaseSave();
+	void endDatabaseSave();
+
 	void save(ModifiedState save_level);
 	//void loadAll();
 	void listAllLoadableBlocks(std::list<v3s16> &dst);
+	// Waits until the blocks queued to the MapSaveThread are written
+	void flushSaves();
 	// Saves map seed and possibly other stuff
 	void saveMapMeta();
 	void loadMapMeta();
@@ -458,10 +483,27 @@ class ServerMap : public Map
 	// Returns true if sector now resides in memory
 	//bool deFlushSector(v2s16 p2d);
 
+	// Queues a snapshot to the MapSaveThread if it is enabled,
+	// otherwise writes the block right away
 	void saveBlock(MapBlock *block);
+	// Serializes and writes the block to the database.
+	// Returns true on success. Also called from the MapSaveThread.
+	bool writeBlock(MapBlock *block);
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
+	/*
+		loadBlock(p) in steps, so that the database can be read
+		without holding the environment lock:
+		- readBlockData() only touches the database and is safe to
+		  call from any thread. Returns false if the block is not in
+		  the database.
+		- loadBlockFromData() and loadBlockFromFiles() put the block
+		  into the map; they return NULL if it could not be loaded.
+	*/
+	bool readBlockData(v3s16 p, std::string *data);
+	MapBlock* loadBlockFromData(v3s16 p, std::string *data);
+	MapBlock* loadBlockFromFiles(v3s16 p);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
@@ -470,6 +512,9 @@ class ServerMap : public Map
 
 	bool isSavingEnabled(){ return m_map_saving_enabled; }
 
+	// Amount of serialized block data written by writeBlock()
+	u64 getBytesWritten();
+
 	u64 getSeed(){ return m_seed; }
 
 	MapgenParams *getMapgenParams(){ return m_mgparams; }
@@ -500,13 +545,30 @@ class ServerMap : public Map
 	*/
 	bool m_map_metadata_changed;
 
+	// Storage backend, selected by world.mt
+	MapDatabase *m_database;
+
+	// Write-behind saver; NULL if blocks are saved synchronously
+	MapSaveThread *m_saver;
+
 	/*
-		SQLite database and statements
+		Blocks read from the database along with a requested neighbour
+		(see loadBlockData). An entry is dropped when the block is
+		loaded or saved.
 	*/
-	sqlite3 *m_database;
-	sqlite3_stmt *m_database_read;
-	sqlite3_stmt *m_database_write;
-	sqlite3_stmt *m_database_list;
+	std::map<v3s16, std::string> m_prefetched;
+	JMutex m_prefetch_mutex;
+	// Edge length of the prefetched cube; < 2 disables prefetching
+	s16 m_prefetch_size;
+	// Incremented by every saveBlock(); prefetched neighbours read
+	// while a save was queued may be outdated and are dropped
+	u32 m_prefetch_save_counter;
+
+	u64 m_bytes_written;
+	JMutex m_bytes_written_mutex;
+
+	// Reads a block from the database, prefetching its neighbourhood
+	bool loadBlockData(v3s16 p, std::string *data);
 };
 
 #define VMANIP_BLOCK_DATA_INEXIST     1
@@ -550,11 +612,21 @@ class ManualMapVoxelManipulator : public MapVoxelManipulator
 
 	void initialEmerge(v3s16 blockpos_min, v3s16 blockpos_max);
 
+	/*
+		Copies the existing blocks into detached blocks and updates
+		their day/night difference. Doesn't touch the map, so this can
+		be done without the environment lock; blitBackAll() then only
+		swaps the prepared nodes in. Call blitBackAll() once after this.
+	*/
+	void prepareBlitBack(IGameDef *gamedef);
+
 	// This is much faster with big chunks of generated data
 	void blitBackAll(std::map<v3s16, MapBlock*> * modified_blocks);
 
 protected:
 	bool m_create_area;
+	// Detached blocks made by prepareBlitBack()
+	std::map<v3s16, MapBlock*> m_prepared_blocks;
 };
 
 #endif
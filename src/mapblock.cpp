@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <algorithm>
 #include "map.h"
 // For g_settings
 #include "main.h"
@@ -61,6 +62,7 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_refcount(0)
 {
 	data = NULL;
+	m_uniform = false;
 	if(dummy == false)
 		reallocate();
 	
@@ -88,6 +90,122 @@ MapBlock::~MapBlock()
 		delete[] data;
 }
 
+void MapBlock::expandUniform()
+{
+	assert(isUniform());
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	data = new MapNode[nodecount];
+	for(u32 i=0; i<nodecount; i++)
+		data[i] = m_uniform_node;
+	m_uniform = false;
+}
+
+bool MapBlock::tryMakeUniform()
+{
+	if(data == NULL)
+		return m_uniform;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	for(u32 i=1; i<nodecount; i++)
+	{
+		if(!(data[i] == data[0]))
+			return false;
+	}
+	m_uniform_node = data[0];
+	m_uniform = true;
+	delete[] data;
+	data = NULL;
+	return true;
+}
+
+bool MapBlock::containsContent(content_t c)
+{
+	for(u32 i=0; i<m_content_counts.size(); i++)
+	{
+		if(m_content_counts[i].content == c)
+			return true;
+	}
+	return false;
+}
+
+bool MapBlock::containsAnyContent(const std::set<content_t> &contents)
+{
+	for(u32 i=0; i<m_content_counts.size(); i++)
+	{
+		if(contents.count(m_content_counts[i].content) != 0)
+			return true;
+	}
+	return false;
+}
+
+void MapBlock::getContents(std::vector<content_t> &dst)
+{
+	for(u32 i=0; i<m_content_counts.size(); i++)
+		dst.push_back(m_content_counts[i].content);
+}
+
+void MapBlock::changeContentCount(content_t from, content_t to)
+{
+	bool to_found = false;
+	for(u32 i=0; i<m_content_counts.size(); i++)
+	{
+		ContentCount &cc = m_content_counts[i];
+		if(cc.content == to)
+		{
+			cc.count++;
+			to_found = true;
+		}
+		else if(cc.content == from && --cc.count == 0)
+		{
+			// Order doesn't matter; fill the hole with the last one
+			cc = m_content_counts.back();
+			m_content_counts.pop_back();
+			i--;
+		}
+	}
+	if(!to_found)
+	{
+		ContentCount cc = {to, 1};
+		m_content_counts.push_back(cc);
+	}
+}
+
+void MapBlock::recountContents()
+{
+	m_content_counts.clear();
+	if(isDummy())
+		return;
+	if(isUniform())
+	{
+		ContentCount cc = {m_uniform_node.getContent(),
+				MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE};
+		m_content_counts.push_back(cc);
+		return;
+	}
+	// Runs of equal content are common; count them in one go
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	u32 i = 0;
+	while(i < nodecount)
+	{
+		content_t c = data[i].getContent();
+		u32 run = 1;
+		while(i + run < nodecount && data[i + run].getContent() == c)
+			run++;
+		i += run;
+		u32 j = 0;
+		for(; j<m_content_counts.size(); j++)
+		{
+			if(m_content_counts[j].content == c)
+				break;
+		}
+		if(j == m_content_counts.size())
+		{
+			ContentCount cc = {c, 0};
+			m_content_counts.push_back(cc);
+		}
+		m_content_counts[j].count += run;
+	}
+}
+
 bool MapBlock::isValidPositionParent(v3s16 p)
 {
 	if(isValidPosition(p))
@@ -107,9 +225,7 @@ MapNode MapBlock::getNodeParent(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return getNodeNoCheck(p.X, p.Y, p.Z);
 	}
 }
 
@@ -121,9 +237,10 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	}
 	else
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		MapNode &old = getNodeRef(p.X, p.Y, p.Z);
+		if(old.getContent() != n.getContent())
+			changeContentCount(old.getContent(), n.getContent());
+		old = n;
 	}
 }
 
@@ -141,11 +258,11 @@ MapNode MapBlock::getNodeParentNoEx(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 		{
 			return MapNode(CONTENT_IGNORE);
 		}
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return getNodeNoCheck(p.X, p.Y, p.Z);
 	}
 }
 
@@ -175,6 +292,9 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 
 	// Whether the sunlight at the top of the bottom block is valid
 	bool block_below_is_valid = true;
+
+	// getNodeRef() expands uniform blocks; compact them again afterwards
+	bool was_uniform = isUniform();
 	
 	v3s16 pos_relative = getPosRelative();
 	
@@ -335,6 +455,9 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 		}
 	}
 
+	if(was_uniform)
+		tryMakeUniform();
+
 	return block_below_is_valid;
 }
 
@@ -344,6 +467,12 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
+	if(isUniform())
+	{
+		dst.copyFromUniform(m_uniform_node, getPosRelative(), data_size);
+		return;
+	}
+
 	// Copy from data to VoxelManipulator
 	dst.copyFrom(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
@@ -354,9 +483,29 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
+	if(isUniform())
+		expandUniform();
+
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	// Most generated blocks are all air or all stone
+	tryMakeUniform();
+	recountContents();
+}
+
+void MapBlock::swapNodes(MapBlock &other)
+{
+	std::swap(data, other.data);
+	std::swap(m_uniform, other.m_uniform);
+	std::swap(m_uniform_node, other.m_uniform_node);
+	m_content_counts.swap(other.m_content_counts);
+	std::swap(m_day_night_differs, other.m_day_night_differs);
+	std::swap(m_day_night_differs_expired, other.m_day_night_differs_expired);
+
+	raiseModified(MOD_STATE_WRITE_NEEDED, "swapNodes");
+	other.raiseModified(MOD_STATE_WRITE_NEEDED, "swapNodes");
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -365,12 +514,21 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
 	}
 
+	if(isUniform())
+	{
+		MapNode &n = m_uniform_node;
+		m_day_night_differs = n.getContent() != CONTENT_AIR &&
+				n.getLight(LIGHTBANK_DAY, nodemgr) !=
+				n.getLight(LIGHTBANK_NIGHT, nodemgr);
+		return;
+	}
+
 	bool differs = false;
 
 	/*
@@ -414,7 +572,7 @@ void MapBlock::expireDayNightDiff()
 {
 	//INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -432,7 +590,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeNoCheck(p2d.X, y, p2d.Y);
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -495,6 +653,21 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 				<<"Name for node id "<<(*i)<<" not known"<<std::endl;
 	}
 }
+// Same for blocks in the palette format (version >= 26), in which the
+// ids are the palette indices.
+static void getPaletteNodeIdMapping(NameIdMapping *nimap,
+		const std::vector<content_t> &palette, INodeDefManager *nodedef)
+{
+	for(u32 i=0; i<palette.size(); i++)
+	{
+		const ContentFeatures &f = nodedef->get(palette[i]);
+		if(f.name == "")
+			errorstream<<"getPaletteNodeIdMapping(): IGNORING ERROR: "
+					<<"Name for node id "<<palette[i]<<" not known"<<std::endl;
+		else
+			nimap->set(i, f.name);
+	}
+}
 // Correct ids in the block to match nodedef based on names.
 // Unknown ones are added to nodedef.
 // Will not update itself to match id-name pairs in nodedef.
@@ -508,9 +681,16 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	// correct ids.
 	std::set<content_t> unnamed_contents;
 	std::set<std::string> unallocatable_contents;
+	// Blocks have only a few different ids; look each up only once
+	std::map<content_t, content_t> corrected;
 	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 	{
 		content_t local_id = nodes[i].getContent();
+		std::map<content_t, content_t>::iterator c = corrected.find(local_id);
+		if(c != corrected.end()){
+			nodes[i].setContent(c->second);
+			continue;
+		}
 		std::string name;
 		bool found = nimap->getName(local_id, name);
 		if(!found){
@@ -526,6 +706,7 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 				continue;
 			}
 		}
+		corrected[local_id] = global_id;
 		nodes[i].setContent(global_id);
 	}
 	for(std::set<content_t>::const_iterator
@@ -549,7 +730,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -577,11 +758,32 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	*/
 	NameIdMapping nimap;
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-	if(disk)
+	// Older versions need the full node array
+	std::vector<MapNode> uniform_nodes;
+	MapNode *nodes = data;
+	if(isUniform() && version < 26)
+	{
+		uniform_nodes.resize(nodecount, m_uniform_node);
+		nodes = &uniform_nodes[0];
+	}
+	if(version >= 26)
+	{
+		// On disk, the palette holds indices into nimap
+		std::vector<content_t> palette;
+		if(isUniform())
+			MapNode::serializeBulkUniform(os, m_uniform_node, disk,
+					&palette);
+		else
+			MapNode::serializeBulkPalette(os, data, nodecount, &palette,
+					disk);
+		if(disk)
+			getPaletteNodeIdMapping(&nimap, palette, m_gamedef->ndef());
+	}
+	else if(disk)
 	{
 		MapNode *tmp_nodes = new MapNode[nodecount];
 		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
+			tmp_nodes[i] = nodes[i];
 		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
 
 		u8 content_width = 2;
@@ -598,7 +800,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		u8 params_width = 2;
 		writeU8(os, content_width);
 		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
+		MapNode::serializeBulk(os, version, nodes, nodecount,
 				content_width, params_width, true);
 	}
 	
@@ -635,6 +837,35 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	}
 }
 
+MapBlock * MapBlock::createSnapshot()
+{
+	MapBlock *block = new MapBlock(m_parent, m_pos, m_gamedef, true);
+
+	if(data != NULL)
+	{
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		block->data = new MapNode[nodecount];
+		std::copy(data, data + nodecount, block->data);
+	}
+	block->m_uniform = m_uniform;
+	block->m_uniform_node = m_uniform_node;
+	block->m_content_counts = m_content_counts;
+
+	block->is_underground = is_underground;
+	block->m_lighting_expired = m_lighting_expired;
+	block->m_day_night_differs = m_day_night_differs;
+	block->m_day_night_differs_expired = m_day_night_differs_expired;
+	block->m_generated = m_generated;
+	block->m_timestamp = m_timestamp;
+	block->m_disk_timestamp = m_disk_timestamp;
+
+	block->m_node_metadata.copyFrom(m_node_metadata);
+	block->m_node_timers = m_node_timers;
+	block->m_static_objects = m_static_objects;
+
+	return block;
+}
+
 void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
@@ -644,9 +875,18 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 
 	m_day_night_differs_expired = false;
 
+	// The nodes are read into a full array
+	if(data == NULL)
+	{
+		data = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		m_uniform = false;
+	}
+
 	if(version <= 21)
 	{
 		deSerialize_pre22(is, version, disk);
+		tryMakeUniform();
+		recountContents();
 		return;
 	}
 
@@ -662,14 +902,21 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Bulk node data"<<std::endl);
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-	u8 content_width = readU8(is);
-	u8 params_width = readU8(is);
-	if(content_width != 1 && content_width != 2)
-		throw SerializationError("MapBlock::deSerialize(): invalid content_width");
-	if(params_width != 2)
-		throw SerializationError("MapBlock::deSerialize(): invalid params_width");
-	MapNode::deSerializeBulk(is, version, data, nodecount,
-			content_width, params_width, true);
+	if(version >= 26)
+	{
+		MapNode::deSerializeBulkPalette(is, data, nodecount);
+	}
+	else
+	{
+		u8 content_width = readU8(is);
+		u8 params_width = readU8(is);
+		if(content_width != 1 && content_width != 2)
+			throw SerializationError("MapBlock::deSerialize(): invalid content_width");
+		if(params_width != 2)
+			throw SerializationError("MapBlock::deSerialize(): invalid params_width");
+		MapNode::deSerializeBulk(is, version, data, nodecount,
+				content_width, params_width, true);
+	}
 
 	/*
 		NodeMetadata
@@ -736,6 +983,9 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		}
 	}
 		
+	tryMakeUniform();
+	recountContents();
+
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Done."<<std::endl);
 }
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <jmutexautolock.h>
 #include <exception>
 #include <set>
+#include <vector>
 #include "debug.h"
 #include "irrlichttypes.h"
 #include "irr_v3d.h"
@@ -123,26 +124,59 @@ class MapBlock /*: public NodeContainer*/
 		return m_parent;
 	}
 
+	// Fills the block with CONTENT_IGNORE (in the uniform form)
 	void reallocate()
 	{
 		if(data != NULL)
 			delete[] data;
-		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
-		data = new MapNode[l];
-		for(u32 i=0; i<l; i++){
-			//data[i] = MapNode();
-			data[i] = MapNode(CONTENT_IGNORE);
-		}
+		data = NULL;
+		m_uniform = true;
+		m_uniform_node = MapNode(CONTENT_IGNORE);
+		recountContents();
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
+	/*
+		Uniform blocks
+
+		A block whose nodes are all the same is stored as a single
+		node instead of a node array. It is expanded on the first
+		write of a different node.
+	*/
+
+	bool isUniform()
+	{
+		return (data == NULL && m_uniform);
+	}
+	// Only valid if isUniform()
+	MapNode getUniformNode()
+	{
+		return m_uniform_node;
+	}
+	// Switches to the uniform form if all nodes are the same.
+	// Returns isUniform().
+	bool tryMakeUniform();
+
+	/*
+		Contents of the block
+
+		The number of nodes of each content is kept up to date by
+		setNode and when the whole block is written. Lets searches
+		skip blocks that can't contain what is searched for.
+	*/
+
+	bool containsContent(content_t c);
+	bool containsAnyContent(const std::set<content_t> &contents);
+	// Appends the contents of the block to dst
+	void getContents(std::vector<content_t> &dst);
+
 	/*
 		Flags
 	*/
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && !m_uniform);
 	}
 	void unDummify()
 	{
@@ -226,7 +260,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -259,7 +293,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	bool isValidPosition(v3s16 p)
 	{
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return (p.X >= 0 && p.X < MAP_BLOCKSIZE
 				&& p.Y >= 0 && p.Y < MAP_BLOCKSIZE
@@ -268,12 +302,10 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNode(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return getNodeNoCheck(x, y, z);
 	}
 	
 	MapNode getNode(v3s16 p)
@@ -292,13 +324,10 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
-		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
+		setNodeNoCheck(x, y, z, n);
 	}
 	
 	void setNode(v3s16 p, MapNode & n)
@@ -313,7 +342,11 @@ class MapBlock /*: public NodeContainer*/
 	MapNode getNodeNoCheck(s16 x, s16 y, s16 z)
 	{
 		if(data == NULL)
-			throw InvalidPositionException();
+		{
+			if(!m_uniform)
+				throw InvalidPositionException();
+			return m_uniform_node;
+		}
 		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
 	}
 	
@@ -325,8 +358,20 @@ class MapBlock /*: public NodeContainer*/
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
 		if(data == NULL)
-			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		{
+			if(!m_uniform)
+				throw InvalidPositionException();
+			if(n == m_uniform_node)
+			{
+				raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
+				return;
+			}
+			expandUniform();
+		}
+		MapNode &old = data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		if(old.getContent() != n.getContent())
+			changeContentCount(old.getContent(), n.getContent());
+		old = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -360,6 +405,12 @@ class MapBlock /*: public NodeContainer*/
 	void copyTo(VoxelManipulator &dst);
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
+	/*
+		Exchanges the nodes, and what is cached about them, with
+		another block. Nodes prepared in a detached block can be put
+		in the map with this without copying.
+	*/
+	void swapNodes(MapBlock &other);
 
 	/*
 		Update day-night lighting difference flag.
@@ -432,6 +483,18 @@ class MapBlock /*: public NodeContainer*/
 		return m_usage_timer;
 	}
 
+	/*
+		Approximate heap memory used by the block (the node array
+		dominates; metadata and static objects are not counted)
+	*/
+	u32 getMemoryUsage()
+	{
+		u32 bytes = sizeof(MapBlock);
+		if(data != NULL)
+			bytes += MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE * sizeof(MapNode);
+		return bytes;
+	}
+
 	/*
 		See m_refcount
 	*/
@@ -479,6 +542,14 @@ class MapBlock /*: public NodeContainer*/
 	// unknown blocks from id-name mapping to wndef
 	void deSerialize(std::istream &is, u8 version, bool disk);
 
+	/*
+		Returns a detached copy of everything that serialize() writes to
+		disk (nodes, metadata, static objects, timers and flags).
+		The copy can be serialized in another thread while this block
+		keeps being modified. Caller takes ownership.
+	*/
+	MapBlock * createSnapshot();
+
 private:
 	/*
 		Private methods
@@ -486,6 +557,14 @@ class MapBlock /*: public NodeContainer*/
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
+	// Allocates data and fills it with the uniform node
+	void expandUniform();
+
+	// Moves one node from content from to content to in m_content_counts
+	void changeContentCount(content_t from, content_t to);
+	// Rebuilds m_content_counts from the nodes
+	void recountContents();
+
 	/*
 		Used only internally, because changes can't be tracked
 	*/
@@ -493,7 +572,11 @@ class MapBlock /*: public NodeContainer*/
 	MapNode & getNodeRef(s16 x, s16 y, s16 z)
 	{
 		if(data == NULL)
-			throw InvalidPositionException();
+		{
+			if(!m_uniform)
+				throw InvalidPositionException();
+			expandUniform();
+		}
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
@@ -531,10 +614,22 @@ class MapBlock /*: public NodeContainer*/
 	IGameDef *m_gamedef;
 	
 	/*
-		If NULL, block is a dummy block.
+		If NULL, block is a dummy block or a uniform block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode * data;
+	// If true and data is NULL, all nodes are m_uniform_node
+	bool m_uniform;
+	MapNode m_uniform_node;
+
+	// Contents in the block and their node counts; a block has only
+	// a few contents, so this is searched linearly
+	struct ContentCount
+	{
+		content_t content;
+		u16 count;
+	};
+	std::vector<ContentCount> m_content_counts;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -0,0 +1,170 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPBLOCKINDEX_HEADER
+#define MAPBLOCKINDEX_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <vector>
+#include "debug.h"
+
+class MapBlock;
+
+/*
+	Hash table from block positions to loaded blocks.
+
+	Open addressing with linear probing; removal shifts the following
+	entries back so no tombstones are needed. The table is kept at
+	most half full, so a lookup usually touches one or two slots.
+*/
+
+class MapBlockIndex
+{
+public:
+	MapBlockIndex():
+		m_count(0)
+	{
+		m_slots.resize(MIN_CAPACITY);
+	}
+
+	MapBlock * get(v3s16 p) const
+	{
+		u32 mask = m_slots.size() - 1;
+		for(u32 i = hash(p) & mask;; i = (i + 1) & mask)
+		{
+			const Slot &slot = m_slots[i];
+			if(slot.block == NULL)
+				return NULL;
+			if(slot.p == p)
+				return slot.block;
+		}
+	}
+
+	// Replaces an existing entry of the same position
+	void insert(v3s16 p, MapBlock *block)
+	{
+		assert(block != NULL);
+		if((m_count + 1) * 2 > m_slots.size())
+			rehash(m_slots.size() * 2);
+		u32 mask = m_slots.size() - 1;
+		for(u32 i = hash(p) & mask;; i = (i + 1) & mask)
+		{
+			Slot &slot = m_slots[i];
+			if(slot.block == NULL)
+			{
+				slot.p = p;
+				slot.block = block;
+				m_count++;
+				return;
+			}
+			if(slot.p == p)
+			{
+				slot.block = block;
+				return;
+			}
+		}
+	}
+
+	void remove(v3s16 p)
+	{
+		u32 mask = m_slots.size() - 1;
+		u32 i = hash(p) & mask;
+		for(;; i = (i + 1) & mask)
+		{
+			if(m_slots[i].block == NULL)
+				return;
+			if(m_slots[i].p == p)
+				break;
+		}
+		m_count--;
+
+		// Move back entries whose probe sequence passes the hole
+		u32 hole = i;
+		for(u32 j = (i + 1) & mask; m_slots[j].block != NULL;
+				j = (j + 1) & mask)
+		{
+			u32 home = hash(m_slots[j].p) & mask;
+			// Distance from the home slot; the entry can fill the hole
+			// if the hole is no further from home than the entry itself
+			if(((hole - home) & mask) < ((j - home) & mask))
+			{
+				m_slots[hole] = m_slots[j];
+				hole = j;
+			}
+		}
+		m_slots[hole] = Slot();
+
+		if(m_slots.size() > MIN_CAPACITY && m_count * 8 < m_slots.size())
+			rehash(m_slots.size() / 2);
+	}
+
+	u32 size() const
+	{
+		return m_count;
+	}
+
+	void clear()
+	{
+		m_slots.clear();
+		m_slots.resize(MIN_CAPACITY);
+		m_count = 0;
+	}
+
+private:
+	struct Slot
+	{
+		v3s16 p;
+		MapBlock *block; // NULL if the slot is free
+
+		Slot():
+			p(0,0,0),
+			block(NULL)
+		{}
+	};
+
+	static const u32 MIN_CAPACITY = 1024;
+
+	static u32 hash(v3s16 p)
+	{
+		u32 h = (u32)(u16)p.X * 73856093u
+				^ (u32)(u16)p.Y * 19349663u
+				^ (u32)(u16)p.Z * 83492791u;
+		// The low bits pick the slot; fold the high bits into them
+		return h ^ (h >> 16);
+	}
+
+	void rehash(u32 capacity)
+	{
+		std::vector<Slot> old;
+		old.swap(m_slots);
+		m_slots.resize(capacity);
+		m_count = 0;
+		for(u32 i=0; i<old.size(); i++)
+		{
+			if(old[i].block != NULL)
+				insert(old[i].p, old[i].block);
+		}
+	}
+
+	std::vector<Slot> m_slots;
+	u32 m_count;
+};
+
+#endif
+
@@ -0,0 +1,109 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPCURSOR_HEADER
+#define MAPCURSOR_HEADER
+
+#include "map.h"
+#include "mapblock.h"
+
+/*
+	Reads nodes of a Map without exceptions.
+
+	The blocks around the last read block are remembered, so reading
+	nearby nodes needs no map lookup. Dummy blocks read as not loaded.
+
+	The cached pointers become invalid when blocks are loaded, created
+	or unloaded; keep the cursor local to a loop, and call invalidate()
+	after running code that may do any of those (eg. scripts).
+*/
+
+class MapCursor
+{
+public:
+	MapCursor(Map *map):
+		m_map(map)
+	{
+		invalidate();
+	}
+
+	void invalidate()
+	{
+		m_has_center = false;
+	}
+
+	// Returns NULL if the block is not loaded or is a dummy
+	MapBlock * getBlock(v3s16 blockpos)
+	{
+		v3s16 d = blockpos - m_center;
+		if(!m_has_center || d.X < -1 || d.X > 1 || d.Y < -1 || d.Y > 1
+				|| d.Z < -1 || d.Z > 1)
+		{
+			m_center = blockpos;
+			m_has_center = true;
+			for(u32 i=0; i<27; i++)
+				m_fetched[i] = false;
+			d = v3s16(0,0,0);
+		}
+		u32 i = (d.Z + 1) * 9 + (d.Y + 1) * 3 + (d.X + 1);
+		if(!m_fetched[i])
+		{
+			MapBlock *block = m_map->getBlockNoCreateNoEx(blockpos);
+			if(block != NULL && block->isDummy())
+				block = NULL;
+			m_blocks[i] = block;
+			m_fetched[i] = true;
+		}
+		return m_blocks[i];
+	}
+
+	// Returns CONTENT_IGNORE and sets is_valid_position to false if the
+	// node is not loaded
+	MapNode getNode(v3s16 p, bool *is_valid_position)
+	{
+		v3s16 blockpos = getNodeBlockPos(p);
+		MapBlock *block = getBlock(blockpos);
+		if(block == NULL)
+		{
+			*is_valid_position = false;
+			return MapNode(CONTENT_IGNORE);
+		}
+		*is_valid_position = true;
+		return block->getNodeNoCheck(p - blockpos * MAP_BLOCKSIZE);
+	}
+
+	// Returns CONTENT_IGNORE if the node is not loaded
+	MapNode getNodeNoEx(v3s16 p)
+	{
+		bool is_valid_position;
+		return getNode(p, &is_valid_position);
+	}
+
+private:
+	Map *m_map;
+
+	// The 3x3x3 blocks around m_center, X fastest
+	bool m_has_center;
+	v3s16 m_center;
+	bool m_fetched[27];
+	MapBlock *m_blocks[27];
+};
+
+#endif
+
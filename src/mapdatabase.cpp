@@ -0,0 +1,321 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapdatabase.h"
+#include "mapdatabase_sqlite3.h"
+#include "mapdatabase_log.h"
+#include "main.h" // For g_settings
+#include "settings.h"
+#include "filesys.h"
+#include "log.h"
+#include "mapnode.h"
+#include "serialization.h"
+#include "porting.h"
+#include "util/serialize.h"
+#include "constants.h"
+#include <sstream>
+
+MapDatabase * createMapDatabase(const std::string &backend,
+		const std::string &savedir)
+{
+	if(backend == "sqlite3")
+	{
+		// Key layout of newly created databases
+		MapDatabaseSQLite3::KeyLayout layout;
+		std::string name = g_settings->get("sqlite_block_keys");
+		if(!MapDatabaseSQLite3::parseKeyLayout(name, &layout))
+		{
+			errorstream<<"Unknown sqlite_block_keys \""<<name
+					<<"\", using linear"<<std::endl;
+			layout = MapDatabaseSQLite3::KEY_LINEAR;
+		}
+		return new MapDatabaseSQLite3(savedir, layout);
+	}
+	if(backend == "log")
+		return new MapDatabaseLog(savedir);
+	return NULL;
+}
+
+std::string getWorldMapDatabaseBackend(const std::string &savedir)
+{
+	std::string conf_path = savedir + DIR_DELIM + "world.mt";
+	Settings conf;
+	if(!conf.readConfigFile(conf_path.c_str()) || !conf.exists("backend"))
+		return MAPDATABASE_DEFAULT_BACKEND;
+	return conf.get("backend");
+}
+
+bool benchmarkMapBlockFormat(const std::string &savedir, u32 max_blocks)
+{
+	std::string backend = getWorldMapDatabaseBackend(savedir);
+	MapDatabase *db = createMapDatabase(backend, savedir);
+	if(db == NULL)
+	{
+		errorstream<<"Unknown map database backend \""<<backend
+				<<"\" in world.mt"<<std::endl;
+		return false;
+	}
+
+	std::list<v3s16> blocks;
+	db->listAllLoadableBlocks(blocks);
+
+	const u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	// Blocks are timed in batches; the clock has a resolution of 1ms
+	const u32 batch_size = 256;
+
+	u32 count = 0;
+	u64 stored_bytes = 0;
+	// Per version: total size of blocks, encode and decode time in ms
+	u64 bytes_25 = 0, bytes_26 = 0;
+	u32 encode_25 = 0, encode_26 = 0;
+	u32 decode_25 = 0, decode_26 = 0;
+
+	std::list<v3s16>::iterator bi = blocks.begin();
+	while(bi != blocks.end() && (max_blocks == 0 || count < max_blocks))
+	{
+		/*
+			Read a batch of blocks. Everything but the bulk node data
+			is the same in both versions and is only counted.
+		*/
+		std::vector<MapNode> nodes;
+		std::vector<u32> other_bytes;
+		for(; bi != blocks.end() && other_bytes.size() < batch_size &&
+				(max_blocks == 0 || count < max_blocks); ++bi)
+		{
+			std::string blob;
+			if(!db->loadBlock(*bi, &blob))
+				continue;
+			try{
+				std::istringstream is(blob, std::ios_base::binary);
+				u8 version = readU8(is);
+				if(version < 22 || !ser_ver_supported(version))
+					continue;
+				readU8(is); // flags
+				nodes.resize(nodes.size() + nodecount);
+				MapNode *n = &nodes[nodes.size() - nodecount];
+				if(version >= 26)
+				{
+					MapNode::deSerializeBulkPalette(is, n, nodecount);
+				}
+				else
+				{
+					u8 content_width = readU8(is);
+					u8 params_width = readU8(is);
+					MapNode::deSerializeBulk(is, version, n, nodecount,
+							content_width, params_width, true);
+				}
+				other_bytes.push_back(blob.size() - is.tellg());
+			}
+			catch(SerializationError &e)
+			{
+				errorstream<<"Skipping block ("<<bi->X<<","<<bi->Y<<","
+						<<bi->Z<<"): "<<e.what()<<std::endl;
+				nodes.resize(other_bytes.size() * nodecount);
+				continue;
+			}
+			stored_bytes += blob.size();
+			count++;
+		}
+		u32 n = other_bytes.size();
+		if(n == 0)
+			continue;
+
+		std::vector<std::string> data_25(n);
+		std::vector<std::string> data_26(n);
+		std::vector<MapNode> decoded(nodecount);
+		std::vector<content_t> palette;
+
+		u32 t0 = porting::getTimeMs();
+		for(u32 i=0; i<n; i++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			MapNode::serializeBulk(os, 25, &nodes[i * nodecount], nodecount,
+					2, 2, true);
+			data_25[i] = os.str();
+		}
+		u32 t1 = porting::getTimeMs();
+		for(u32 i=0; i<n; i++)
+		{
+			std::istringstream is(data_25[i], std::ios_base::binary);
+			MapNode::deSerializeBulk(is, 25, &decoded[0], nodecount,
+					2, 2, true);
+		}
+		u32 t2 = porting::getTimeMs();
+		for(u32 i=0; i<n; i++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			MapNode::serializeBulkPalette(os, &nodes[i * nodecount],
+					nodecount, &palette, true);
+			data_26[i] = os.str();
+		}
+		u32 t3 = porting::getTimeMs();
+		for(u32 i=0; i<n; i++)
+		{
+			std::istringstream is(data_26[i], std::ios_base::binary);
+			MapNode::deSerializeBulkPalette(is, &decoded[0], nodecount);
+		}
+		u32 t4 = porting::getTimeMs();
+
+		encode_25 += t1 - t0;
+		decode_25 += t2 - t1;
+		encode_26 += t3 - t2;
+		decode_26 += t4 - t3;
+		for(u32 i=0; i<n; i++)
+		{
+			// Version, flags, content_width and params_width
+			bytes_25 += 4 + data_25[i].size() + other_bytes[i];
+			// Version and flags
+			bytes_26 += 2 + data_26[i].size() + other_bytes[i];
+		}
+	}
+
+	delete db;
+
+	if(count == 0)
+	{
+		errorstream<<"No blocks to benchmark in "<<savedir<<std::endl;
+		return false;
+	}
+
+	actionstream<<"Benchmarked "<<count<<" blocks, stored size "
+			<<(stored_bytes / count)<<" bytes/block"<<std::endl;
+	u8 versions[] = {25, 26};
+	u64 bytes[] = {bytes_25, bytes_26};
+	u32 encode[] = {encode_25, encode_26};
+	u32 decode[] = {decode_25, decode_26};
+	for(u32 i=0; i<2; i++)
+	{
+		actionstream<<"Version "<<(int)versions[i]<<": "
+				<<(bytes[i] / count)<<" bytes/block, "
+				<<"encode "<<(encode[i] ? (u64)count * 1000 / encode[i] : 0)
+				<<" blocks/s, "
+				<<"decode "<<(decode[i] ? (u64)count * 1000 / decode[i] : 0)
+				<<" blocks/s"<<std::endl;
+	}
+	return true;
+}
+
+bool migrateMapDatabaseKeys(const std::string &savedir,
+		const std::string &layout_name)
+{
+	MapDatabaseSQLite3::KeyLayout layout;
+	if(!MapDatabaseSQLite3::parseKeyLayout(layout_name, &layout))
+	{
+		errorstream<<"Unknown key layout \""<<layout_name
+				<<"\" (use linear or morton)"<<std::endl;
+		return false;
+	}
+	if(getWorldMapDatabaseBackend(savedir) != "sqlite3")
+	{
+		errorstream<<"Key layouts only apply to the sqlite3 backend"
+				<<std::endl;
+		return false;
+	}
+	actionstream<<"Converting map.sqlite of "<<savedir<<" to "
+			<<layout_name<<" keys"<<std::endl;
+	MapDatabaseSQLite3 db(savedir);
+	return db.convertKeyLayout(layout);
+}
+
+bool migrateMapDatabase(const std::string &savedir,
+		const std::string &new_backend)
+{
+	std::string old_backend = getWorldMapDatabaseBackend(savedir);
+	if(new_backend == old_backend)
+	{
+		errorstream<<"Map database of "<<savedir<<" already uses backend "
+				<<new_backend<<std::endl;
+		return false;
+	}
+
+	MapDatabase *old_db = createMapDatabase(old_backend, savedir);
+	if(old_db == NULL)
+	{
+		errorstream<<"Unknown map database backend \""<<old_backend
+				<<"\" in world.mt"<<std::endl;
+		return false;
+	}
+	MapDatabase *new_db = createMapDatabase(new_backend, savedir);
+	if(new_db == NULL)
+	{
+		errorstream<<"Unknown map database backend \""<<new_backend
+				<<"\""<<std::endl;
+		delete old_db;
+		return false;
+	}
+
+	actionstream<<"Migrating map database of "<<savedir<<" from "
+			<<old_backend<<" to "<<new_backend<<std::endl;
+
+	std::list<v3s16> blocks;
+	old_db->listAllLoadableBlocks(blocks);
+
+	u32 count = 0;
+	u32 failed = 0;
+	std::string data;
+	new_db->beginSave();
+	for(std::list<v3s16>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		if(!old_db->loadBlock(*i, &data) || !new_db->saveBlock(*i, data))
+		{
+			failed++;
+			continue;
+		}
+		count++;
+
+		// Commit in big chunks
+		if(count % 1000 == 0)
+		{
+			new_db->endSave();
+			new_db->beginSave();
+			actionstream<<"Migrated "<<count<<" of "<<blocks.size()
+					<<" blocks"<<std::endl;
+		}
+	}
+	new_db->endSave();
+
+	delete old_db;
+	delete new_db;
+
+	actionstream<<"Migrated "<<count<<" blocks";
+	if(failed != 0)
+		actionstream<<", "<<failed<<" failed";
+	actionstream<<std::endl;
+	if(failed != 0)
+	{
+		errorstream<<"Not switching world.mt to the new backend because"
+				<<" some blocks could not be migrated"<<std::endl;
+		return false;
+	}
+
+	std::string conf_path = savedir + DIR_DELIM + "world.mt";
+	Settings conf;
+	conf.readConfigFile(conf_path.c_str());
+	conf.set("backend", new_backend);
+	if(!conf.updateConfigFile(conf_path.c_str()))
+	{
+		errorstream<<"Failed to update "<<conf_path<<std::endl;
+		return false;
+	}
+	actionstream<<"World now uses map database backend "<<new_backend
+			<<"; the old database files can be removed"<<std::endl;
+	return true;
+}
+
@@ -0,0 +1,98 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPDATABASE_HEADER
+#define MAPDATABASE_HEADER
+
+#include <string>
+#include <list>
+#include <map>
+#include "irr_v3d.h"
+
+/*
+	Storage backend of ServerMap.
+
+	Stores serialized MapBlocks by position. The backend of a world is
+	selected by the "backend" key in world.mt; see createMapDatabase().
+
+	Implementations have to allow saveBlock() being called from the map
+	save thread while loadBlock() is called from the emerge threads.
+*/
+
+class MapDatabase
+{
+public:
+	virtual ~MapDatabase() {}
+
+	// Call these before and after saving of many blocks
+	virtual void beginSave() = 0;
+	virtual void endSave() = 0;
+
+	// Returns false on failure
+	virtual bool saveBlock(v3s16 blockpos, const std::string &data) = 0;
+	// Returns false if the block is not in the database
+	virtual bool loadBlock(v3s16 blockpos, std::string *data) = 0;
+	virtual void listAllLoadableBlocks(std::list<v3s16> &dst) = 0;
+
+	/*
+		Reads all stored blocks in the area minp...maxp (inclusive)
+		into dst. Only supported if canLoadBlockRange() returns true,
+		that is, if this is faster than loading the blocks one by one.
+	*/
+	virtual bool canLoadBlockRange() { return false; }
+	virtual void loadBlockRange(v3s16 minp, v3s16 maxp,
+			std::map<v3s16, std::string> &dst) {}
+
+	// Returns true if the database has been created on disk
+	virtual bool exists() = 0;
+};
+
+// Name of the backend used when world.mt does not specify one
+#define MAPDATABASE_DEFAULT_BACKEND "sqlite3"
+
+// Returns NULL if the backend name is unknown
+MapDatabase * createMapDatabase(const std::string &backend,
+		const std::string &savedir);
+
+// Reads the backend name from world.mt
+std::string getWorldMapDatabaseBackend(const std::string &savedir);
+
+/*
+	Copies all blocks of a world to a new backend and switches world.mt
+	over to it. Returns true on success.
+*/
+bool migrateMapDatabase(const std::string &savedir,
+		const std::string &new_backend);
+
+/*
+	Reads up to max_blocks blocks (0 = all) of a world and prints the
+	size and encoding/decoding speed of their node data in the
+	serialization versions 25 and 26. Returns false on failure.
+*/
+bool benchmarkMapBlockFormat(const std::string &savedir, u32 max_blocks);
+
+/*
+	Rewrites the keys of an sqlite3 map database in the given layout
+	("linear" or "morton"). Returns true on success.
+*/
+bool migrateMapDatabaseKeys(const std::string &savedir,
+		const std::string &layout_name);
+
+#endif
+
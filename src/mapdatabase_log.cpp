@@ -0,0 +1,543 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapdatabase_log.h"
+#include <stdio.h> // rename
+#include <jmutexautolock.h>
+#include "zlib.h"
+#include "filesys.h"
+#include "exceptions.h"
+#include "log.h"
+#include "debug.h"
+#include "util/serialize.h"
+#ifdef _WIN32
+	#include <io.h>
+	#include <fcntl.h>
+#else
+	#include <unistd.h>
+	#include <fcntl.h>
+#endif
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+#define MAPLOG_MAGIC "MTMAPLOG"
+#define MAPLOG_VERSION 1
+// Magic and version
+#define MAPLOG_HEADER_SIZE 9
+// Position, length and checksum
+#define MAPLOG_RECORD_HEADER_SIZE 14
+
+// Don't bother compacting files with less garbage than this
+#define MAPLOG_COMPACT_MIN_GARBAGE (16*1024*1024)
+
+static u32 data_checksum(const std::string &data)
+{
+	uLong crc = crc32(0L, Z_NULL, 0);
+	return crc32(crc, (const Bytef*)data.c_str(), data.size());
+}
+
+// Makes sure that the contents of the file are on the disk
+static bool sync_file(const std::string &path)
+{
+#ifdef _WIN32
+	int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+	if(fd < 0)
+		return false;
+	bool ok = (_commit(fd) == 0);
+	_close(fd);
+#else
+	int fd = open(path.c_str(), O_RDWR);
+	if(fd < 0)
+		return false;
+	bool ok = (fsync(fd) == 0);
+	close(fd);
+#endif
+	return ok;
+}
+
+/*
+	MapDatabaseLogCompactThread
+*/
+
+void *MapDatabaseLogCompactThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapDatabaseLogCompactThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		m_event.wait();
+		if(!getRun())
+			break;
+		m_db->compact();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
+
+/*
+	MapDatabaseLog
+*/
+
+MapDatabaseLog::MapDatabaseLog(const std::string &savedir):
+	m_savedir(savedir),
+	m_path(savedir + DIR_DELIM + "map.log"),
+	m_open(false),
+	m_end(0),
+	m_garbage(0),
+	m_compact_thread(this)
+{
+	m_mutex.Init();
+	m_compact_mutex.Init();
+}
+
+MapDatabaseLog::~MapDatabaseLog()
+{
+	m_compact_thread.stop();
+
+	JMutexAutoLock lock(m_mutex);
+	if(m_open)
+	{
+		m_file.flush();
+		if(!sync_file(m_path))
+			errorstream<<"MapDatabaseLog: Syncing map.log failed, map"
+					<<" might not have saved"<<std::endl;
+		m_file.close();
+	}
+}
+
+void MapDatabaseLog::writeRecord(std::ostream &os, v3s16 pos,
+		const std::string &data)
+{
+	writeV3S16(os, pos);
+	writeU32(os, data.size());
+	writeU32(os, data_checksum(data));
+	os.write(data.c_str(), data.size());
+}
+
+bool MapDatabaseLog::readRecord(std::istream &is, u64 offset, v3s16 *pos,
+		std::string *data)
+{
+	is.clear();
+	is.seekg(offset);
+	*pos = readV3S16(is);
+	u32 size = readU32(is);
+	u32 checksum = readU32(is);
+	if(!is.good())
+		return false;
+	data->resize(size);
+	if(size != 0)
+		is.read(&(*data)[0], size);
+	if(!is.good())
+		return false;
+	return data_checksum(*data) == checksum;
+}
+
+void MapDatabaseLog::openNoLock()
+{
+	if(m_open)
+		return;
+
+	if(fs::CreateAllDirs(m_savedir) == false)
+	{
+		errorstream<<"MapDatabaseLog: Failed to create directory "
+				<<"\""<<m_savedir<<"\""<<std::endl;
+		throw BaseException("MapDatabaseLog failed to create directory");
+	}
+
+	// Finish a compaction that was interrupted while swapping the files
+	if(!fs::PathExists(m_path) && fs::PathExists(m_path + ".compact"))
+		rename((m_path + ".compact").c_str(), m_path.c_str());
+
+	if(!fs::PathExists(m_path))
+	{
+		std::ofstream os(m_path.c_str(), std::ios_base::binary);
+		os.write(MAPLOG_MAGIC, 8);
+		writeU8(os, MAPLOG_VERSION);
+		if(!os.good())
+			throw FileNotGoodException("Cannot create map.log");
+	}
+
+	/*
+		Build the index, verifying every record. An invalid record
+		is skipped, so its block keeps its previous record. Invalid
+		records at the end of the file are cut off below.
+	*/
+	u64 filesize = 0;
+	bool torn = false;
+	u32 corrupted = 0;
+	{
+		std::ifstream is(m_path.c_str(), std::ios_base::binary);
+		if(!is.good())
+			throw FileNotGoodException("Cannot open map.log");
+
+		is.seekg(0, std::ios_base::end);
+		filesize = is.tellg();
+		is.seekg(0);
+
+		char magic[8];
+		is.read(magic, 8);
+		u8 version = readU8(is);
+		if(!is.good() || memcmp(magic, MAPLOG_MAGIC, 8) != 0)
+			throw SerializationError("MapDatabaseLog: Invalid map.log header");
+		if(version > MAPLOG_VERSION)
+			throw VersionMismatchException("MapDatabaseLog: map.log was"
+					" written by a newer version");
+
+		u64 offset = MAPLOG_HEADER_SIZE;
+		// End of the last valid record
+		u64 valid_end = offset;
+		// Size of the invalid records after valid_end
+		u64 invalid_size = 0;
+		std::string data;
+		while(offset + MAPLOG_RECORD_HEADER_SIZE <= filesize)
+		{
+			is.seekg(offset);
+			v3s16 p = readV3S16(is);
+			u32 size = readU32(is);
+			u32 checksum = readU32(is);
+			if(!is.good() || offset + MAPLOG_RECORD_HEADER_SIZE + size > filesize)
+				break;
+			data.resize(size);
+			if(size != 0)
+				is.read(&data[0], size);
+			u64 next = offset + MAPLOG_RECORD_HEADER_SIZE + size;
+
+			if(!is.good() || data_checksum(data) != checksum)
+			{
+				is.clear();
+				corrupted++;
+				invalid_size += next - offset;
+				offset = next;
+				continue;
+			}
+
+			std::map<v3s16, Entry>::iterator n = m_index.find(p);
+			if(n != m_index.end())
+				m_garbage += MAPLOG_RECORD_HEADER_SIZE + n->second.size;
+
+			Entry e;
+			e.offset = offset + MAPLOG_RECORD_HEADER_SIZE;
+			e.size = size;
+			m_index[p] = e;
+
+			// Skipped records are garbage if they aren't at the end
+			m_garbage += invalid_size;
+			invalid_size = 0;
+			offset = next;
+			valid_end = offset;
+		}
+		m_end = valid_end;
+		torn = (m_end != filesize);
+	}
+
+	if(corrupted != 0)
+	{
+		errorstream<<"MapDatabaseLog: Skipped "<<corrupted
+				<<" corrupted records in map.log; their blocks are loaded"
+				<<" from their previous records"<<std::endl;
+	}
+
+	if(torn)
+	{
+		/*
+			Drop the incomplete tail so that new records don't end up
+			after garbage. The complete records are copied as-is.
+		*/
+		errorstream<<"MapDatabaseLog: map.log ends in an incomplete or"
+				<<" corrupted record (crash during save?); dropping "<<(filesize - m_end)
+				<<" bytes"<<std::endl;
+
+		std::string tmppath = m_path + ".tmp";
+		{
+			std::ifstream is(m_path.c_str(), std::ios_base::binary);
+			std::ofstream os(tmppath.c_str(),
+					std::ios_base::binary | std::ios_base::trunc);
+			char buf[65536];
+			u64 left = m_end;
+			while(left > 0 && is.good() && os.good())
+			{
+				u32 n = left < sizeof(buf) ? left : sizeof(buf);
+				is.read(buf, n);
+				os.write(buf, n);
+				left -= n;
+			}
+			if(left != 0 || !os.good())
+				throw FileNotGoodException("Cannot repair map.log");
+		}
+		// Or a crash could leave a truncated file in place of map.log
+		if(!sync_file(tmppath))
+			throw FileNotGoodException("Cannot repair map.log");
+#ifdef _WIN32
+		fs::DeleteSingleFileOrEmptyDirectory(m_path);
+#endif
+		if(rename(tmppath.c_str(), m_path.c_str()) != 0)
+			throw FileNotGoodException("Cannot repair map.log");
+	}
+
+	m_file.open(m_path.c_str(), std::ios_base::in | std::ios_base::out
+			| std::ios_base::binary);
+	if(!m_file.good())
+		throw FileNotGoodException("Cannot open map.log");
+
+	m_open = true;
+
+	infostream<<"MapDatabaseLog: Opened map.log: "<<m_index.size()
+			<<" blocks, "<<m_end<<" bytes of which "<<m_garbage
+			<<" are garbage"<<std::endl;
+}
+
+bool MapDatabaseLog::exists()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_open || fs::PathExists(m_path);
+}
+
+void MapDatabaseLog::beginSave()
+{
+	JMutexAutoLock lock(m_mutex);
+	openNoLock();
+}
+
+void MapDatabaseLog::endSave()
+{
+	JMutexAutoLock lock(m_mutex);
+	if(!m_open)
+		return;
+
+	// Saved blocks must survive a crash, as with the sqlite backend
+	m_file.flush();
+	if(!m_file.good() || !sync_file(m_path))
+		errorstream<<"MapDatabaseLog: Flushing map.log failed, map might"
+				<<" not have saved"<<std::endl;
+
+	if(m_garbage >= MAPLOG_COMPACT_MIN_GARBAGE && m_garbage > m_end / 2)
+	{
+		if(!m_compact_thread.IsRunning())
+		{
+			m_compact_thread.setRun(true);
+			m_compact_thread.Start();
+		}
+		m_compact_thread.trigger();
+	}
+}
+
+bool MapDatabaseLog::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	JMutexAutoLock lock(m_mutex);
+	openNoLock();
+
+	m_file.clear();
+	m_file.seekp(m_end);
+	writeRecord(m_file, blockpos, data);
+	if(!m_file.good())
+	{
+		errorstream<<"WARNING: Block failed to save "<<PP(blockpos)
+				<<" to map.log"<<std::endl;
+		// The next record overwrites whatever got written
+		m_file.clear();
+		return false;
+	}
+
+	std::map<v3s16, Entry>::iterator n = m_index.find(blockpos);
+	if(n != m_index.end())
+		m_garbage += MAPLOG_RECORD_HEADER_SIZE + n->second.size;
+
+	Entry e;
+	e.offset = m_end + MAPLOG_RECORD_HEADER_SIZE;
+	e.size = data.size();
+	m_index[blockpos] = e;
+
+	m_end += MAPLOG_RECORD_HEADER_SIZE + data.size();
+
+	return true;
+}
+
+bool MapDatabaseLog::loadBlock(v3s16 blockpos, std::string *data)
+{
+	JMutexAutoLock lock(m_mutex);
+	if(!m_open && !fs::PathExists(m_path))
+		return false;
+	openNoLock();
+
+	std::map<v3s16, Entry>::iterator n = m_index.find(blockpos);
+	if(n == m_index.end())
+		return false;
+
+	v3s16 p;
+	if(!readRecord(m_file, n->second.offset - MAPLOG_RECORD_HEADER_SIZE,
+			&p, data) || p != blockpos)
+	{
+		m_file.clear();
+		errorstream<<"MapDatabaseLog: Corrupted record for block "
+				<<PP(blockpos)<<" in map.log"<<std::endl;
+		throw SerializationError("Corrupted record in map.log");
+	}
+	return true;
+}
+
+void MapDatabaseLog::listAllLoadableBlocks(std::list<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+	if(!m_open && !fs::PathExists(m_path))
+		return;
+	openNoLock();
+
+	for(std::map<v3s16, Entry>::iterator i = m_index.begin();
+			i != m_index.end(); ++i)
+		dst.push_back(i->first);
+}
+
+void MapDatabaseLog::abortCompact(std::ofstream &os,
+		const std::string &tmppath, v3s16 blockpos)
+{
+	// Leaving the record out would delete the block for good; loading
+	// it reports the error instead
+	errorstream<<"MapDatabaseLog: Corrupted record of block "
+			<<PP(blockpos)<<" in map.log; not compacting"<<std::endl;
+	os.close();
+	fs::DeleteSingleFileOrEmptyDirectory(tmppath);
+}
+
+void MapDatabaseLog::compact()
+{
+	JMutexAutoLock compactlock(m_compact_mutex);
+
+	/*
+		Everything before end is never modified, so it can be copied
+		without holding m_mutex
+	*/
+	std::map<v3s16, Entry> index;
+	u64 end;
+	{
+		JMutexAutoLock lock(m_mutex);
+		if(!m_open)
+			return;
+		m_file.flush();
+		index = m_index;
+		end = m_end;
+	}
+
+	infostream<<"MapDatabaseLog: Compacting map.log"<<std::endl;
+
+	std::string tmppath = m_path + ".compact";
+	std::ofstream os(tmppath.c_str(),
+			std::ios_base::binary | std::ios_base::trunc);
+	os.write(MAPLOG_MAGIC, 8);
+	writeU8(os, MAPLOG_VERSION);
+
+	std::map<v3s16, Entry> newindex;
+	u64 newend = MAPLOG_HEADER_SIZE;
+	std::string data;
+
+	{
+		std::ifstream is(m_path.c_str(), std::ios_base::binary);
+		for(std::map<v3s16, Entry>::iterator i = index.begin();
+				i != index.end(); ++i)
+		{
+			v3s16 p;
+			if(!readRecord(is, i->second.offset - MAPLOG_RECORD_HEADER_SIZE,
+					&p, &data) || p != i->first)
+			{
+				abortCompact(os, tmppath, i->first);
+				return;
+			}
+			writeRecord(os, p, data);
+
+			Entry e;
+			e.offset = newend + MAPLOG_RECORD_HEADER_SIZE;
+			e.size = data.size();
+			newindex[p] = e;
+			newend += MAPLOG_RECORD_HEADER_SIZE + data.size();
+		}
+	}
+
+	// Most of the file is synced here, not while saving is blocked
+	os.flush();
+	sync_file(tmppath);
+
+	JMutexAutoLock lock(m_mutex);
+
+	// Copy the records that were written in the meantime
+	for(std::map<v3s16, Entry>::iterator i = m_index.begin();
+			i != m_index.end(); ++i)
+	{
+		if(i->second.offset < end)
+			continue;
+		v3s16 p;
+		if(!readRecord(m_file, i->second.offset - MAPLOG_RECORD_HEADER_SIZE,
+				&p, &data) || p != i->first)
+		{
+			m_file.clear();
+			abortCompact(os, tmppath, i->first);
+			return;
+		}
+		writeRecord(os, p, data);
+
+		Entry e;
+		e.offset = newend + MAPLOG_RECORD_HEADER_SIZE;
+		e.size = data.size();
+		newindex[p] = e;
+		newend += MAPLOG_RECORD_HEADER_SIZE + data.size();
+	}
+
+	os.close();
+	// Or a crash could leave a truncated file in place of map.log
+	if(os.fail() || !sync_file(tmppath))
+	{
+		errorstream<<"MapDatabaseLog: Writing "<<tmppath<<" failed;"
+				<<" not compacting"<<std::endl;
+		fs::DeleteSingleFileOrEmptyDirectory(tmppath);
+		return;
+	}
+
+	m_file.close();
+#ifdef _WIN32
+	fs::DeleteSingleFileOrEmptyDirectory(m_path);
+#endif
+	if(rename(tmppath.c_str(), m_path.c_str()) != 0)
+	{
+		errorstream<<"MapDatabaseLog: Replacing map.log failed;"
+				<<" not compacting"<<std::endl;
+		m_file.open(m_path.c_str(), std::ios_base::in | std::ios_base::out
+				| std::ios_base::binary);
+		return;
+	}
+	m_file.open(m_path.c_str(), std::ios_base::in | std::ios_base::out
+			| std::ios_base::binary);
+	if(!m_file.good())
+		throw FileNotGoodException("Cannot open map.log");
+
+	infostream<<"MapDatabaseLog: Compacted map.log from "<<m_end
+			<<" to "<<newend<<" bytes"<<std::endl;
+
+	m_index = newindex;
+	m_end = newend;
+	m_garbage = 0;
+}
+
@@ -0,0 +1,145 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPDATABASE_LOG_HEADER
+#define MAPDATABASE_LOG_HEADER
+
+#include <map>
+#include <fstream>
+#include "mapdatabase.h"
+#include "irrlichttypes.h"
+#include "util/container.h"
+#include "util/thread.h"
+
+/*
+	Append-only log-structured block store.
+
+	Every saved block is appended to map.log; an in-memory index
+	points to the latest record of each block. Rewriting a block
+	thus costs one sequential write, and old records of the block
+	become garbage that is removed by a background compaction which
+	rewrites the live records into a new file.
+
+	Structure of map.log:
+		"MTMAPLOG" u8 version
+		records:
+			v3s16 pos
+			u32 data length
+			u32 crc32 of data
+			data
+
+	Every record is verified when the index is rebuilt. Invalid records
+	at the end of the file (crash during a write) are cut off right away.
+	An invalid record elsewhere is skipped, so its block keeps its
+	previous record. Replacement files are synced to the disk before
+	they are renamed over map.log, and so is map.log at the end of each
+	save. Compaction gives up, leaving map.log as it is, if it finds a
+	record that has been corrupted since.
+*/
+
+class MapDatabaseLog;
+
+class MapDatabaseLogCompactThread : public SimpleThread
+{
+public:
+	MapDatabaseLogCompactThread(MapDatabaseLog *db):
+		SimpleThread(),
+		m_db(db)
+	{}
+
+	void *Thread();
+
+	void trigger()
+	{
+		m_event.signal();
+	}
+
+	void stop()
+	{
+		setRun(false);
+		m_event.signal();
+		SimpleThread::stop();
+	}
+
+private:
+	MapDatabaseLog *m_db;
+	Event m_event;
+};
+
+class MapDatabaseLog : public MapDatabase
+{
+public:
+	MapDatabaseLog(const std::string &savedir);
+	~MapDatabaseLog();
+
+	void beginSave();
+	void endSave();
+
+	bool saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string *data);
+	void listAllLoadableBlocks(std::list<v3s16> &dst);
+
+	bool exists();
+
+	/*
+		Rewrites the live records into a new file. Saving and loading
+		can go on while the copying is done; they are only blocked
+		while the files are swapped.
+	*/
+	void compact();
+
+private:
+	struct Entry
+	{
+		// Offset of the data (not the record header) in the file
+		u64 offset;
+		u32 size;
+	};
+
+	// Opens the file and builds the index if not done yet.
+	// Call with m_mutex locked.
+	void openNoLock();
+	// Returns false if the record at offset is invalid
+	bool readRecord(std::istream &is, u64 offset, v3s16 *pos,
+			std::string *data);
+	static void writeRecord(std::ostream &os, v3s16 pos,
+			const std::string &data);
+	// Leaves map.log as it is
+	void abortCompact(std::ofstream &os, const std::string &tmppath,
+			v3s16 blockpos);
+
+	std::string m_savedir;
+	std::string m_path;
+
+	JMutex m_mutex;
+	std::fstream m_file;
+	bool m_open;
+	// End of the last complete record
+	u64 m_end;
+	// Bytes in records that have been superseded
+	u64 m_garbage;
+	std::map<v3s16, Entry> m_index;
+
+	// Compaction is only run by one thread at a time
+	JMutex m_compact_mutex;
+	MapDatabaseLogCompactThread m_compact_thread;
+};
+
+#endif
+
@@ -0,0 +1,452 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapdatabase_sqlite3.h"
+#include <jmutexautolock.h>
+#include "debug.h"
+#include <sstream>
+#include "filesys.h"
+#include "exceptions.h"
+#include "log.h"
+
+MapDatabaseSQLite3::MapDatabaseSQLite3(const std::string &savedir,
+		KeyLayout new_layout):
+	m_savedir(savedir),
+	m_dbpath(savedir + DIR_DELIM + "map.sqlite"),
+	m_new_layout(new_layout),
+	m_key_layout(KEY_LINEAR),
+	m_database(NULL),
+	m_database_read(NULL),
+	m_database_write(NULL),
+	m_database_list(NULL),
+	m_database_read_range(NULL)
+{
+	m_open_mutex.Init();
+	m_read_mutex.Init();
+}
+
+MapDatabaseSQLite3::~MapDatabaseSQLite3()
+{
+	finalizeStatements();
+	if(m_database)
+		sqlite3_close(m_database);
+}
+
+static int getUserVersion(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	int version = 0;
+	if(sqlite3_prepare(db, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK)
+		throw FileNotGoodException("Cannot read database version");
+	if(sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return version;
+}
+
+static bool setUserVersion(sqlite3 *db, int version)
+{
+	std::ostringstream os;
+	os<<"PRAGMA user_version = "<<version<<";";
+	return sqlite3_exec(db, os.str().c_str(), NULL, NULL, NULL) == SQLITE_OK;
+}
+
+void MapDatabaseSQLite3::createDatabase() {
+	int e;
+	assert(m_database);
+	e = sqlite3_exec(m_database,
+		"CREATE TABLE IF NOT EXISTS `blocks` ("
+			"`pos` INT NOT NULL PRIMARY KEY,"
+			"`data` BLOB"
+		");"
+	, NULL, NULL, NULL);
+	if(e == SQLITE_ABORT)
+		throw FileNotGoodException("Could not create database structure");
+	else
+		infostream<<"ServerMap: Database structure was created"<<std::endl;
+}
+
+void MapDatabaseSQLite3::verifyDatabase() {
+	JMutexAutoLock lock(m_open_mutex);
+
+	if(m_database)
+		return;
+
+	{
+		bool needs_create = false;
+		int d;
+
+		/*
+			Open the database connection
+		*/
+
+		if(fs::CreateAllDirs(m_savedir) == false)
+		{
+			errorstream<<"ServerMap: Failed to create directory "
+					<<"\""<<m_savedir<<"\""<<std::endl;
+			throw BaseException("ServerMap failed to create directory");
+		}
+
+		if(!fs::PathExists(m_dbpath))
+			needs_create = true;
+
+		// The connection is shared with the MapSaveThread
+		d = sqlite3_open_v2(m_dbpath.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot open database file");
+		}
+
+		if(needs_create)
+		{
+			createDatabase();
+			setUserVersion(m_database, m_new_layout);
+		}
+
+		int layout = getUserVersion(m_database);
+		if(layout != KEY_LINEAR && layout != KEY_MORTON)
+			throw VersionMismatchException("map.sqlite uses an unknown"
+					" key layout");
+		m_key_layout = (KeyLayout)layout;
+
+		prepareStatements();
+
+		infostream<<"ServerMap: Database opened"
+				<<(m_key_layout == KEY_MORTON ? " (Morton keys)" : "")
+				<<std::endl;
+	}
+}
+
+void MapDatabaseSQLite3::prepareStatements()
+{
+	int d;
+
+	d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+
+	d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare write statement");
+	}
+
+	d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+
+	d = sqlite3_prepare(m_database, "SELECT `pos`, `data` FROM `blocks` WHERE `pos` BETWEEN ? AND ?", -1, &m_database_read_range, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database range read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+}
+
+void MapDatabaseSQLite3::finalizeStatements()
+{
+	if(m_database_read)
+		sqlite3_finalize(m_database_read);
+	if(m_database_write)
+		sqlite3_finalize(m_database_write);
+	if(m_database_list)
+		sqlite3_finalize(m_database_list);
+	if(m_database_read_range)
+		sqlite3_finalize(m_database_read_range);
+	m_database_read = NULL;
+	m_database_write = NULL;
+	m_database_list = NULL;
+	m_database_read_range = NULL;
+}
+
+bool MapDatabaseSQLite3::exists() {
+	if(m_database)
+		return true;
+	return fs::PathExists(m_dbpath);
+}
+
+void MapDatabaseSQLite3::beginSave() {
+	verifyDatabase();
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+}
+
+void MapDatabaseSQLite3::endSave() {
+	verifyDatabase();
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: endSave() failed, map might not have saved.";
+}
+
+bool MapDatabaseSQLite3::saveBlock(v3s16 p3d, const std::string &data)
+{
+	verifyDatabase();
+
+	bool success = true;
+	if(sqlite3_bind_int64(m_database_write, 1, getBlockKey(p3d)) != SQLITE_OK) {
+		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	if(sqlite3_bind_blob(m_database_write, 2, (void *)data.c_str(), data.size(), NULL) != SQLITE_OK) {
+		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	int written = sqlite3_step(m_database_write);
+	if(written != SQLITE_DONE) {
+		errorstream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	// Make ready for later reuse
+	sqlite3_reset(m_database_write);
+
+	return success;
+}
+
+bool MapDatabaseSQLite3::loadBlock(v3s16 blockpos, std::string *data)
+{
+	verifyDatabase();
+	JMutexAutoLock lock(m_read_mutex);
+
+	if(sqlite3_bind_int64(m_database_read, 1, getBlockKey(blockpos)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+
+	bool found = false;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+		const char * blob = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+
+		*data = std::string(blob, len);
+		found = true;
+
+		sqlite3_step(m_database_read);
+	}
+	// We should never get more than 1 row, so ok to reset
+	sqlite3_reset(m_database_read);
+
+	return found;
+}
+
+void MapDatabaseSQLite3::listAllLoadableBlocks(std::list<v3s16> &dst)
+{
+	verifyDatabase();
+
+	while(sqlite3_step(m_database_list) == SQLITE_ROW)
+	{
+		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
+		v3s16 p = getKeyBlock(block_i);
+		//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
+		dst.push_back(p);
+	}
+	sqlite3_reset(m_database_list);
+}
+
+bool MapDatabaseSQLite3::canLoadBlockRange()
+{
+	verifyDatabase();
+	return m_key_layout == KEY_MORTON;
+}
+
+void MapDatabaseSQLite3::loadBlockRange(v3s16 minp, v3s16 maxp,
+		std::map<v3s16, std::string> &dst)
+{
+	verifyDatabase();
+	JMutexAutoLock lock(m_read_mutex);
+	assert(m_key_layout == KEY_MORTON);
+
+	/*
+		All keys of the area are between the keys of its corners.
+		For an aligned cube these are exactly the blocks of the cube;
+		otherwise some blocks outside of the area are skipped below.
+	*/
+	sqlite3_bind_int64(m_database_read_range, 1,
+			getBlockAsMortonInteger(minp));
+	sqlite3_bind_int64(m_database_read_range, 2,
+			getBlockAsMortonInteger(maxp));
+
+	while(sqlite3_step(m_database_read_range) == SQLITE_ROW)
+	{
+		v3s16 p = getMortonIntegerAsBlock(
+				sqlite3_column_int64(m_database_read_range, 0));
+		if(p.X < minp.X || p.Y < minp.Y || p.Z < minp.Z ||
+				p.X > maxp.X || p.Y > maxp.Y || p.Z > maxp.Z)
+			continue;
+		const char *blob = (const char *)sqlite3_column_blob(
+				m_database_read_range, 1);
+		size_t len = sqlite3_column_bytes(m_database_read_range, 1);
+		dst[p] = std::string(blob, len);
+	}
+	sqlite3_reset(m_database_read_range);
+}
+
+MapDatabaseSQLite3::KeyLayout MapDatabaseSQLite3::getKeyLayout()
+{
+	verifyDatabase();
+	return m_key_layout;
+}
+
+bool MapDatabaseSQLite3::convertKeyLayout(KeyLayout layout)
+{
+	verifyDatabase();
+
+	if(layout == m_key_layout)
+		return true;
+
+	// The statements would keep the old table alive
+	finalizeStatements();
+
+	sqlite3_stmt *select = NULL;
+	sqlite3_stmt *insert = NULL;
+	bool success =
+		sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK &&
+		sqlite3_exec(m_database,
+			"CREATE TABLE `blocks_new` ("
+				"`pos` INT NOT NULL PRIMARY KEY,"
+				"`data` BLOB"
+			");"
+		, NULL, NULL, NULL) == SQLITE_OK &&
+		sqlite3_prepare(m_database, "SELECT `pos`, `data` FROM `blocks`",
+				-1, &select, NULL) == SQLITE_OK &&
+		sqlite3_prepare(m_database, "INSERT INTO `blocks_new` VALUES(?, ?)",
+				-1, &insert, NULL) == SQLITE_OK;
+
+	u32 count = 0;
+	while(success && sqlite3_step(select) == SQLITE_ROW)
+	{
+		v3s16 p = getKeyBlock(sqlite3_column_int64(select, 0));
+		sqlite3_int64 key = layout == KEY_MORTON ?
+				getBlockAsMortonInteger(p) : getBlockAsInteger(p);
+		sqlite3_bind_int64(insert, 1, key);
+		sqlite3_bind_blob(insert, 2, sqlite3_column_blob(select, 1),
+				sqlite3_column_bytes(select, 1), SQLITE_TRANSIENT);
+		if(sqlite3_step(insert) != SQLITE_DONE)
+			success = false;
+		sqlite3_reset(insert);
+		count++;
+	}
+
+	if(select)
+		sqlite3_finalize(select);
+	if(insert)
+		sqlite3_finalize(insert);
+
+	success = success &&
+		sqlite3_exec(m_database, "DROP TABLE `blocks`;",
+				NULL, NULL, NULL) == SQLITE_OK &&
+		sqlite3_exec(m_database,
+				"ALTER TABLE `blocks_new` RENAME TO `blocks`;",
+				NULL, NULL, NULL) == SQLITE_OK &&
+		setUserVersion(m_database, layout) &&
+		sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
+
+	if(!success)
+	{
+		errorstream<<"MapDatabaseSQLite3: Converting keys failed: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_exec(m_database, "ROLLBACK;", NULL, NULL, NULL);
+	}
+	else
+	{
+		m_key_layout = layout;
+		infostream<<"MapDatabaseSQLite3: Converted keys of "<<count
+				<<" blocks"<<std::endl;
+	}
+
+	prepareStatements();
+	return success;
+}
+
+bool MapDatabaseSQLite3::parseKeyLayout(const std::string &name,
+		KeyLayout *layout)
+{
+	if(name == "linear")
+		*layout = KEY_LINEAR;
+	else if(name == "morton")
+		*layout = KEY_MORTON;
+	else
+		return false;
+	return true;
+}
+
+sqlite3_int64 MapDatabaseSQLite3::getBlockAsInteger(const v3s16 pos) {
+	return (sqlite3_int64)pos.Z*16777216 +
+		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
+}
+
+static s32 unsignedToSigned(s32 i, s32 max_positive)
+{
+	if(i < max_positive)
+		return i;
+	else
+		return i - 2*max_positive;
+}
+
+// modulo of a negative number does not work consistently in C
+static sqlite3_int64 pythonmodulo(sqlite3_int64 i, sqlite3_int64 mod)
+{
+	if(i >= 0)
+		return i % mod;
+	return mod - ((-i) % mod);
+}
+
+v3s16 MapDatabaseSQLite3::getIntegerAsBlock(sqlite3_int64 i)
+{
+	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - x) / 4096;
+	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - y) / 4096;
+	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	return v3s16(x,y,z);
+}
+
+// Puts the 12 low bits of v in every third bit
+static sqlite3_int64 spreadBits3(u32 v)
+{
+	sqlite3_int64 r = 0;
+	for(u32 b = 0; b < 12; b++)
+		r |= (sqlite3_int64)((v >> b) & 1) << (3 * b);
+	return r;
+}
+
+static u32 compactBits3(sqlite3_int64 v)
+{
+	u32 r = 0;
+	for(u32 b = 0; b < 12; b++)
+		r |= (u32)((v >> (3 * b)) & 1) << b;
+	return r;
+}
+
+sqlite3_int64 MapDatabaseSQLite3::getBlockAsMortonInteger(const v3s16 pos)
+{
+	return spreadBits3((pos.X + 2048) & 0xfff) |
+		(spreadBits3((pos.Y + 2048) & 0xfff) << 1) |
+		(spreadBits3((pos.Z + 2048) & 0xfff) << 2);
+}
+
+v3s16 MapDatabaseSQLite3::getMortonIntegerAsBlock(sqlite3_int64 i)
+{
+	return v3s16(
+		(s32)compactBits3(i) - 2048,
+		(s32)compactBits3(i >> 1) - 2048,
+		(s32)compactBits3(i >> 2) - 2048);
+}
+
@@ -0,0 +1,136 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPDATABASE_SQLITE3_HEADER
+#define MAPDATABASE_SQLITE3_HEADER
+
+#include <jmutex.h>
+#include "mapdatabase.h"
+
+extern "C" {
+	#include "sqlite3.h"
+}
+
+/*
+	SQLite format specification:
+	- Initially only replaces sectors/ and sectors2/
+
+	If map.sqlite does not exist in the save dir
+	or the block was not found in the database
+	the map will try to load from sectors folder.
+	In either case, map.sqlite will be created
+	and all future saves will save there.
+
+	Structure of map.sqlite:
+	Tables:
+		blocks
+			(PK) INT pos
+			BLOB data
+	PRAGMA user_version: key layout of pos (see KeyLayout)
+
+	With the Morton layout, the blocks of any aligned 2^n cube have
+	consecutive keys, so neighbouring blocks are stored next to each
+	other and a neighbourhood can be read with a single range query.
+*/
+
+class MapDatabaseSQLite3 : public MapDatabase
+{
+public:
+	enum KeyLayout
+	{
+		// z*16777216 + y*4096 + x
+		KEY_LINEAR = 0,
+		// Bits of x+2048, y+2048 and z+2048 interleaved
+		KEY_MORTON = 1
+	};
+
+	// new_layout is used if the database does not exist yet
+	MapDatabaseSQLite3(const std::string &savedir,
+			KeyLayout new_layout = KEY_LINEAR);
+	~MapDatabaseSQLite3();
+
+	void beginSave();
+	void endSave();
+
+	bool saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string *data);
+	void listAllLoadableBlocks(std::list<v3s16> &dst);
+	// Only supported with the Morton layout
+	bool canLoadBlockRange();
+	void loadBlockRange(v3s16 minp, v3s16 maxp,
+			std::map<v3s16, std::string> &dst);
+
+	bool exists();
+
+	KeyLayout getKeyLayout();
+	// Rewrites all keys in the given layout. Returns true on success.
+	bool convertKeyLayout(KeyLayout layout);
+
+	// Get an integer suitable for a block
+	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
+	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
+	static sqlite3_int64 getBlockAsMortonInteger(const v3s16 pos);
+	static v3s16 getMortonIntegerAsBlock(sqlite3_int64 i);
+
+	// Returns false if the name is unknown
+	static bool parseKeyLayout(const std::string &name, KeyLayout *layout);
+
+private:
+	// Create the database structure
+	void createDatabase();
+	// Open the database if it isn't open yet
+	void verifyDatabase();
+	// Prepares the statements that depend on nothing but the schema
+	void prepareStatements();
+	void finalizeStatements();
+
+	sqlite3_int64 getBlockKey(v3s16 pos)
+	{
+		if(m_key_layout == KEY_MORTON)
+			return getBlockAsMortonInteger(pos);
+		return getBlockAsInteger(pos);
+	}
+	v3s16 getKeyBlock(sqlite3_int64 i)
+	{
+		if(m_key_layout == KEY_MORTON)
+			return getMortonIntegerAsBlock(i);
+		return getIntegerAsBlock(i);
+	}
+
+	std::string m_savedir;
+	std::string m_dbpath;
+
+	// Held while opening the database
+	JMutex m_open_mutex;
+	// Held while using the read statements; emerge threads read
+	// concurrently
+	JMutex m_read_mutex;
+
+	KeyLayout m_new_layout;
+	KeyLayout m_key_layout;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_read_range;
+};
+
+#endif
+
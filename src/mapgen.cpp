@@ -18,6 +18,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "mapgen.h"
+#include <string.h>
+#include "jmutexautolock.h"
 #include "voxel.h"
 #include "noise.h"
 #include "biome.h"
@@ -34,6 +36,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h" // For g_profiler
 #include "treegen.h"
 #include "mapgen_v6.h"
+#include "util/thread.h"
+#include "log.h"
 
 FlagDesc flagdesc_mapgen[] = {
 	{"trees",          MG_TREES},
@@ -98,6 +102,221 @@ void Mapgen::updateLighting(v3s16 nmin, v3s16 nmax) {
 }
 
 
+//////////////////////// Column cache
+
+
+MapgenColumnCache::MapgenColumnCache(u32 max_columns) {
+	m_max_columns = max_columns;
+	m_mutex.Init();
+}
+
+
+MapgenColumnCache::~MapgenColumnCache() {
+	for (std::map<v2s16, Entry *>::iterator i = m_entries.begin();
+			i != m_entries.end(); ++i)
+		delete i->second;
+}
+
+
+bool MapgenColumnCache::get(v2s16 column, float *dst, u32 count) {
+	for (;;) {
+		Entry *e;
+		{
+			JMutexAutoLock lock(m_mutex);
+			std::map<v2s16, Entry *>::iterator i = m_entries.find(column);
+			if (i == m_entries.end()) {
+				// The caller computes it; others asking meanwhile will wait
+				e = new Entry;
+				e->ready = false;
+				e->abandoned = false;
+				e->users = 0;
+				e->compute_mutex.Init();
+				e->compute_mutex.Lock();
+				m_lru.push_front(column);
+				e->lru = m_lru.begin();
+				m_entries[column] = e;
+				evict();
+				return false;
+			}
+			e = i->second;
+			e->users++;
+			touch(e);
+		}
+
+		// Wait until the data has been put(); it is not changed after that
+		e->compute_mutex.Lock();
+		bool ok = e->ready && e->data.size() == count;
+		if (ok)
+			memcpy(dst, &e->data[0], count * sizeof(float));
+		e->compute_mutex.Unlock();
+
+		JMutexAutoLock lock(m_mutex);
+		e->users--;
+		if (!e->abandoned)
+			return ok;
+		// Nobody is computing it anymore; look it up again
+		if (e->users == 0)
+			delete e;
+	}
+}
+
+
+void MapgenColumnCache::put(v2s16 column, const float *src, u32 count) {
+	JMutexAutoLock lock(m_mutex);
+	std::map<v2s16, Entry *>::iterator i = m_entries.find(column);
+	// Entries being computed are not evicted
+	assert(i != m_entries.end() && !i->second->ready);
+	Entry *e = i->second;
+	e->data.assign(src, src + count);
+	e->ready = true;
+	e->compute_mutex.Unlock();
+}
+
+
+void MapgenColumnCache::abandon(v2s16 column) {
+	JMutexAutoLock lock(m_mutex);
+	std::map<v2s16, Entry *>::iterator i = m_entries.find(column);
+	assert(i != m_entries.end() && !i->second->ready);
+	Entry *e = i->second;
+	m_lru.erase(e->lru);
+	m_entries.erase(i);
+	// The last of the waiting threads deletes it
+	e->abandoned = true;
+	e->compute_mutex.Unlock();
+	if (e->users == 0)
+		delete e;
+}
+
+
+void MapgenColumnCache::touch(Entry *e) {
+	m_lru.splice(m_lru.begin(), m_lru, e->lru);
+}
+
+
+void MapgenColumnCache::evict() {
+	std::list<v2s16>::iterator i = m_lru.end();
+	while (m_entries.size() > m_max_columns && i != m_lru.begin()) {
+		--i;
+		Entry *e = m_entries[*i];
+		if (!e->ready || e->users != 0)
+			continue;
+		m_entries.erase(*i);
+		delete e;
+		i = m_lru.erase(i);
+	}
+}
+
+
+//////////////////////// Worker pool
+
+
+class MapgenWorkerThread : public SimpleThread {
+public:
+	MapgenWorkerThread(MapgenWorkerPool *pool):
+		SimpleThread(),
+		m_pool(pool)
+	{}
+
+	void *Thread();
+
+private:
+	MapgenWorkerPool *m_pool;
+};
+
+
+void *MapgenWorkerThread::Thread() {
+	ThreadStarted();
+	log_register_thread("MapgenWorkerThread");
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	for (;;) {
+		m_pool->m_start_event.wait();
+		if (!getRun())
+			break;
+		m_pool->work();
+		m_pool->m_done_event.signal();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+	log_deregister_thread();
+	return NULL;
+}
+
+
+MapgenWorkerPool::MapgenWorkerPool(u32 num_threads) {
+	m_mutex.Init();
+	m_task   = NULL;
+	m_nparts = 0;
+	m_next   = 0;
+	for (u32 i = 0; i != num_threads; i++) {
+		MapgenWorkerThread *t = new MapgenWorkerThread(this);
+		t->Start();
+		m_threads.push_back(t);
+	}
+}
+
+
+MapgenWorkerPool::~MapgenWorkerPool() {
+	// Stop all of them before waking any, since any thread can take
+	// any of the signals
+	for (u32 i = 0; i != m_threads.size(); i++)
+		m_threads[i]->setRun(false);
+	for (u32 i = 0; i != m_threads.size(); i++)
+		m_start_event.signal();
+	for (u32 i = 0; i != m_threads.size(); i++) {
+		m_threads[i]->stop();
+		delete m_threads[i];
+	}
+}
+
+
+void MapgenWorkerPool::run(MapgenTask *task, u32 nparts) {
+	bool busy = true;
+	if (!m_threads.empty() && nparts > 1) {
+		JMutexAutoLock lock(m_mutex);
+		busy = (m_task != NULL);
+		if (!busy) {
+			m_task   = task;
+			m_nparts = nparts;
+			m_next   = 0;
+		}
+	}
+	if (busy) {
+		for (u32 i = 0; i != nparts; i++)
+			task->runPart(i);
+		return;
+	}
+
+	// Only wake up threads that have something to do
+	u32 woken = MYMIN(m_threads.size(), nparts - 1);
+	for (u32 i = 0; i != woken; i++)
+		m_start_event.signal();
+	work();
+	for (u32 i = 0; i != woken; i++)
+		m_done_event.wait();
+
+	JMutexAutoLock lock(m_mutex);
+	m_task = NULL;
+}
+
+
+void MapgenWorkerPool::work() {
+	for (;;) {
+		MapgenTask *task;
+		u32 part;
+		{
+			JMutexAutoLock lock(m_mutex);
+			if (m_task == NULL || m_next == m_nparts)
+				return;
+			task = m_task;
+			part = m_next++;
+		}
+		task->runPart(part);
+	}
+}
+
+
 //////////////////////// Mapgen V6 parameter read/write
 
 bool MapgenV6Params::readParams(Settings *settings) {
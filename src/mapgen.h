@@ -26,7 +26,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include "noise.h"
 #include "settings.h"
+#include "jmutex.h"
 #include <map>
+#include <list>
+#include <vector>
 
 /////////////////// Mapgen flags
 #define MG_TREES         0x01
@@ -46,6 +49,8 @@ class ManualMapVoxelManipulator;
 class VoxelManipulator;
 class INodeDefManager;
 class BlockMakeData;
+class MapgenWorkerPool;
+class MapgenWorkerThread;
 
 struct MapgenParams {
 	std::string mg_name;
@@ -74,6 +79,9 @@ class Mapgen {
 	int id;
 	ManualMapVoxelManipulator *vm;
 	INodeDefManager *ndef;
+	// Set by the EmergeThread if makeChunk() may split its work across
+	// these threads, NULL otherwise
+	MapgenWorkerPool *workers;
 
 	void updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax);
 	void updateLighting(v3s16 nmin, v3s16 nmax);
@@ -87,6 +95,131 @@ class Mapgen {
 	static s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision);
 };
 
+/*
+	Least recently used cache of 2D data of chunk columns, such as noise
+	maps and heightmaps, which are the same for all the chunks stacked
+	in a column. Shared by the mapgens of all the EmergeThreads.
+
+	A thread that misses the cache is expected to compute the data and
+	put() it, or abandon() the column if it fails to; other threads
+	asking for the same column meanwhile wait for it instead of
+	computing it too.
+*/
+class MapgenColumnCache {
+public:
+	MapgenColumnCache(u32 max_columns);
+	~MapgenColumnCache();
+
+	/*
+		Copies count floats of the column to dst and returns true, or
+		returns false if the caller has to compute them and put() them
+	*/
+	bool get(v2s16 column, float *dst, u32 count);
+	void put(v2s16 column, const float *src, u32 count);
+	// Drops a column that missed the cache without putting it
+	void abandon(v2s16 column);
+
+private:
+	struct Entry {
+		std::vector<float> data;
+		bool ready;
+		// Removed from the cache by abandon()
+		bool abandoned;
+		// Threads waiting for the data or copying it
+		u32 users;
+		// Locked by the thread computing the data until put()
+		JMutex compute_mutex;
+		std::list<v2s16>::iterator lru;
+	};
+
+	void touch(Entry *e);
+	void evict();
+
+	u32 m_max_columns;
+	JMutex m_mutex;
+	std::map<v2s16, Entry *> m_entries;
+	// Most recently used first
+	std::list<v2s16> m_lru;
+};
+
+/*
+	Abandons a column that missed the cache unless it gets put(), so
+	that the threads waiting for it are released if computing it throws
+*/
+class MapgenColumnCacheGuard {
+public:
+	MapgenColumnCacheGuard(MapgenColumnCache *cache, v2s16 column):
+		m_cache(cache),
+		m_column(column),
+		m_put(false)
+	{}
+
+	~MapgenColumnCacheGuard() {
+		if (!m_put)
+			m_cache->abandon(m_column);
+	}
+
+	void put(const float *src, u32 count) {
+		m_cache->put(m_column, src, count);
+		m_put = true;
+	}
+
+private:
+	MapgenColumnCache *m_cache;
+	v2s16 m_column;
+	bool m_put;
+};
+
+/*
+	A part of the generation of a chunk that can be split into parts
+	that are independent of each other
+*/
+class MapgenTask {
+public:
+	virtual ~MapgenTask() {}
+	// Called once for each part; the parts may run at the same time
+	virtual void runPart(u32 part) = 0;
+};
+
+/*
+	Threads that help the mapgens to generate a single chunk faster.
+	Shared by the mapgens of all the EmergeThreads; one task runs at a
+	time.
+*/
+class MapgenWorkerPool {
+public:
+	MapgenWorkerPool(u32 num_threads);
+	~MapgenWorkerPool();
+
+	u32 getThreadCount() { return m_threads.size(); }
+
+	/*
+		Runs the parts 0...nparts-1 of the task on the calling thread
+		and the worker threads, and returns when all of them are done.
+		If the workers are busy with another task, the calling thread
+		runs all the parts.
+	*/
+	void run(MapgenTask *task, u32 nparts);
+
+private:
+	friend class MapgenWorkerThread;
+
+	// Runs parts of the current task until none are left
+	void work();
+
+	std::vector<MapgenWorkerThread *> m_threads;
+	// Signaled once per thread to be woken up
+	Event m_start_event;
+	// Signaled by a thread when it has finished with the task
+	Event m_done_event;
+
+	JMutex m_mutex;
+	// The current task, NULL if none; guarded by m_mutex
+	MapgenTask *m_task;
+	u32 m_nparts;
+	u32 m_next;
+};
+
 struct MapgenFactory {
 	virtual Mapgen *createMapgen(int mgid, MapgenParams *params,
 								 EmergeManager *emerge) = 0;
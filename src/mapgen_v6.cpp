@@ -60,7 +60,13 @@ NoiseParams nparams_v6_def_cave =
 ///////////////////////////////////////////////////////////////////////////////
 
 
-MapgenV6::MapgenV6(int mapgenid, MapgenV6Params *params) {
+// The maps kept in the column cache: the 2D noises and the heightmap
+#define MGV6_COLUMN_MAPS 9
+// The 2D noises, calculated by calculateNoiseMap()
+#define MGV6_NOISE_MAPS 8
+
+
+MapgenV6::MapgenV6(int mapgenid, MapgenV6Params *params, EmergeManager *emerge) {
 	this->generating  = false;
 	this->id       = mapgenid;
 
@@ -84,6 +90,11 @@ MapgenV6::MapgenV6(int mapgenid, MapgenV6Params *params) {
 	noise_mud            = new Noise(params->np_mud,            seed, csize.X, csize.Y);
 	noise_beach          = new Noise(params->np_beach,          seed, csize.X, csize.Y);
 	noise_biome          = new Noise(params->np_biome,          seed, csize.X, csize.Y);
+
+	heightmap    = new float[csize.X * csize.Z];
+	column_cache = emerge->column_cache;
+	workers      = NULL;
+	column_buf   = new float[MGV6_COLUMN_MAPS * csize.X * csize.Z];
 }
 
 
@@ -96,6 +107,9 @@ MapgenV6::~MapgenV6() {
 	delete noise_mud;
 	delete noise_beach;
 	delete noise_biome;
+
+	delete[] heightmap;
+	delete[] column_buf;
 }
 
 
@@ -223,7 +237,7 @@ float MapgenV6::baseTerrainLevelFromMap(int index) {
 
 
 s16 MapgenV6::find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision) {
-	return baseTerrainLevelFromNoise(p2d) + AVERAGE_MUD_AMOUNT;
+	return getGroundLevelAtPoint(p2d);
 }
 
 
@@ -369,6 +383,8 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 	// Create a block-specific seed
 	blockseed = get_blockseed(data->seed, full_node_min);
 
+	g_profiler->avg("MapgenV6: chunks using workers", workers ? 1 : 0);
+
 	// Make some noise
 	calculateNoise();
 
@@ -392,7 +408,7 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 	s16 stone_surface_max_y;
 
 	// Generate general ground level to full area
-	stone_surface_max_y = generateGround();
+	stone_surface_max_y = runStage(MGV6_STAGE_GROUND);
 
 	const s16 max_spread_amount = MAP_BLOCKSIZE;
 	// Limit dirt flow area by 1 because mud is flown into neighbors.
@@ -407,7 +423,7 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 			generateCaves(stone_surface_max_y);
 
 		// Add mud to the central chunk
-		addMud();
+		runStage(MGV6_STAGE_MUD);
 
 		// Add blobs of dirt and gravel underground
 		addDirtGravelBlobs();
@@ -427,7 +443,7 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 	updateLiquid(&data->transforming_liquid, full_node_min, full_node_max);
 
 	// Grow grass
-	growGrass();
+	runStage(MGV6_STAGE_GRASS);
 
 	// Generate some trees
 	if (flags & MG_TREES)
@@ -443,62 +459,215 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 void MapgenV6::calculateNoise() {
 	int x = node_min.X;
 	int z = node_min.Z;
+	u32 mapsize = csize.X * csize.Z;
+	float *maps[MGV6_COLUMN_MAPS] = {
+		noise_terrain_base->result,
+		noise_terrain_higher->result,
+		noise_steepness->result,
+		noise_height_select->result,
+		noise_trees->result,
+		noise_mud->result,
+		noise_beach->result,
+		noise_biome->result,
+		heightmap
+	};
+
+	// The chunks above and below have the same 2D maps
+	v2s16 column(x, z);
+	bool cached = column_cache->get(column, column_buf,
+		MGV6_COLUMN_MAPS * mapsize);
+	g_profiler->avg("MapgenV6: 2D maps cached", cached ? 1 : 0);
+	if (cached) {
+		for (u32 i = 0; i != MGV6_COLUMN_MAPS; i++)
+			memcpy(maps[i], &column_buf[i * mapsize], mapsize * sizeof(float));
+		return;
+	}
+
+	// Releases the threads waiting for the column if this throws
+	MapgenColumnCacheGuard guard(column_cache, column);
+
+	runStage(MGV6_STAGE_NOISE);
+
+	for (u32 i = 0; i != mapsize; i++)
+		heightmap[i] = baseTerrainLevelFromMap(i);
+
+	for (u32 i = 0; i != MGV6_COLUMN_MAPS; i++)
+		memcpy(&column_buf[i * mapsize], maps[i], mapsize * sizeof(float));
+	guard.put(column_buf, MGV6_COLUMN_MAPS * mapsize);
+}
+
+
+void MapgenV6::calculateNoiseMap(u32 i) {
+	int x = node_min.X;
+	int z = node_min.Z;
 
 	// Need to adjust for the original implementation's +.5 offset...
-	if (!(flags & MG_FLAT)) {
+	switch (i) {
+	case 0:
+		if (flags & MG_FLAT)
+			break;
 		noise_terrain_base->perlinMap2D(
 			x + 0.5 * noise_terrain_base->np->spread.X,
 			z + 0.5 * noise_terrain_base->np->spread.Z);
 		noise_terrain_base->transformNoiseMap();
-
+		break;
+	case 1:
+		if (flags & MG_FLAT)
+			break;
 		noise_terrain_higher->perlinMap2D(
 			x + 0.5 * noise_terrain_higher->np->spread.X,
 			z + 0.5 * noise_terrain_higher->np->spread.Z);
 		noise_terrain_higher->transformNoiseMap();
-
+		break;
+	case 2:
+		if (flags & MG_FLAT)
+			break;
 		noise_steepness->perlinMap2D(
 			x + 0.5 * noise_steepness->np->spread.X,
 			z + 0.5 * noise_steepness->np->spread.Z);
 		noise_steepness->transformNoiseMap();
-
+		break;
+	case 3:
+		if (flags & MG_FLAT)
+			break;
 		noise_height_select->perlinMap2D(
 			x + 0.5 * noise_height_select->np->spread.X,
 			z + 0.5 * noise_height_select->np->spread.Z);
-	}
-	
-	if (flags & MG_TREES) {
+		break;
+	case 4:
+		if (!(flags & MG_TREES))
+			break;
 		noise_trees->perlinMap2D(
 			x + 0.5 * noise_trees->np->spread.X,
 			z + 0.5 * noise_trees->np->spread.Z);
-	}
-		
-	if (!(flags & MG_FLAT)) {
+		break;
+	case 5:
+		if (flags & MG_FLAT)
+			break;
 		noise_mud->perlinMap2D(
 			x + 0.5 * noise_mud->np->spread.X,
 			z + 0.5 * noise_mud->np->spread.Z);
 		noise_mud->transformNoiseMap();
+		break;
+	case 6:
+		noise_beach->perlinMap2D(
+			x + 0.2 * noise_beach->np->spread.X,
+			z + 0.7 * noise_beach->np->spread.Z);
+		break;
+	case 7:
+		noise_biome->perlinMap2D(
+			x + 0.6 * noise_biome->np->spread.X,
+			z + 0.2 * noise_biome->np->spread.Z);
+		break;
+	}
+}
+
+
+/*
+	Runs one stage of makeChunk() over a range of rows, or one noise map.
+	Each column is only touched by the part it is in, and each noise map
+	has its own buffers, so the result does not depend on how the parts
+	are scheduled.
+*/
+class MapgenV6Task : public MapgenTask {
+public:
+	MapgenV6Task(MapgenV6 *mg, MapgenV6Stage stage, u32 nparts):
+		m_mg(mg),
+		m_stage(stage),
+		m_nparts(nparts),
+		m_stone_max(nparts, -MAP_GENERATION_LIMIT)
+	{
+		bool full = (stage == MGV6_STAGE_GRASS);
+		m_zmin = full ? mg->full_node_min.Z : mg->node_min.Z;
+		m_zmax = full ? mg->full_node_max.Z : mg->node_max.Z;
+	}
+
+	void runPart(u32 part) {
+		if (m_stage == MGV6_STAGE_NOISE) {
+			m_mg->calculateNoiseMap(part);
+			return;
+		}
+
+		s32 rows = m_zmax - m_zmin + 1;
+		s16 z0 = m_zmin + rows * part / m_nparts;
+		s16 z1 = m_zmin + rows * (part + 1) / m_nparts - 1;
+		if (z0 > z1)
+			return;
+
+		switch (m_stage) {
+		case MGV6_STAGE_GROUND:
+			m_stone_max[part] = m_mg->generateGround(z0, z1);
+			break;
+		case MGV6_STAGE_MUD:
+			m_mg->addMud(z0, z1);
+			break;
+		case MGV6_STAGE_GRASS:
+			m_mg->growGrass(z0, z1);
+			break;
+		default:
+			break;
+		}
+	}
+
+	int getStoneMax() {
+		int stone_max = -MAP_GENERATION_LIMIT;
+		for (u32 i = 0; i != m_nparts; i++)
+			stone_max = MYMAX(stone_max, m_stone_max[i]);
+		return stone_max;
+	}
+
+private:
+	MapgenV6 *m_mg;
+	MapgenV6Stage m_stage;
+	u32 m_nparts;
+	s16 m_zmin;
+	s16 m_zmax;
+	std::vector<int> m_stone_max;
+};
+
+
+int MapgenV6::runStage(MapgenV6Stage stage) {
+	if (!workers) {
+		switch (stage) {
+		case MGV6_STAGE_NOISE:
+			for (u32 i = 0; i != MGV6_NOISE_MAPS; i++)
+				calculateNoiseMap(i);
+			break;
+		case MGV6_STAGE_GROUND:
+			return generateGround(node_min.Z, node_max.Z);
+		case MGV6_STAGE_MUD:
+			addMud(node_min.Z, node_max.Z);
+			break;
+		case MGV6_STAGE_GRASS:
+			growGrass(full_node_min.Z, full_node_max.Z);
+			break;
+		default:
+			break;
+		}
+		return 0;
 	}
-	noise_beach->perlinMap2D(
-		x + 0.2 * noise_beach->np->spread.X,
-		z + 0.7 * noise_beach->np->spread.Z);
 
-	noise_biome->perlinMap2D(
-		x + 0.6 * noise_biome->np->spread.X,
-		z + 0.2 * noise_biome->np->spread.Z);
+	// A few parts per thread, so that one slow part does not hold up
+	// the whole stage
+	u32 nparts = (stage == MGV6_STAGE_NOISE) ? MGV6_NOISE_MAPS :
+		4 * (workers->getThreadCount() + 1);
+	MapgenV6Task task(this, stage, nparts);
+	workers->run(&task, nparts);
+	return task.getStoneMax();
 }
 
 
-int MapgenV6::generateGround() {
+int MapgenV6::generateGround(s16 z0, s16 z1) {
 	//TimeTaker timer1("Generating ground level");
 	MapNode n_air(CONTENT_AIR), n_water_source(c_water_source);
 	MapNode n_stone(c_stone), n_desert_stone(c_desert_stone);
 	int stone_surface_max_y = -MAP_GENERATION_LIMIT;
-	u32 index = 0;
+	u32 index = (z0 - node_min.Z) * ystride;
 	
-	for (s16 z = node_min.Z; z <= node_max.Z; z++)
+	for (s16 z = z0; z <= z1; z++)
 	for (s16 x = node_min.X; x <= node_max.X; x++, index++) {
 		// Surface height
-		s16 surface_y = (s16)baseTerrainLevelFromMap(index);
+		s16 surface_y = (s16)heightmap[index];
 		
 		// Log it
 		if (surface_y > stone_surface_max_y)
@@ -528,15 +697,15 @@ int MapgenV6::generateGround() {
 }
 
 
-void MapgenV6::addMud() {
+void MapgenV6::addMud(s16 z0, s16 z1) {
 	// 15ms @cs=8
 	//TimeTaker timer1("add mud");
 	MapNode n_dirt(c_dirt), n_gravel(c_gravel);
 	MapNode n_sand(c_sand), n_desert_sand(c_desert_sand);
 	MapNode addnode;
 
-	u32 index = 0;
-	for (s16 z = node_min.Z; z <= node_max.Z; z++)
+	u32 index = (z0 - node_min.Z) * ystride;
+	for (s16 z = z0; z <= z1; z++)
 	for (s16 x = node_min.X; x <= node_max.X; x++, index++) {
 		// Randomize mud amount
 		s16 mud_add_amount = getMudAmount(index) / 2.0 + 0.5;
@@ -813,8 +982,8 @@ void MapgenV6::placeTrees() {
 }
 
 
-void MapgenV6::growGrass() {
-	for (s16 z = full_node_min.Z; z <= full_node_max.Z; z++)
+void MapgenV6::growGrass(s16 z0, s16 z1) {
+	for (s16 z = z0; z <= z1; z++)
 	for (s16 x = full_node_min.X; x <= full_node_max.X; x++) {
 		// Find the lowest surface to which enough light ends up to make
 		// grass grow.  Basically just wait until not air and not leaves.
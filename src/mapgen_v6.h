@@ -31,6 +31,15 @@ enum BiomeType
 	BT_DESERT
 };
 
+// The parts of makeChunk() that can be split across the worker threads
+enum MapgenV6Stage
+{
+	MGV6_STAGE_NOISE,
+	MGV6_STAGE_GROUND,
+	MGV6_STAGE_MUD,
+	MGV6_STAGE_GRASS
+};
+
 extern NoiseParams nparams_v6_def_terrain_base;
 extern NoiseParams nparams_v6_def_terrain_higher;
 extern NoiseParams nparams_v6_def_steepness;
@@ -95,6 +104,12 @@ class MapgenV6 : public Mapgen {
 	Noise *noise_beach;
 	Noise *noise_biome;
 	NoiseParams *np_cave;
+	// Base terrain level of each X,Z of the chunk
+	float *heightmap;
+	// The 2D noise maps and the heightmap are shared with the chunks
+	// above and below through this
+	MapgenColumnCache *column_cache;
+	float *column_buf;
 	float freq_desert;
 	float freq_beach;
 	
@@ -109,7 +124,7 @@ class MapgenV6 : public Mapgen {
 	content_t c_desert_sand;
 	content_t c_desert_stone;
 
-	MapgenV6(int mapgenid, MapgenV6Params *params);
+	MapgenV6(int mapgenid, MapgenV6Params *params, EmergeManager *emerge);
 	~MapgenV6();
 	
 	void makeChunk(BlockMakeData *data);
@@ -138,19 +153,24 @@ class MapgenV6 : public Mapgen {
 	u32 get_blockseed(u64 seed, v3s16 p);
 	
 	
+	// Runs the stage on the worker threads if there are any
+	int runStage(MapgenV6Stage stage);
+
 	void calculateNoise();
-	int generateGround();
-	void addMud();
+	void calculateNoiseMap(u32 i);
+	// These only touch the columns of the rows z0...z1
+	int generateGround(s16 z0, s16 z1);
+	void addMud(s16 z0, s16 z1);
 	void flowMud(s16 &mudflow_minpos, s16 &mudflow_maxpos);
 	void addDirtGravelBlobs();
-	void growGrass();
+	void growGrass(s16 z0, s16 z1);
 	void placeTrees();
 	void generateCaves(int max_stone_y);
 };
 
 struct MapgenFactoryV6 : public MapgenFactory {
 	Mapgen *createMapgen(int mgid, MapgenParams *params, EmergeManager *emerge) {
-		return new MapgenV6(mgid, (MapgenV6Params *)params);
+		return new MapgenV6(mgid, (MapgenV6Params *)params, emerge);
 	};
 	
 	MapgenParams *createMapgenParams() {
@@ -27,6 +27,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/serialize.h"
 #include <string>
 #include <sstream>
+#include <map>
+#include <string.h> // memset
 
 /*
 	MapNode
@@ -396,6 +398,251 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 	}
 }
 
+/*
+	Palette format of bulk node data (version >= 26), zlib-compressed:
+		u16 palette size N
+		u16 content * N
+		u8 bits per node (0 if N == 1)
+		palette indices of all nodes, packed lowest bit first
+		param1 of all nodes (see writeParamArray)
+		param2 of all nodes
+*/
+
+enum ParamArrayMode
+{
+	// u8 value
+	PARAMS_UNIFORM = 0,
+	// u16 run count, runs of (u16 length, u8 value)
+	PARAMS_RLE = 1,
+	// u8 value * count
+	PARAMS_RAW = 2
+};
+
+static void writeParamArray(std::ostream &os, const u8 *values, u32 count)
+{
+	u32 runs = 1;
+	for(u32 i=1; i<count; i++)
+		if(values[i] != values[i-1])
+			runs++;
+
+	if(runs == 1)
+	{
+		writeU8(os, PARAMS_UNIFORM);
+		writeU8(os, values[0]);
+	}
+	else if(2 + runs * 3 < count)
+	{
+		writeU8(os, PARAMS_RLE);
+		writeU16(os, runs);
+		u32 start = 0;
+		for(u32 i=1; i<=count; i++)
+		{
+			if(i == count || values[i] != values[start])
+			{
+				writeU16(os, i - start);
+				writeU8(os, values[start]);
+				start = i;
+			}
+		}
+	}
+	else
+	{
+		writeU8(os, PARAMS_RAW);
+		os.write((const char*)values, count);
+	}
+}
+
+static void readParamArray(std::istream &is, u8 *values, u32 count)
+{
+	u8 mode = readU8(is);
+	if(mode == PARAMS_UNIFORM)
+	{
+		memset(values, readU8(is), count);
+	}
+	else if(mode == PARAMS_RLE)
+	{
+		u16 runs = readU16(is);
+		u32 pos = 0;
+		for(u16 i=0; i<runs; i++)
+		{
+			u16 length = readU16(is);
+			u8 value = readU8(is);
+			if(pos + length > count)
+				throw SerializationError("readParamArray: run too long");
+			memset(&values[pos], value, length);
+			pos += length;
+		}
+		if(pos != count)
+			throw SerializationError("readParamArray: runs too short");
+	}
+	else if(mode == PARAMS_RAW)
+	{
+		is.read((char*)values, count);
+	}
+	else
+	{
+		throw SerializationError("readParamArray: invalid mode");
+	}
+	if(is.fail())
+		throw SerializationError("readParamArray: not enough data");
+}
+
+void MapNode::serializeBulkPalette(std::ostream &os,
+		const MapNode *nodes, u32 nodecount,
+		std::vector<content_t> *palette, bool local_ids)
+{
+	/*
+		Build the palette; neighbouring nodes are often the same,
+		so the last lookup is cached
+	*/
+	std::vector<u16> indices(nodecount);
+	std::map<content_t, u16> palette_map;
+	content_t last_content = CONTENT_IGNORE;
+	u16 last_index = 0;
+	palette->clear();
+	for(u32 i=0; i<nodecount; i++)
+	{
+		content_t c = nodes[i].param0;
+		if(c != last_content || palette->empty())
+		{
+			std::map<content_t, u16>::iterator n = palette_map.find(c);
+			if(n != palette_map.end())
+			{
+				last_index = n->second;
+			}
+			else
+			{
+				last_index = palette->size();
+				palette_map[c] = last_index;
+				palette->push_back(c);
+			}
+			last_content = c;
+		}
+		indices[i] = last_index;
+	}
+
+	std::ostringstream tmp(std::ios_base::binary);
+
+	writeU16(tmp, palette->size());
+	for(u32 i=0; i<palette->size(); i++)
+		writeU16(tmp, local_ids ? i : (*palette)[i]);
+
+	u8 bits = 0;
+	while((1U << bits) < palette->size())
+		bits++;
+	writeU8(tmp, bits);
+	if(bits != 0)
+	{
+		std::string packed;
+		packed.reserve((nodecount * bits + 7) / 8);
+		u32 acc = 0;
+		u32 accbits = 0;
+		for(u32 i=0; i<nodecount; i++)
+		{
+			acc |= (u32)indices[i] << accbits;
+			accbits += bits;
+			while(accbits >= 8)
+			{
+				packed.push_back((char)(acc & 0xff));
+				acc >>= 8;
+				accbits -= 8;
+			}
+		}
+		if(accbits != 0)
+			packed.push_back((char)(acc & 0xff));
+		tmp.write(packed.c_str(), packed.size());
+	}
+
+	std::vector<u8> params(nodecount);
+	for(u32 i=0; i<nodecount; i++)
+		params[i] = nodes[i].param1;
+	writeParamArray(tmp, &params[0], nodecount);
+	for(u32 i=0; i<nodecount; i++)
+		params[i] = nodes[i].param2;
+	writeParamArray(tmp, &params[0], nodecount);
+
+	compressZlib(tmp.str(), os);
+}
+
+void MapNode::serializeBulkUniform(std::ostream &os, const MapNode &n,
+		bool local_ids, std::vector<content_t> *palette)
+{
+	palette->clear();
+	palette->push_back(n.param0);
+
+	std::ostringstream tmp(std::ios_base::binary);
+	writeU16(tmp, 1);
+	writeU16(tmp, local_ids ? 0 : n.param0);
+	writeU8(tmp, 0); // bits
+	writeU8(tmp, PARAMS_UNIFORM);
+	writeU8(tmp, n.param1);
+	writeU8(tmp, PARAMS_UNIFORM);
+	writeU8(tmp, n.param2);
+
+	compressZlib(tmp.str(), os);
+}
+
+void MapNode::deSerializeBulkPalette(std::istream &is,
+		MapNode *nodes, u32 nodecount)
+{
+	std::ostringstream os(std::ios_base::binary);
+	decompressZlib(is, os);
+	std::istringstream tmp(os.str(), std::ios_base::binary);
+
+	u16 palette_size = readU16(tmp);
+	if(palette_size == 0 || palette_size > nodecount)
+		throw SerializationError("deSerializeBulkPalette: "
+				"invalid palette size");
+	std::vector<content_t> palette(palette_size);
+	for(u32 i=0; i<palette_size; i++)
+		palette[i] = readU16(tmp);
+
+	u8 bits = readU8(tmp);
+	if(tmp.fail() || bits > 16 || (1U << bits) < palette_size)
+		throw SerializationError("deSerializeBulkPalette: "
+				"invalid palette");
+	if(bits == 0)
+	{
+		for(u32 i=0; i<nodecount; i++)
+			nodes[i].param0 = palette[0];
+	}
+	else
+	{
+		std::string packed((nodecount * bits + 7) / 8, '\0');
+		tmp.read(&packed[0], packed.size());
+		if(tmp.fail())
+			throw SerializationError("deSerializeBulkPalette: "
+					"not enough data");
+		const u8 *p = (const u8*)packed.c_str();
+		u32 mask = (1U << bits) - 1;
+		u32 acc = 0;
+		u32 accbits = 0;
+		for(u32 i=0; i<nodecount; i++)
+		{
+			while(accbits < bits)
+			{
+				acc |= (u32)*p++ << accbits;
+				accbits += 8;
+			}
+			u32 index = acc & mask;
+			acc >>= bits;
+			accbits -= bits;
+			if(index >= palette_size)
+				throw SerializationError("deSerializeBulkPalette: "
+						"invalid palette index");
+			nodes[i].param0 = palette[index];
+		}
+	}
+
+	std::vector<u8> params(nodecount);
+	readParamArray(tmp, &params[0], nodecount);
+	for(u32 i=0; i<nodecount; i++)
+		nodes[i].param1 = params[i];
+	readParamArray(tmp, &params[0], nodecount);
+	for(u32 i=0; i<nodecount; i++)
+		nodes[i].param2 = params[i];
+}
+
 /*
 	Legacy serialization
 */
@@ -215,6 +215,20 @@ struct MapNode
 			MapNode *nodes, u32 nodecount,
 			u8 content_width, u8 params_width, bool compressed);
 
+	// Serializes or deserializes a list of nodes in the palette format
+	// used from version 26 on; see mapnode.cpp. Output is compressed.
+	//   palette = receives the distinct contents in order of appearance
+	//   local_ids = true to write palette indices instead of contents
+	//               into the palette (for use with a NameIdMapping)
+	static void serializeBulkPalette(std::ostream &os,
+			const MapNode *nodes, u32 nodecount,
+			std::vector<content_t> *palette, bool local_ids);
+	static void deSerializeBulkPalette(std::istream &is,
+			MapNode *nodes, u32 nodecount);
+	// Same output as serializeBulkPalette() for a block of only node n
+	static void serializeBulkUniform(std::ostream &os, const MapNode &n,
+			bool local_ids, std::vector<content_t> *palette);
+
 private:
 	// Deprecated serialization methods
 	void deSerialize_pre22(u8 *source, u8 version);
@@ -0,0 +1,265 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapsaver.h"
+#include "map.h"
+#include "mapblock.h"
+#include "main.h" // For g_profiler
+#include "profiler.h"
+#include "log.h"
+#include "debug.h"
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+MapSaveThread::MapSaveThread(ServerMap *map, u32 queue_limit):
+	SimpleThread(),
+	m_map(map),
+	m_queue_limit(queue_limit),
+	m_waiters(0),
+	m_accepting(false)
+{
+	m_queue_mutex.Init();
+	m_process_mutex.Init();
+}
+
+MapSaveThread::~MapSaveThread()
+{
+	stop();
+
+	// Nothing should be left, but don't leak if writing failed
+	for(std::map<v3s16, MapBlock*>::iterator i = m_queue.begin();
+			i != m_queue.end(); ++i)
+		delete i->second;
+}
+
+void MapSaveThread::queueBlock(MapBlock *snapshot)
+{
+	u32 queue_size;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+
+		std::map<v3s16, MapBlock*>::iterator n =
+				m_queue.find(snapshot->getPos());
+		if(n != m_queue.end())
+		{
+			// Superseded by the new snapshot
+			delete n->second;
+			n->second = snapshot;
+		}
+		else
+		{
+			m_queue[snapshot->getPos()] = snapshot;
+		}
+		queue_size = m_queue.size();
+	}
+	m_queue_event.signal();
+
+	g_profiler->avg("MapSaveThread: queue depth", queue_size);
+
+	/*
+		Backpressure: don't let the server thread produce snapshots
+		faster than they can be written
+	*/
+	if(queue_size >= m_queue_limit)
+	{
+		ScopeProfiler sp(g_profiler, "MapSaveThread: backpressure wait");
+		while(getQueueSize() >= m_queue_limit / 2)
+			waitForWrite();
+	}
+}
+
+void MapSaveThread::waitForWrite()
+{
+	bool accepting;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		accepting = m_accepting;
+		if(accepting)
+			m_waiters++;
+	}
+	if(!accepting)
+	{
+		processQueue();
+		return;
+	}
+	m_queue_event.signal();
+	m_written_event.wait();
+}
+
+void MapSaveThread::wakeWaitersNoLock()
+{
+	for(; m_waiters != 0; m_waiters--)
+		m_written_event.signal();
+}
+
+void MapSaveThread::waitForBlock(v3s16 p)
+{
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			if(m_queue.find(p) == m_queue.end() &&
+					m_writing.find(p) == m_writing.end())
+				return;
+		}
+		waitForWrite();
+	}
+}
+
+void MapSaveThread::waitForArea(v3s16 minp, v3s16 maxp)
+{
+	for(;;)
+	{
+		bool pending = false;
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			v3s16 p;
+			for(p.Z=minp.Z; p.Z<=maxp.Z && !pending; p.Z++)
+			for(p.Y=minp.Y; p.Y<=maxp.Y && !pending; p.Y++)
+			for(p.X=minp.X; p.X<=maxp.X && !pending; p.X++)
+			{
+				if(m_queue.find(p) != m_queue.end() ||
+						m_writing.find(p) != m_writing.end())
+					pending = true;
+			}
+		}
+		if(!pending)
+			return;
+		waitForWrite();
+	}
+}
+
+void MapSaveThread::flush()
+{
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			if(m_queue.empty() && m_writing.empty())
+				return;
+		}
+		waitForWrite();
+	}
+}
+
+void MapSaveThread::stop()
+{
+	setRun(false);
+	m_queue_event.signal();
+	SimpleThread::stop();
+}
+
+u32 MapSaveThread::getQueueSize()
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	return m_queue.size();
+}
+
+u32 MapSaveThread::processQueue()
+{
+	// The thread and waiters that write the queue themselves
+	JMutexAutoLock processlock(m_process_mutex);
+
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		assert(m_writing.empty());
+		m_writing.swap(m_queue);
+	}
+
+	if(m_writing.empty())
+	{
+		// Something may have been written by another call meanwhile
+		JMutexAutoLock lock(m_queue_mutex);
+		wakeWaitersNoLock();
+		return 0;
+	}
+
+	u32 written = 0;
+	{
+		ScopeProfiler sp(g_profiler, "MapSaveThread: commit latency",
+				SPT_AVG);
+
+		m_map->beginDatabaseSave();
+		for(std::map<v3s16, MapBlock*>::iterator i = m_writing.begin();
+				i != m_writing.end(); ++i)
+		{
+			MapBlock *block = i->second;
+			try{
+				if(m_map->writeBlock(block))
+					written++;
+			}
+			catch(std::exception &e)
+			{
+				errorstream<<"MapSaveThread: Failed to save block "
+						<<PP(i->first)<<": "<<e.what()<<std::endl;
+			}
+		}
+		m_map->endDatabaseSave();
+	}
+
+	g_profiler->avg("MapSaveThread: blocks per commit", written);
+
+	JMutexAutoLock lock(m_queue_mutex);
+	for(std::map<v3s16, MapBlock*>::iterator i = m_writing.begin();
+			i != m_writing.end(); ++i)
+		delete i->second;
+	m_writing.clear();
+	wakeWaitersNoLock();
+
+	return written;
+}
+
+void *MapSaveThread::Thread()
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		m_accepting = true;
+	}
+
+	ThreadStarted();
+
+	log_register_thread("MapSaveThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		m_queue_event.wait();
+		processQueue();
+	}
+
+	// Flush on shutdown
+	processQueue();
+
+	// Waiters that come after this write the queue themselves
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		m_accepting = false;
+		wakeWaitersNoLock();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
+
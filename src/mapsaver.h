@@ -0,0 +1,97 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPSAVER_HEADER
+#define MAPSAVER_HEADER
+
+#include <map>
+#include "irr_v3d.h"
+#include "util/container.h"
+#include "util/thread.h"
+
+class ServerMap;
+class MapBlock;
+
+/*
+	Write-behind saver for ServerMap.
+
+	The server thread only queues snapshots of modified blocks (see
+	MapBlock::createSnapshot()); this thread serializes and compresses
+	them and writes everything that is queued in a single transaction.
+
+	A newer snapshot of a block replaces a queued older one. If the
+	queue grows over the limit, queueBlock() blocks until the thread
+	has caught up.
+*/
+
+class MapSaveThread : public SimpleThread
+{
+public:
+	MapSaveThread(ServerMap *map, u32 queue_limit);
+	~MapSaveThread();
+
+	void *Thread();
+
+	// Takes ownership of the snapshot
+	void queueBlock(MapBlock *snapshot);
+
+	// Waits until the block at p is not queued or being written.
+	// Call before reading the block back from the database.
+	void waitForBlock(v3s16 p);
+	// Same for all blocks in the area minp...maxp (inclusive)
+	void waitForArea(v3s16 minp, v3s16 maxp);
+
+	// Waits until everything queued so far is written
+	void flush();
+
+	// Writes out the queue and stops the thread
+	void stop();
+
+	u32 getQueueSize();
+
+private:
+	// Writes all queued blocks in one transaction; one caller at a time.
+	// Returns the number of blocks written.
+	u32 processQueue();
+	// Waits until the thread has written what was queued, or writes it
+	// if the thread is not running
+	void waitForWrite();
+	// Call with m_queue_mutex locked
+	void wakeWaitersNoLock();
+
+	ServerMap *m_map;
+	u32 m_queue_limit;
+
+	// Locked by processQueue(); taken before m_queue_mutex
+	JMutex m_process_mutex;
+	JMutex m_queue_mutex;
+	Event m_queue_event;
+	// Snapshots waiting to be written
+	std::map<v3s16, MapBlock*> m_queue;
+	// Snapshots currently being written
+	std::map<v3s16, MapBlock*> m_writing;
+	// Signaled once for each waiter when a write is done
+	Event m_written_event;
+	u32 m_waiters;
+	// Whether the thread is there to wake up waiters
+	bool m_accepting;
+};
+
+#endif
+
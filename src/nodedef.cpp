@@ -349,6 +349,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 public:
 	void clear()
 	{
+		m_revision++;
 		m_name_id_mapping.clear();
 		m_name_id_mapping_with_aliases.clear();
 
@@ -404,7 +405,8 @@ class CNodeDefManager: public IWritableNodeDefManager
 		}
 		return CONTENT_IGNORE;
 	}
-	CNodeDefManager()
+	CNodeDefManager():
+		m_revision(0)
 	{
 		clear();
 	}
@@ -469,6 +471,10 @@ class CNodeDefManager: public IWritableNodeDefManager
 		getId(name, id);
 		return get(id);
 	}
+	virtual u32 getRevision() const
+	{
+		return m_revision;
+	}
 	// IWritableNodeDefManager
 	virtual void set(content_t c, const ContentFeatures &def)
 	{
@@ -493,6 +499,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 		m_content_features[c] = def;
 		if(def.name != "")
 			addNameIdMapping(c, def.name);
+		m_revision++;
 	}
 	virtual content_t set(const std::string &name,
 			const ContentFeatures &def)
@@ -522,6 +529,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 	{
 		std::set<std::string> all = idef->getAll();
 		m_name_id_mapping_with_aliases.clear();
+		m_revision++;
 		for(std::set<std::string>::iterator
 				i = all.begin(); i != all.end(); i++)
 		{
@@ -782,6 +790,8 @@ class CNodeDefManager: public IWritableNodeDefManager
 	// item aliases too. Updated by updateAliases()
 	// Note: Not serialized.
 	std::map<std::string, content_t> m_name_id_mapping_with_aliases;
+	// Incremented on every change of the definitions or the names
+	u32 m_revision;
 };
 
 IWritableNodeDefManager* createNodeDefManager()
@@ -267,6 +267,8 @@ class INodeDefManager
 	virtual void getIds(const std::string &name, std::set<content_t> &result)
 			const=0;
 	virtual const ContentFeatures& get(const std::string &name) const=0;
+	// Changes whenever definitions or names of nodes change
+	virtual u32 getRevision() const=0;
 	
 	virtual void serialize(std::ostream &os, u16 protocol_version)=0;
 };
@@ -287,6 +289,8 @@ class IWritableNodeDefManager : public INodeDefManager
 			const=0;
 	// If not found, returns the features of CONTENT_IGNORE
 	virtual const ContentFeatures& get(const std::string &name) const=0;
+	// Changes whenever definitions or names of nodes change
+	virtual u32 getRevision() const=0;
 
 	// Register node definition
 	virtual void set(content_t c, const ContentFeatures &def)=0;
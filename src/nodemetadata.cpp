@@ -36,11 +36,26 @@ NodeMetadata::NodeMetadata(IGameDef *gamedef):
 {
 }
 
+NodeMetadata::NodeMetadata(const NodeMetadata &other):
+	m_stringvars(other.m_stringvars),
+	m_inventory(new Inventory(*other.m_inventory))
+{
+}
+
 NodeMetadata::~NodeMetadata()
 {
 	delete m_inventory;
 }
 
+NodeMetadata & NodeMetadata::operator=(const NodeMetadata &other)
+{
+	if(this == &other)
+		return *this;
+	m_stringvars = other.m_stringvars;
+	*m_inventory = *other.m_inventory;
+	return *this;
+}
+
 void NodeMetadata::serialize(std::ostream &os) const
 {
 	int num_vars = m_stringvars.size();
@@ -191,3 +206,14 @@ void NodeMetadataList::clear()
 	}
 	m_data.clear();
 }
+
+void NodeMetadataList::copyFrom(const NodeMetadataList &other)
+{
+	clear();
+	for(std::map<v3s16, NodeMetadata*>::const_iterator
+			i = other.m_data.begin();
+			i != other.m_data.end(); i++)
+	{
+		m_data[i->first] = new NodeMetadata(*i->second);
+	}
+}
@@ -41,7 +41,9 @@ class NodeMetadata
 {
 public:
 	NodeMetadata(IGameDef *gamedef);
+	NodeMetadata(const NodeMetadata &other);
 	~NodeMetadata();
+	NodeMetadata & operator=(const NodeMetadata &other);
 	
 	void serialize(std::ostream &os) const;
 	void deSerialize(std::istream &is);
@@ -108,6 +110,8 @@ class NodeMetadataList
 	void set(v3s16 p, NodeMetadata *d);
 	// Deletes all
 	void clear();
+	// Deletes all and sets deep copies of the contents of other
+	void copyFrom(const NodeMetadataList &other);
 	
 private:
 	std::map<v3s16, NodeMetadata*> m_data;
@@ -59,11 +59,11 @@ void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
 		writeU16(os, m_data.size());
 	}
 
-	for(std::map<v3s16, NodeTimer>::const_iterator
+	for(std::map<v3s16, Entry>::const_iterator
 			i = m_data.begin();
 			i != m_data.end(); i++){
 		v3s16 p = i->first;
-		NodeTimer t = i->second;
+		NodeTimer t = i->second.get(m_time);
 
 		u16 p16 = p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X;
 		writeU16(os, p16);
@@ -73,7 +73,7 @@ void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
 
 void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 {
-	m_data.clear();
+	clear();
 	
 	if(map_format_version == 24){
 		u8 timer_version = readU8(is);
@@ -123,31 +123,47 @@ void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 			continue;
 		}
 
-		m_data.insert(std::make_pair(p, t));
+		set(p, t);
 	}
 }
 
 std::map<v3s16, NodeTimer> NodeTimerList::step(float dtime)
 {
 	std::map<v3s16, NodeTimer> elapsed_timers;
-	// Increment timers
-	for(std::map<v3s16, NodeTimer>::iterator
-			i = m_data.begin();
-			i != m_data.end(); i++){
-		v3s16 p = i->first;
-		NodeTimer t = i->second;
-		t.elapsed += dtime;
-		if(t.elapsed >= t.timeout)
-			elapsed_timers.insert(std::make_pair(p, t));
-		else
-			i->second = t;
-	}
-	// Delete elapsed timers
-	for(std::map<v3s16, NodeTimer>::const_iterator
-			i = elapsed_timers.begin();
-			i != elapsed_timers.end(); i++){
-		v3s16 p = i->first;
-		m_data.erase(p);
+	m_time += dtime;
+	// Take the elapsed timers off the front of the index
+	while(!m_due.empty() && m_due.begin()->first <= m_time)
+	{
+		v3s16 p = m_due.begin()->second;
+		m_due.erase(m_due.begin());
+		std::map<v3s16, Entry>::iterator n = m_data.find(p);
+		if(n == m_data.end())
+			continue;
+		elapsed_timers.insert(std::make_pair(p, n->second.get(m_time)));
+		m_data.erase(n);
 	}
+	// Restart the clock when it can be done for free
+	if(m_data.empty())
+		m_time = 0;
 	return elapsed_timers;
 }
+
+NodeTimerList & NodeTimerList::operator=(const NodeTimerList &other)
+{
+	if(this == &other)
+		return *this;
+	clear();
+	m_time = other.m_time;
+	for(std::map<v3s16, Entry>::const_iterator
+			i = other.m_data.begin();
+			i != other.m_data.end(); i++)
+		schedule(i->first, i->second);
+	return *this;
+}
+
+void NodeTimerList::schedule(v3s16 p, const Entry &e)
+{
+	Entry &n = m_data[p];
+	n = e;
+	n.due_i = m_due.insert(std::make_pair(n.due(), p));
+}
@@ -49,42 +49,86 @@ class NodeTimer
 
 /*
 	List of timers of all the nodes of a block
+
+	The list keeps its own clock, and the timers are indexed by the time
+	they are due on it, so step() only touches the timers that elapse.
 */
 
 class NodeTimerList
 {
 public:
-	NodeTimerList() {}
+	NodeTimerList(): m_time(0) {}
+	NodeTimerList(const NodeTimerList &other): m_time(0) { *this = other; }
 	~NodeTimerList() {}
+
+	// The index points into the list's own maps, so it is rebuilt
+	NodeTimerList & operator=(const NodeTimerList &other);
 	
 	void serialize(std::ostream &os, u8 map_format_version) const;
 	void deSerialize(std::istream &is, u8 map_format_version);
 	
 	// Get timer
 	NodeTimer get(v3s16 p){
-		std::map<v3s16, NodeTimer>::iterator n = m_data.find(p);
+		std::map<v3s16, Entry>::iterator n = m_data.find(p);
 		if(n == m_data.end())
 			return NodeTimer();
-		return n->second;
+		return n->second.get(m_time);
 	}
 	// Deletes timer
 	void remove(v3s16 p){
-		m_data.erase(p);
+		std::map<v3s16, Entry>::iterator n = m_data.find(p);
+		if(n == m_data.end())
+			return;
+		m_due.erase(n->second.due_i);
+		m_data.erase(n);
 	}
 	// Deletes old timer and sets a new one
 	void set(v3s16 p, NodeTimer t){
-		m_data[p] = t;
+		remove(p);
+		schedule(p, Entry(t, m_time));
 	}
 	// Deletes all timers
 	void clear(){
 		m_data.clear();
+		m_due.clear();
+		m_time = 0;
+	}
+
+	u32 size() const {
+		return m_data.size();
 	}
 
 	// A step in time. Returns map of elapsed timers.
 	std::map<v3s16, NodeTimer> step(float dtime);
 
 private:
-	std::map<v3s16, NodeTimer> m_data;
+	struct Entry
+	{
+		f32 timeout;
+		// Time of the list's clock when the timer was at 0 elapsed
+		double start;
+		// The timer's place in m_due
+		std::multimap<double, v3s16>::iterator due_i;
+
+		Entry(): timeout(0), start(0) {}
+		Entry(const NodeTimer &t, double time):
+			timeout(t.timeout), start(time - t.elapsed) {}
+
+		double due() const {
+			return start + timeout;
+		}
+		NodeTimer get(double time) const {
+			return NodeTimer(timeout, time - start);
+		}
+	};
+
+	void schedule(v3s16 p, const Entry &e);
+
+	// The clock; advanced by step()
+	double m_time;
+	std::map<v3s16, Entry> m_data;
+	// The timers in the order they are due
+	std::multimap<double, v3s16> m_due;
 };
 
 #endif
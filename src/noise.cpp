@@ -22,6 +22,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include "debug.h"
 #include "util/numeric.h"
+#include "porting.h"
+#include "constants.h"
+
+/*
+	SSE2 is part of x86-64 and is used whenever the compiler targets it.
+	The SSE2 code does the same operations in the same order as the
+	scalar code, so the results are the same bit by bit.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || \
+		(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define NOISE_USE_SSE2 1
+	#include <emmintrin.h>
+#else
+	#define NOISE_USE_SSE2 0
+#endif
 
 #define NOISE_MAGIC_X    1619
 #define NOISE_MAGIC_Y    31337
@@ -37,22 +52,152 @@ float cos_lookup[16] = {
 ///////////////////////////////////////////////////////////////////////////////
 
 
-//noise poly:  p(n) = 60493n^3 + 19990303n + 137612589
-float noise2d(int x, int y, int seed) {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
+/*
+	The hash is calculated with unsigned ints; the overflows of signed
+	ones are undefined, and compilers have been seen to optimize the
+	masking away, returning values outside -1...1.
+*/
+static inline float noise_hash(unsigned int n) {
+	n &= 0x7fffffff;
 	n = (n >> 13) ^ n;
 	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)n / 0x40000000;
+	return 1.f - (float)(int)n / 0x40000000;
+}
+
+
+//noise poly:  p(n) = 60493n^3 + 19990303n + 137612589
+float noise2d(int x, int y, int seed) {
+	return noise_hash((unsigned int)NOISE_MAGIC_X * x
+		+ (unsigned int)NOISE_MAGIC_Y * y
+		+ (unsigned int)NOISE_MAGIC_SEED * seed);
 }
 
 
 float noise3d(int x, int y, int z, int seed) {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y + NOISE_MAGIC_Z * z
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
-	n = (n >> 13) ^ n;
-	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)n / 0x40000000;
+	return noise_hash((unsigned int)NOISE_MAGIC_X * x
+		+ (unsigned int)NOISE_MAGIC_Y * y
+		+ (unsigned int)NOISE_MAGIC_Z * z
+		+ (unsigned int)NOISE_MAGIC_SEED * seed);
+}
+
+
+#if NOISE_USE_SSE2
+// Low 32 bits of a * b for each of the four ints (SSE2 has no pmulld)
+static inline __m128i mullo_epi32(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd  = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+	return _mm_unpacklo_epi32(
+		_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		_mm_shuffle_epi32(odd,  _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+
+// noise2d()/noise3d() of four lattice points, given the hash input n
+static inline __m128 noise_sse2(__m128i n) {
+	const __m128i mask = _mm_set1_epi32(0x7fffffff);
+	n = _mm_and_si128(n, mask);
+	n = _mm_xor_si128(_mm_srli_epi32(n, 13), n);
+	__m128i t = mullo_epi32(n, n);
+	t = mullo_epi32(t, _mm_set1_epi32(60493));
+	t = _mm_add_epi32(t, _mm_set1_epi32(19990303));
+	t = mullo_epi32(n, t);
+	t = _mm_add_epi32(t, _mm_set1_epi32(1376312589));
+	n = _mm_and_si128(t, mask);
+	// Dividing by a power of two is exact, so this is the same as the
+	// division in noise2d()
+	__m128 f = _mm_mul_ps(_mm_cvtepi32_ps(n),
+		_mm_set1_ps(1.f / 0x40000000));
+	return _mm_sub_ps(_mm_set1_ps(1.f), f);
+}
+#endif
+
+
+// The hash input grows by NOISE_MAGIC_X along a row
+static void noise_row(unsigned int n0, int count, float *out) {
+	int i = 0;
+#if NOISE_USE_SSE2
+	__m128i n = _mm_add_epi32(_mm_set1_epi32(n0),
+		_mm_setr_epi32(0, NOISE_MAGIC_X, 2 * NOISE_MAGIC_X, 3 * NOISE_MAGIC_X));
+	const __m128i step = _mm_set1_epi32(4 * NOISE_MAGIC_X);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(out + i, noise_sse2(n));
+		n = _mm_add_epi32(n, step);
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = noise_hash(n0 + (unsigned int)NOISE_MAGIC_X * i);
+}
+
+
+void noise2d_row(int x, int y, int seed, int count, float *out) {
+	noise_row((unsigned int)NOISE_MAGIC_X * x + (unsigned int)NOISE_MAGIC_Y * y
+		+ (unsigned int)NOISE_MAGIC_SEED * seed, count, out);
+}
+
+
+void noise3d_row(int x, int y, int z, int seed, int count, float *out) {
+	noise_row((unsigned int)NOISE_MAGIC_X * x + (unsigned int)NOISE_MAGIC_Y * y
+		+ (unsigned int)NOISE_MAGIC_Z * z + (unsigned int)NOISE_MAGIC_SEED * seed,
+		count, out);
+}
+
+
+// out = a + (b - a) * t
+static void lerp_row(const float *a, const float *b, float t,
+		int count, float *out) {
+	int i = 0;
+#if NOISE_USE_SSE2
+	__m128 vt = _mm_set1_ps(t);
+	for (; i + 4 <= count; i += 4) {
+		__m128 va = _mm_loadu_ps(a + i);
+		__m128 vb = _mm_loadu_ps(b + i);
+		_mm_storeu_ps(out + i,
+			_mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vt)));
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = a[i] + (b[i] - a[i]) * t;
+}
+
+
+// The same as lerp_row(lerp_row(a, b, t), lerp_row(c, d, t), s)
+static void lerp_rows(const float *a, const float *b,
+		const float *c, const float *d, float t, float s,
+		int count, float *out) {
+	int i = 0;
+#if NOISE_USE_SSE2
+	__m128 vt = _mm_set1_ps(t);
+	__m128 vs = _mm_set1_ps(s);
+	for (; i + 4 <= count; i += 4) {
+		__m128 va = _mm_loadu_ps(a + i);
+		__m128 vb = _mm_loadu_ps(b + i);
+		__m128 vc = _mm_loadu_ps(c + i);
+		__m128 vd = _mm_loadu_ps(d + i);
+		__m128 u = _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vt));
+		__m128 v = _mm_add_ps(vc, _mm_mul_ps(_mm_sub_ps(vd, vc), vt));
+		_mm_storeu_ps(out + i,
+			_mm_add_ps(u, _mm_mul_ps(_mm_sub_ps(v, u), vs)));
+	}
+#endif
+	for (; i < count; i++) {
+		float u = a[i] + (b[i] - a[i]) * t;
+		float v = c[i] + (d[i] - c[i]) * t;
+		out[i] = u + (v - u) * s;
+	}
+}
+
+
+// out += src * g
+static void add_scaled_row(const float *src, float g, int count, float *out) {
+	int i = 0;
+#if NOISE_USE_SSE2
+	__m128 vg = _mm_set1_ps(g);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i),
+			_mm_mul_ps(_mm_loadu_ps(src + i), vg)));
+#endif
+	for (; i < count; i++)
+		out[i] += src[i] * g;
 }
 
 
@@ -287,10 +432,13 @@ void Noise::init(NoiseParams *np, int seed, int sx, int sy, int sz) {
 	this->sz   = sz;
 
 	this->noisebuf = NULL;
+	this->xbuf     = NULL;
 	resizeNoiseBuf(sz > 1);
 
-	this->buf    = new float[sx * sy * sz];
-	this->result = new float[sx * sy * sz];
+	this->buf     = new float[sx * sy * sz];
+	this->result  = new float[sx * sy * sz];
+	this->xindex  = new int[sx];
+	this->xweight = new float[sx];
 }
 
 
@@ -298,6 +446,9 @@ Noise::~Noise() {
 	delete[] buf;
 	delete[] result;
 	delete[] noisebuf;
+	delete[] xbuf;
+	delete[] xindex;
+	delete[] xweight;
 }
 
 
@@ -311,13 +462,16 @@ void Noise::setSize(int sx, int sy, int sz) {
 	this->sy = sy;
 	this->sz = sz;
 
-	this->noisebuf = NULL;
 	resizeNoiseBuf(sz > 1);
 
 	delete[] buf;
 	delete[] result;
-	this->buf    = new float[sx * sy * sz];
-	this->result = new float[sx * sy * sz];
+	delete[] xindex;
+	delete[] xweight;
+	this->buf     = new float[sx * sy * sz];
+	this->result  = new float[sx * sy * sz];
+	this->xindex  = new int[sx];
+	this->xweight = new float[sx];
 }
 
 
@@ -353,63 +507,70 @@ void Noise::resizeNoiseBuf(bool is3d) {
 	if (noisebuf)
 		delete[] noisebuf;
 	noisebuf = new float[nlx * nly * nlz];
+
+	//X-interpolated lattice rows: all of them for 2D, those of two
+	//lattice planes for 3D
+	if (xbuf)
+		delete[] xbuf;
+	xbuf = new float[(is3d ? 2 : 1) * nly * sx];
 }
 
 
 /*
- * NB:  This algorithm is not optimal in terms of space complexity.  The entire
- * integer lattice of noise points could be done as 2 lines instead, and for 3D,
- * 2 lines + 2 planes.
- * However, this would require the noise calls to be interposed with the
- * interpolation loops, which may trash the icache, leading to lower overall
- * performance.
- * Another optimization that could save half as many noise calls is to carry over
- * values from the previous noise lattice as midpoints in the new lattice for the
- * next octave.
+ * The lattice is computed a row at a time (noise2d_row, noise3d_row).
+ * The X coordinate of a map point determines the lattice column and the
+ * weight to interpolate with, and these are the same for every row of
+ * the map; so they are computed first, each lattice row is interpolated
+ * along X only once, and the map rows are then interpolated between
+ * those. The order of the operations is the same as in
+ * biLinearInterpolation() and triLinearInterpolation().
+ *
+ * NB: For 3D, lattice planes are interpolated along X as the map
+ * reaches them, to keep xbuf small.
  */
 #define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed) {
-	float v00, v01, v10, v11, u, v, orig_u;
-	int index, i, j, x0, y0, noisex, noisey;
+	float v, u;
+	int i, j, x0, y0, noisex, noisey;
 	int nlx, nly;
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (int)(u + sx * step_x) + 2;
 	nly = (int)(v + sy * step_y) + 2;
-	index = 0;
 	for (j = 0; j != nly; j++)
-		for (i = 0; i != nlx; i++)
-			noisebuf[index++] = noise2d(x0 + i, y0 + j, seed);
+		noise2d_row(x0, y0 + j, seed, nlx, &noisebuf[idx(0, j)]);
+
+	//calculate the lattice column and weight of each X
+	noisex = 0;
+	for (i = 0; i != sx; i++) {
+		xindex[i]  = noisex;
+		xweight[i] = easeCurve(u);
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
 
-	//calculate interpolations
-	index  = 0;
+	//interpolate lattice rows along X
+	for (j = 0; j != nly; j++) {
+		float *row  = &noisebuf[idx(0, j)];
+		float *xrow = &xbuf[j * sx];
+		for (i = 0; i != sx; i++)
+			xrow[i] = linearInterpolation(row[xindex[i]],
+				row[xindex[i] + 1], xweight[i]);
+	}
+
+	//interpolate map rows along Y
 	noisey = 0;
 	for (j = 0; j != sy; j++) {
-		v00 = noisebuf[idx(0, noisey)];
-		v10 = noisebuf[idx(1, noisey)];
-		v01 = noisebuf[idx(0, noisey + 1)];
-		v11 = noisebuf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			buf[index++] = biLinearInterpolation(v00, v10, v01, v11, u, v);
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noisebuf[idx(noisex + 1, noisey)];
-				v11 = noisebuf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+		lerp_row(&xbuf[noisey * sx], &xbuf[(noisey + 1) * sx],
+			easeCurve(v), sx, &buf[j * sx]);
 
 		v += step_y;
 		if (v >= 1.0) {
@@ -425,11 +586,10 @@ void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed
 void Noise::gradientMap3D(float x, float y, float z,
 						  float step_x, float step_y, float step_z,
 						  int seed) {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	int index, i, j, k, x0, y0, z0, noisex, noisey, noisez;
+	float u, v, w, orig_v;
+	int i, j, k, x0, y0, z0, noisex, noisey, noisez, xplane;
 	int nlx, nly, nlz;
+	float *xplanes[2];
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -437,57 +597,63 @@ void Noise::gradientMap3D(float x, float y, float z,
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
 	orig_v = v;
 
 	//calculate noise point lattice
 	nlx = (int)(u + sx * step_x) + 2;
 	nly = (int)(v + sy * step_y) + 2;
 	nlz = (int)(w + sz * step_z) + 2;
-	index = 0;
 	for (k = 0; k != nlz; k++)
 		for (j = 0; j != nly; j++)
-			for (i = 0; i != nlx; i++)
-				noisebuf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
+			noise3d_row(x0, y0 + j, z0 + k, seed, nlx,
+				&noisebuf[idx(0, j, k)]);
+
+	//calculate the lattice column and weight of each X
+	noisex = 0;
+	for (i = 0; i != sx; i++) {
+		xindex[i]  = noisex;
+		xweight[i] = u;
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
 
 	//calculate interpolations
-	index  = 0;
-	noisey = 0;
+	xplanes[0] = &xbuf[0];
+	xplanes[1] = &xbuf[nly * sx];
+	xplane = -1; // Lattice plane in xplanes[0], -1 for none yet
 	noisez = 0;
 	for (k = 0; k != sz; k++) {
+		//interpolate the two lattice planes along X
+		if (xplane != noisez) {
+			int from = 0;
+			if (xplane != -1 && xplane == noisez - 1) {
+				// The second plane becomes the first one
+				float *t = xplanes[0];
+				xplanes[0] = xplanes[1];
+				xplanes[1] = t;
+				from = 1;
+			}
+			xplane = noisez;
+			for (int p = from; p != 2; p++) {
+				for (j = 0; j != nly; j++) {
+					float *row  = &noisebuf[idx(0, j, noisez + p)];
+					float *xrow = &xplanes[p][j * sx];
+					for (i = 0; i != sx; i++)
+						xrow[i] = linearInterpolation(row[xindex[i]],
+							row[xindex[i] + 1], xweight[i]);
+				}
+			}
+		}
+
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
-			v000 = noisebuf[idx(0, noisey,     noisez)];
-			v100 = noisebuf[idx(1, noisey,     noisez)];
-			v010 = noisebuf[idx(0, noisey + 1, noisez)];
-			v110 = noisebuf[idx(1, noisey + 1, noisez)];
-			v001 = noisebuf[idx(0, noisey,     noisez + 1)];
-			v101 = noisebuf[idx(1, noisey,     noisez + 1)];
-			v011 = noisebuf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noisebuf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				buf[index++] = triLinearInterpolation(
-									v000, v100, v010, v110,
-									v001, v101, v011, v111,
-									u, v, w);
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noisebuf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noisebuf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noisebuf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noisebuf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
+			lerp_rows(&xplanes[0][noisey * sx], &xplanes[0][(noisey + 1) * sx],
+				&xplanes[1][noisey * sx], &xplanes[1][(noisey + 1) * sx],
+				v, w, sx, &buf[(k * sy + j) * sx]);
 
 			v += step_y;
 			if (v >= 1.0) {
@@ -508,7 +674,7 @@ void Noise::gradientMap3D(float x, float y, float z,
 
 float *Noise::perlinMap2D(float x, float y) {
 	float f = 1.0, g = 1.0;
-	int i, j, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -520,13 +686,7 @@ float *Noise::perlinMap2D(float x, float y) {
 			f / np->spread.X, f / np->spread.Y,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (j = 0; j != sy; j++) {
-			for (i = 0; i != sx; i++) {
-				result[index] += g * buf[index];
-				index++;
-			}
-		}
+		add_scaled_row(buf, g, sx * sy, result);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -538,7 +698,7 @@ float *Noise::perlinMap2D(float x, float y) {
 
 float *Noise::perlinMap3D(float x, float y, float z) {
 	float f = 1.0, g = 1.0;
-	int i, j, k, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -551,15 +711,7 @@ float *Noise::perlinMap3D(float x, float y, float z) {
 			f / np->spread.X, f / np->spread.Y, f / np->spread.Z,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (k = 0; k != sz; k++) {
-			for (j = 0; j != sy; j++) {
-				for (i = 0; i != sx; i++) {
-					result[index] += g * buf[index];
-					index++;
-				}
-			}
-		}
+		add_scaled_row(buf, g, sx * sy * sz, result);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -580,3 +732,39 @@ void Noise::transformNoiseMap() {
 		}
 	}
 }
+
+
+static void benchmarkNoiseMap(std::ostream &os, const char *name,
+		NoiseParams *np, int sx, int sy, int sz) {
+	Noise noise(np, 1234, sx, sy, sz);
+	u32 count = 0;
+	u32 t0 = porting::getTimeMs();
+	u32 dtime;
+	// Run for at least a second for the 1ms clock to be accurate enough
+	do {
+		if (sz > 1)
+			noise.perlinMap3D(count * sx, 0, 0);
+		else
+			noise.perlinMap2D(count * sx, 0);
+		count++;
+		dtime = porting::getTimeMs() - t0;
+	} while (dtime < 1000);
+
+	os << name << " " << sx << "x" << sy << "x" << sz << ", "
+		<< np->octaves << " octaves: " << (dtime * 1000 / count)
+		<< "us per map, " << ((u64)count * sx * sy * sz * np->octaves
+		/ dtime / 1000) << " M points/s" << std::endl;
+}
+
+
+void benchmarkNoise(std::ostream &os) {
+	// Chunk sizes and parameters like those of the mapgens
+	const int csize = 5 * MAP_BLOCKSIZE;
+	NoiseParams np2d = {-4, 20, v3f(250, 250, 250), 82341, 5, 0.6};
+	NoiseParams np3d = {0, 12, v3f(96, 96, 96), 52534, 4, 0.5};
+
+	os << "Noise maps use " << (NOISE_USE_SSE2 ? "SSE2" : "scalar code")
+		<< std::endl;
+	benchmarkNoiseMap(os, "perlinMap2D", &np2d, csize, csize, 1);
+	benchmarkNoiseMap(os, "perlinMap3D", &np3d, csize, csize, csize);
+}
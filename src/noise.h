@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "debug.h"
 #include "irr_v3d.h"
+#include <iostream>
 
 class PseudoRandom
 {
@@ -84,6 +85,11 @@ class Noise {
 	float *noisebuf;
 	float *buf;
 	float *result;
+	// Lattice rows interpolated along X, and the lattice column and
+	// weight of each X of the map (see gradientMap2D/3D)
+	float *xbuf;
+	int *xindex;
+	float *xweight;
 
 	Noise(NoiseParams *np, int seed, int sx, int sy);
 	Noise(NoiseParams *np, int seed, int sx, int sy, int sz);
@@ -113,6 +119,10 @@ class Noise {
 float noise2d(int x, int y, int seed);
 float noise3d(int x, int y, int z, int seed);
 
+// Fills out[0...count-1] with noise2d(x + i, y, seed)
+void noise2d_row(int x, int y, int seed, int count, float *out);
+void noise3d_row(int x, int y, int z, int seed, int count, float *out);
+
 float noise2d_gradient(float x, float y, int seed);
 float noise3d_gradient(float x, float y, float z, int seed);
 
@@ -156,6 +166,9 @@ inline float easeCurve(float t) {
 		(float)(yoff) + (float)(y) / (np)->spread.Y, \
 		(s) + (np)->seed, (np)->octaves, (np)->persist))
 
+// Times perlinMap2D and perlinMap3D at mapgen chunk sizes
+void benchmarkNoise(std::ostream &os);
+
 #define NoisePerlin3D(np, x, y, z, s) ((np)->offset + (np)->scale * \
 		noise3d_perlin((float)(x) / (np)->spread.X, (float)(y) / (np)->spread.Y, \
 		(float)(z) / (np)->spread.Z, (s) + (np)->seed, (np)->octaves, (np)->persist))
@@ -0,0 +1,311 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "pregenerate.h"
+#include "server.h"
+#include "environment.h"
+#include "map.h"
+#include "mapblock.h"
+#include "emerge.h"
+#include "settings.h"
+#include "filesys.h"
+#include "porting.h"
+#include "log.h"
+#include "util/numeric.h"
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+// Chunk layout of ServerMap::initBlockMake()
+#define PREGEN_CHUNKSIZE 5
+#define PREGEN_CHUNK_OFFSET -2
+
+// Seconds between progress reports and progress file updates
+#define PREGEN_REPORT_INTERVAL 10.0
+
+MapPregenerator::MapPregenerator(Server *server, v3s16 minp, v3s16 maxp):
+	m_server(server),
+	m_minp(minp),
+	m_maxp(maxp)
+{
+	m_progress_path = server->getWorldPath() + DIR_DELIM + "pregenerate.txt";
+}
+
+static v3s16 getChunkPos(v3s16 blockpos)
+{
+	return getContainerPos(blockpos - v3s16(1,1,1) * PREGEN_CHUNK_OFFSET,
+			PREGEN_CHUNKSIZE);
+}
+
+// The block that is requested to get a chunk generated
+static v3s16 getChunkCenterBlock(v3s16 chunkpos)
+{
+	return chunkpos * PREGEN_CHUNKSIZE + v3s16(1,1,1) *
+			(PREGEN_CHUNK_OFFSET + PREGEN_CHUNKSIZE / 2);
+}
+
+static void addColumn(v3s16 cmin, v3s16 cmax, s16 x, s16 z,
+		std::vector<v3s16> &order)
+{
+	if(x < cmin.X || x > cmax.X || z < cmin.Z || z > cmax.Z)
+		return;
+	for(s16 y = cmin.Y; y <= cmax.Y; y++)
+		order.push_back(v3s16(x, y, z));
+}
+
+void MapPregenerator::getChunkOrder(v3s16 cmin, v3s16 cmax,
+		std::vector<v3s16> &order)
+{
+	order.clear();
+	if(cmin.X > cmax.X || cmin.Y > cmax.Y || cmin.Z > cmax.Z)
+		return;
+	s16 cx = cmin.X + (cmax.X - cmin.X) / 2;
+	s16 cz = cmin.Z + (cmax.Z - cmin.Z) / 2;
+	s16 rmax = MYMAX(MYMAX(cx - cmin.X, cmax.X - cx),
+			MYMAX(cz - cmin.Z, cmax.Z - cz));
+	addColumn(cmin, cmax, cx, cz, order);
+	for(s16 r = 1; r <= rmax; r++)
+	{
+		// Go around the ring: -Z side, +X side, +Z side, -X side
+		for(s16 x = cx - r; x <= cx + r; x++)
+			addColumn(cmin, cmax, x, cz - r, order);
+		for(s16 z = cz - r + 1; z <= cz + r; z++)
+			addColumn(cmin, cmax, cx + r, z, order);
+		for(s16 x = cx + r - 1; x >= cx - r; x--)
+			addColumn(cmin, cmax, x, cz + r, order);
+		for(s16 z = cz + r - 1; z >= cz - r + 1; z--)
+			addColumn(cmin, cmax, cx - r, z, order);
+	}
+}
+
+bool MapPregenerator::parseArea(const std::string &s, v3s16 *minp, v3s16 *maxp)
+{
+	std::string t = s;
+	for(u32 i=0; i<t.size(); i++)
+	{
+		if(t[i] == '(' || t[i] == ')' || t[i] == ',')
+			t[i] = ' ';
+	}
+	std::istringstream is(t);
+	s32 v[6];
+	for(u32 i=0; i<6; i++)
+	{
+		if(!(is>>v[i]) || v[i] < -MAP_GENERATION_LIMIT ||
+				v[i] > MAP_GENERATION_LIMIT)
+			return false;
+	}
+	std::string rest;
+	if(is>>rest)
+		return false;
+	*minp = v3s16(MYMIN(v[0], v[3]), MYMIN(v[1], v[4]), MYMIN(v[2], v[5]));
+	*maxp = v3s16(MYMAX(v[0], v[3]), MYMAX(v[1], v[4]), MYMAX(v[2], v[5]));
+	return true;
+}
+
+static std::string posToString(v3s16 p)
+{
+	std::ostringstream os;
+	os<<"("<<p.X<<","<<p.Y<<","<<p.Z<<")";
+	return os.str();
+}
+
+u32 MapPregenerator::loadProgress()
+{
+	if(!fs::PathExists(m_progress_path))
+		return 0;
+	Settings conf;
+	if(!conf.readConfigFile(m_progress_path.c_str()))
+		return 0;
+	// Only continue a run over the same area
+	if(conf.get("minp") != posToString(m_minp) ||
+			conf.get("maxp") != posToString(m_maxp))
+	{
+		infostream<<"MapPregenerator: "<<m_progress_path
+				<<" is for another area, starting over"<<std::endl;
+		return 0;
+	}
+	return conf.getU64("chunks_done");
+}
+
+void MapPregenerator::saveProgress(u32 chunks_done)
+{
+	Settings conf;
+	conf.set("minp", posToString(m_minp));
+	conf.set("maxp", posToString(m_maxp));
+	conf.setU64("chunks_done", chunks_done);
+	std::ofstream os(m_progress_path.c_str(), std::ios_base::binary);
+	conf.writeLines(os);
+	if(!os.good())
+		errorstream<<"MapPregenerator: Failed to write "
+				<<m_progress_path<<std::endl;
+}
+
+bool MapPregenerator::run(bool &kill)
+{
+	EmergeManager *emerge = m_server->getEmergeManager();
+	ServerMap &map = m_server->m_env->getServerMap();
+
+	std::vector<v3s16> order;
+	getChunkOrder(getChunkPos(getNodeBlockPos(m_minp)),
+			getChunkPos(getNodeBlockPos(m_maxp)), order);
+	u32 total = order.size();
+
+	u32 start = 0;
+	try{
+		start = loadProgress();
+	}
+	catch(SettingNotFoundException &e){
+		errorstream<<"MapPregenerator: Invalid "<<m_progress_path
+				<<", starting over"<<std::endl;
+	}
+	if(start > total)
+		start = 0;
+
+	actionstream<<"Pregenerating "<<posToString(m_minp)<<" - "
+			<<posToString(m_maxp)<<": "<<total<<" chunks using "
+			<<emerge->emergethread.size()<<" threads";
+	if(start != 0)
+		actionstream<<", continuing after "<<start;
+	actionstream<<std::endl;
+
+	for(u32 i=0; i<emerge->emergethread.size(); i++)
+		emerge->emergethread[i]->trigger();
+
+	// Indices to order of the chunks queued and not finished yet
+	std::set<u32> pending;
+	u32 next = start;
+	u32 finished = start;
+
+	u64 bytes_at_start = map.getBytesWritten();
+	u32 time_start = porting::getTimeMs();
+	u32 time_prev = time_start;
+	float report_timer = 0.0;
+
+	while(!kill && !m_server->getShutdownRequested())
+	{
+		// Keep the emerge queue full
+		while(next < total)
+		{
+			v3s16 p = getChunkCenterBlock(order[next]);
+			if(blockpos_over_limit(p))
+			{
+				next++;
+				finished++;
+				continue;
+			}
+			if(!emerge->enqueueBlockEmerge(PEER_ID_INEXISTENT, p, true))
+				break;
+			pending.insert(next);
+			next++;
+		}
+
+		// Saving and unloading of the map happen in here
+		u32 time_now = porting::getTimeMs();
+		float dtime = (float)(time_now - time_prev) / 1000.0;
+		time_prev = time_now;
+		m_server->step(dtime);
+		m_server->AsyncRunStep();
+
+		for(std::set<u32>::iterator i = pending.begin();
+				i != pending.end();)
+		{
+			if(emerge->isBlockEmerging(getChunkCenterBlock(order[*i])))
+			{
+				++i;
+				continue;
+			}
+			pending.erase(i++);
+			finished++;
+		}
+
+		// Everything before the first pending one is done
+		u32 done_in_order = pending.empty() ? next : *pending.begin();
+		if(done_in_order == total)
+			break;
+
+		report_timer += dtime;
+		if(report_timer >= PREGEN_REPORT_INTERVAL)
+		{
+			report_timer = 0.0;
+			saveProgress(done_in_order);
+			float seconds = (float)(time_now - time_start) / 1000.0;
+			float rate = (float)(finished - start) / MYMAX(seconds, 0.001f);
+			u32 eta = rate > 0 ? (u32)((total - finished) / rate) : 0;
+			// Formatted separately to not change the flags of actionstream
+			std::ostringstream os;
+			os<<"Pregenerating: "<<finished<<"/"<<total
+					<<" chunks ("<<((u64)finished * 100 / total)<<"%), "
+					<<std::fixed<<std::setprecision(1)<<rate
+					<<" chunks/s, ETA "<<(eta / 3600)<<"h"
+					<<std::setw(2)<<std::setfill('0')<<(eta / 60 % 60)<<"m"
+					<<std::setw(2)<<std::setfill('0')<<(eta % 60)<<"s";
+			actionstream<<os.str()<<std::endl;
+		}
+
+		sleep_ms(10);
+	}
+
+	bool complete = (finished == total && pending.empty());
+
+	// Wait for the queued chunks so that the progress file stays true
+	while(!pending.empty())
+	{
+		// Throws if an EmergeThread has failed
+		m_server->step(0);
+		for(std::set<u32>::iterator i = pending.begin();
+				i != pending.end();)
+		{
+			if(emerge->isBlockEmerging(getChunkCenterBlock(order[*i])))
+			{
+				++i;
+				continue;
+			}
+			pending.erase(i++);
+			finished++;
+		}
+		sleep_ms(10);
+	}
+
+	{
+		JMutexAutoLock envlock(m_server->m_env_mutex);
+		map.save(MOD_STATE_WRITE_NEEDED);
+	}
+	map.flushSaves();
+
+	if(complete)
+		fs::DeleteSingleFileOrEmptyDirectory(m_progress_path);
+	else
+		saveProgress(next);
+
+	float seconds = (float)(porting::getTimeMs() - time_start) / 1000.0;
+	seconds = MYMAX(seconds, 0.001f);
+	float megabytes = (float)(map.getBytesWritten() - bytes_at_start)
+			/ (1024.0 * 1024.0);
+	std::ostringstream os;
+	os<<"Pregenerated "<<(finished - start)<<" chunks in "
+			<<std::fixed<<std::setprecision(1)<<seconds<<"s: "
+			<<((finished - start) / seconds)<<" chunks/s, "
+			<<megabytes<<" MB written ("<<(megabytes / seconds)<<" MB/s)";
+	actionstream<<os.str()<<std::endl;
+	if(!complete)
+		actionstream<<"Pregeneration interrupted; run again to continue"
+				<<std::endl;
+	return complete;
+}
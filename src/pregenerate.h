@@ -0,0 +1,71 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PREGENERATE_HEADER
+#define PREGENERATE_HEADER
+
+#include "irr_v3d.h"
+#include <string>
+#include <vector>
+
+class Server;
+
+/*
+	Generates an area of the map ahead of time with the EmergeThreads
+	of a server that is not serving anybody (--pregenerate).
+
+	The chunks are generated in a spiral from the middle of the area, so
+	that what has been done is a contiguous square at any time. The
+	number of chunks finished in that order is stored in the world
+	directory every now and then, and a run over the same area continues
+	from there.
+*/
+
+class MapPregenerator
+{
+public:
+	// minp and maxp are node positions
+	MapPregenerator(Server *server, v3s16 minp, v3s16 maxp);
+
+	// Returns false if interrupted or on failure
+	bool run(bool &kill);
+
+	/*
+		Lists the chunks between cmin and cmax (chunk positions), going
+		around the middle column in growing rings, all heights of a
+		column at once
+	*/
+	static void getChunkOrder(v3s16 cmin, v3s16 cmax,
+			std::vector<v3s16> &order);
+
+	// Parses "x,y,z x,y,z"; parentheses are allowed
+	static bool parseArea(const std::string &s, v3s16 *minp, v3s16 *maxp);
+
+private:
+	u32 loadProgress();
+	void saveProgress(u32 chunks_done);
+
+	Server *m_server;
+	v3s16 m_minp;
+	v3s16 m_maxp;
+	std::string m_progress_path;
+};
+
+#endif
+
@@ -230,5 +230,31 @@ class ScopeProfiler
 	enum ScopeProfilerType m_type;
 };
 
+/*
+	Locks a mutex for its lifetime like JMutexAutoLock, and adds the
+	time spent waiting for it (in ms) to the profiler as an average.
+	Shows how contended the mutex is.
+*/
+class ProfiledMutexAutoLock
+{
+public:
+	ProfiledMutexAutoLock(JMutex &mutex, Profiler *profiler,
+			const std::string &name):
+		m_mutex(mutex)
+	{
+		TimeTaker timer(name.c_str());
+		m_mutex.Lock();
+		u32 wait_ms = timer.stop(true);
+		if(profiler)
+			profiler->avg(name, wait_ms);
+	}
+	~ProfiledMutexAutoLock()
+	{
+		m_mutex.Unlock();
+	}
+private:
+	JMutex &m_mutex;
+};
+
 #endif
 
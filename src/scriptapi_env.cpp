@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "gamedef.h"
 #include "map.h"
+#include "mapcursor.h"
 #include "daynightratio.h"
 #include "content_sao.h"
 #include "script.h"
@@ -506,6 +507,29 @@ int EnvRef::l_get_timeofday(lua_State *L)
 }
 
 
+// Returns false if no node in the blocks of the area minp...maxp can be
+// any of the contents. Unloaded nodes are CONTENT_IGNORE.
+static bool area_may_contain(MapCursor &cursor, v3s16 minp, v3s16 maxp,
+		const std::set<content_t> &filter)
+{
+	v3s16 bmin = getNodeBlockPos(minp);
+	v3s16 bmax = getNodeBlockPos(maxp);
+	v3s16 bp;
+	for(bp.X=bmin.X; bp.X<=bmax.X; bp.X++)
+	for(bp.Y=bmin.Y; bp.Y<=bmax.Y; bp.Y++)
+	for(bp.Z=bmin.Z; bp.Z<=bmax.Z; bp.Z++)
+	{
+		MapBlock *block = cursor.getBlock(bp);
+		if(block == NULL){
+			if(filter.count(CONTENT_IGNORE) != 0)
+				return true;
+		} else if(block->containsAnyContent(filter)){
+			return true;
+		}
+	}
+	return false;
+}
+
 // EnvRef:find_node_near(pos, radius, nodenames) -> pos or nil
 // nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 int EnvRef::l_find_node_near(lua_State *L)
@@ -531,13 +555,17 @@ int EnvRef::l_find_node_near(lua_State *L)
 		ndef->getIds(lua_tostring(L, 4), filter);
 	}
 
+	MapCursor cursor(&env->getMap());
+	if(!area_may_contain(cursor, pos - v3s16(1,1,1) * radius,
+			pos + v3s16(1,1,1) * radius, filter))
+		return 0;
 	for(int d=1; d<=radius; d++){
 		std::list<v3s16> list;
 		getFacePositions(list, d);
 		for(std::list<v3s16>::iterator i = list.begin();
 				i != list.end(); ++i){
 			v3s16 p = pos + (*i);
-			content_t c = env->getMap().getNodeNoEx(p).getContent();
+			content_t c = cursor.getNodeNoEx(p).getContent();
 			if(filter.count(c) != 0){
 				push_v3s16(L, p);
 				return 1;
@@ -579,18 +607,37 @@ int EnvRef::l_find_nodes_in_area(lua_State *L)
 
 	lua_newtable(L);
 	int table = lua_gettop(L);
-	for(s16 x=minp.X; x<=maxp.X; x++)
-	for(s16 y=minp.Y; y<=maxp.Y; y++)
-	for(s16 z=minp.Z; z<=maxp.Z; z++)
+	// Go through the area block by block, skipping the blocks that
+	// can't contain any of the contents
+	MapCursor cursor(&env->getMap());
+	v3s16 bmin = getNodeBlockPos(minp);
+	v3s16 bmax = getNodeBlockPos(maxp);
+	v3s16 bp;
+	for(bp.X=bmin.X; bp.X<=bmax.X; bp.X++)
+	for(bp.Y=bmin.Y; bp.Y<=bmax.Y; bp.Y++)
+	for(bp.Z=bmin.Z; bp.Z<=bmax.Z; bp.Z++)
 	{
-		v3s16 p(x,y,z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
-		if(filter.count(c) != 0){
-			lua_pushvalue(L, table_insert);
-			lua_pushvalue(L, table);
-			push_v3s16(L, p);
-			if(lua_pcall(L, 2, 0, 0))
-				script_error(L, "error: %s", lua_tostring(L, -1));
+		v3s16 bminp = bp * MAP_BLOCKSIZE;
+		v3s16 bmaxp = bminp + v3s16(1,1,1) * (MAP_BLOCKSIZE - 1);
+		if(!area_may_contain(cursor, bminp, bmaxp, filter))
+			continue;
+		bminp = v3s16(MYMAX(bminp.X, minp.X), MYMAX(bminp.Y, minp.Y),
+				MYMAX(bminp.Z, minp.Z));
+		bmaxp = v3s16(MYMIN(bmaxp.X, maxp.X), MYMIN(bmaxp.Y, maxp.Y),
+				MYMIN(bmaxp.Z, maxp.Z));
+		for(s16 x=bminp.X; x<=bmaxp.X; x++)
+		for(s16 y=bminp.Y; y<=bmaxp.Y; y++)
+		for(s16 z=bminp.Z; z<=bmaxp.Z; z++)
+		{
+			v3s16 p(x,y,z);
+			content_t c = cursor.getNodeNoEx(p).getContent();
+			if(filter.count(c) != 0){
+				lua_pushvalue(L, table_insert);
+				lua_pushvalue(L, table);
+				push_v3s16(L, p);
+				if(lua_pcall(L, 2, 0, 0))
+					script_error(L, "error: %s", lua_tostring(L, -1));
+			}
 		}
 	}
 	return 1;
@@ -45,6 +45,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_nodemeta.h"
 #include "content_abm.h"
 #include "content_sao.h"
+#include "genericobject.h"
 #include "mods.h"
 #include "sha1.h"
 #include "base64.h"
@@ -59,6 +60,48 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "rollback.h"
 #include "util/serialize.h"
 
+/*
+	Removes the messages of a generic object that a later message
+	replaces. A reliable message is only replaced by a reliable one.
+	Returns the number of messages removed.
+*/
+static u32 dropSupersededMessages(std::list<ActiveObjectMessage> &list)
+{
+	u32 dropped = 0;
+	for(std::list<ActiveObjectMessage>::iterator
+			i = list.begin(); i != list.end();)
+	{
+		bool superseded = false;
+		if(!i->datastring.empty())
+		{
+			u8 cmd = i->datastring[0];
+			if(gob_cmd_is_superseded_by_same(cmd))
+			{
+				std::list<ActiveObjectMessage>::iterator j = i;
+				for(++j; j != list.end(); ++j)
+				{
+					if(!j->datastring.empty() && (u8)j->datastring[0] == cmd
+							&& (j->reliable || !i->reliable))
+					{
+						superseded = true;
+						break;
+					}
+				}
+			}
+		}
+		if(superseded)
+		{
+			i = list.erase(i);
+			dropped++;
+		}
+		else
+		{
+			++i;
+		}
+	}
+	return dropped;
+}
+
 void * ServerThread::Thread()
 {
 	ThreadStarted();
@@ -567,6 +610,14 @@ void RemoteClient::GotBlock(v3s16 p)
 
 void RemoteClient::SentBlock(v3s16 p)
 {
+	if(!m_first_block_sent)
+	{
+		m_first_block_sent = true;
+		u32 ms = porting::getTimeMs() - m_connect_time_ms;
+		g_profiler->avg("Server: time to first block (ms)", ms);
+		verbosestream<<"Server: first block sent to peer "<<peer_id
+				<<" after "<<ms<<"ms"<<std::endl;
+	}
 	if(m_blocks_sending.find(p) == m_blocks_sending.end())
 		m_blocks_sending[p] = 0.0;
 	else
@@ -1087,7 +1138,8 @@ void Server::AsyncRunStep()
 	}
 
 	{
-		JMutexAutoLock lock(m_env_mutex);
+		ProfiledMutexAutoLock lock(m_env_mutex, g_profiler,
+				"Server: envlock wait for step (ms)");
 		// Step environment
 		ScopeProfiler sp(g_profiler, "SEnv step");
 		ScopeProfiler sp2(g_profiler, "SEnv step avg", SPT_AVG);
@@ -1100,8 +1152,10 @@ void Server::AsyncRunStep()
 		JMutexAutoLock lock(m_env_mutex);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
+		s32 memory_budget = g_settings->getS32("server_map_memory_budget");
 		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
-				g_settings->getFloat("server_unload_unused_data_timeout"));
+				g_settings->getFloat("server_unload_unused_data_timeout"),
+				NULL, MYMAX(memory_budget, 0));
 	}
 
 	/*
@@ -1255,9 +1309,13 @@ void Server::AsyncRunStep()
 
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
 
-		// Radius inside which objects are active
+		// Radius inside which objects are active, in blocks
 		s16 radius = g_settings->getS16("active_object_send_range_blocks");
-		radius *= MAP_BLOCKSIZE;
+
+		// Objects that may have come into the view of someone
+		std::vector<u16> moved_objects;
+		m_env->takeMovedActiveObjects(moved_objects);
+		g_profiler->avg("Server: moved objects", moved_objects.size());
 
 		for(std::map<u16, RemoteClient*>::iterator
 			i = m_clients.begin();
@@ -1268,7 +1326,10 @@ void Server::AsyncRunStep()
 			// If definitions and textures have not been sent, don't
 			// send objects either
 			if(!client->definitions_sent)
+			{
+				client->m_object_view_valid = false;
 				continue;
+			}
 
 			Player *player = m_env->getPlayer(client->peer_id);
 			if(player==NULL)
@@ -1277,16 +1338,32 @@ void Server::AsyncRunStep()
 				/*infostream<<"WARNING: "<<__FUNCTION_NAME<<": Client "
 						<<client->peer_id
 						<<" has no associated player"<<std::endl;*/
+				client->m_object_view_valid = false;
 				continue;
 			}
-			v3s16 pos = floatToInt(player->getPosition(), BS);
+			v3s16 center = getNodeBlockPos(
+					floatToInt(player->getPosition(), BS));
 
 			std::set<u16> removed_objects;
 			std::set<u16> added_objects;
-			m_env->getRemovedActiveObjects(pos, radius,
+			m_env->getRemovedActiveObjects(center, radius,
 					client->m_known_objects, removed_objects);
-			m_env->getAddedActiveObjects(pos, radius,
-					client->m_known_objects, added_objects);
+			if(client->m_object_view_valid &&
+					client->m_object_view_center == center &&
+					client->m_object_view_radius == radius)
+			{
+				// Only the objects that moved can have come into view
+				m_env->getAddedActiveObjects(center, radius, moved_objects,
+						client->m_known_objects, added_objects);
+			}
+			else
+			{
+				m_env->getAddedActiveObjects(center, radius,
+						client->m_known_objects, added_objects);
+				client->m_object_view_valid = true;
+				client->m_object_view_center = center;
+				client->m_object_view_radius = radius;
+			}
 
 			// Ignore if nothing happened
 			if(removed_objects.size() == 0 && added_objects.size() == 0)
@@ -1436,12 +1513,66 @@ void Server::AsyncRunStep()
 			message_list->push_back(aom);
 		}
 
+		/*
+			Compose the data of each object once for all clients:
+			drop messages that later ones replace, and make the
+			compact variant for clients that support it.
+			Index 0 = data for old clients, 1 = compact.
+		*/
+		std::map<u16, std::string> composed_reliable[2];
+		std::map<u16, std::string> composed_unreliable[2];
+		u32 dropped_count = 0;
+		for(std::map<u16, std::list<ActiveObjectMessage>* >::iterator
+				j = buffered_messages.begin();
+				j != buffered_messages.end(); ++j)
+		{
+			u16 id = j->first;
+			std::list<ActiveObjectMessage>* list = j->second;
+			// Only the generic objects use the GENERIC_CMD_* commands
+			ServerActiveObject *obj = m_env->getActiveObject(id);
+			bool generic = (obj != NULL &&
+					obj->getSendType() == ACTIVEOBJECT_TYPE_GENERIC);
+			if(generic)
+				dropped_count += dropSupersededMessages(*list);
+			for(std::list<ActiveObjectMessage>::iterator
+					k = list->begin(); k != list->end(); ++k)
+			{
+				const ActiveObjectMessage &aom = *k;
+				std::string compact_data = aom.datastring;
+				if(generic && !aom.datastring.empty() &&
+						(u8)aom.datastring[0] == GENERIC_CMD_UPDATE_POSITION)
+					compact_data = gob_cmd_update_position_compact(
+							aom.datastring);
+				// Compose the full new data with header
+				char buf[2];
+				writeU16((u8*)&buf[0], aom.id);
+				std::string header(buf, 2);
+				if(aom.reliable)
+				{
+					composed_reliable[0][id] += header
+							+ serializeString(aom.datastring);
+					composed_reliable[1][id] += header
+							+ serializeString(compact_data);
+				}
+				else
+				{
+					composed_unreliable[0][id] += header
+							+ serializeString(aom.datastring);
+					composed_unreliable[1][id] += header
+							+ serializeString(compact_data);
+				}
+			}
+		}
+		g_profiler->avg("Server: superseded object messages dropped",
+				dropped_count);
+
 		// Route data to every client
 		for(std::map<u16, RemoteClient*>::iterator
 			i = m_clients.begin();
 			i != m_clients.end(); ++i)
 		{
 			RemoteClient *client = i->second;
+			int v = client->net_proto_version >= 17 ? 1 : 0;
 			std::string reliable_data;
 			std::string unreliable_data;
 			// Go through all objects in message buffer
@@ -1453,27 +1584,13 @@ void Server::AsyncRunStep()
 				u16 id = j->first;
 				if(client->m_known_objects.find(id) == client->m_known_objects.end())
 					continue;
-				// Get message list of object
-				std::list<ActiveObjectMessage>* list = j->second;
-				// Go through every message
-				for(std::list<ActiveObjectMessage>::iterator
-						k = list->begin(); k != list->end(); ++k)
-				{
-					// Compose the full new data with header
-					ActiveObjectMessage aom = *k;
-					std::string new_data;
-					// Add object id
-					char buf[2];
-					writeU16((u8*)&buf[0], aom.id);
-					new_data.append(buf, 2);
-					// Add data
-					new_data += serializeString(aom.datastring);
-					// Add data to buffer
-					if(aom.reliable)
-						reliable_data += new_data;
-					else
-						unreliable_data += new_data;
-				}
+				std::map<u16, std::string>::iterator n;
+				n = composed_reliable[v].find(id);
+				if(n != composed_reliable[v].end())
+					reliable_data += n->second;
+				n = composed_unreliable[v].find(id);
+				if(n != composed_unreliable[v].end())
+					unreliable_data += n->second;
 			}
 			/*
 				reliable_data and unreliable_data are now ready.
@@ -1639,6 +1756,28 @@ void Server::AsyncRunStep()
 
 	}
 
+	/*
+		Tell the emerge threads where the players are, so that they
+		generate the blocks nearest to them first
+	*/
+	{
+		JMutexAutoLock envlock(m_env_mutex);
+		JMutexAutoLock conlock(m_con_mutex);
+
+		std::map<u16, v3s16> positions;
+		for(std::map<u16, RemoteClient*>::iterator
+			i = m_clients.begin();
+			i != m_clients.end(); ++i)
+		{
+			Player *player = m_env->getPlayer(i->first);
+			if(player == NULL)
+				continue;
+			positions[i->first] = getNodeBlockPos(
+					floatToInt(player->getPosition(), BS));
+		}
+		m_emerge->setPeerPositions(positions);
+	}
+
 	/*
 		Trigger emergethread (it somehow gets to a non-triggered but
 		bysy state sometimes)
@@ -250,6 +250,9 @@ class RemoteClient
 
 	RemoteClient():
 		m_time_from_building(9999),
+		m_object_view_valid(false),
+		m_object_view_center(0,0,0),
+		m_object_view_radius(0),
 		m_excess_gotblocks(0)
 	{
 		peer_id = 0;
@@ -261,6 +264,8 @@ class RemoteClient
 		m_nearest_unsent_reset_timer = 0.0;
 		m_nothing_to_send_counter = 0;
 		m_nothing_to_send_pause_timer = 0;
+		m_connect_time_ms = porting::getTimeMs();
+		m_first_block_sent = false;
 	}
 	~RemoteClient()
 	{
@@ -317,6 +322,14 @@ class RemoteClient
 	*/
 	std::set<u16> m_known_objects;
 
+	/*
+		The view that all the objects in have been added to
+		m_known_objects for; see ServerEnvironment::getAddedActiveObjects()
+	*/
+	bool m_object_view_valid;
+	v3s16 m_object_view_center;
+	s16 m_object_view_radius;
+
 private:
 	/*
 		Blocks that have been sent to client.
@@ -354,6 +367,10 @@ class RemoteClient
 	// CPU usage optimization
 	u32 m_nothing_to_send_counter;
 	float m_nothing_to_send_pause_timer;
+
+	// For measuring how long a joining player waits for the map
+	u32 m_connect_time_ms;
+	bool m_first_block_sent;
 };
 
 class Server : public con::PeerHandler, public MapEventReceiver,
@@ -775,6 +792,7 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	u16 m_ignore_map_edit_events_peer_id;
 
 	friend class EmergeThread;
+	friend class MapPregenerator;
 	friend class RemoteClient;
 
 	std::map<std::string,MediaInfo> m_media;
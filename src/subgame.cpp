@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "log.h"
 #include "util/string.h"
+#include "mapdatabase.h"
 
 std::string getGameName(const std::string &game_path)
 {
@@ -220,6 +221,7 @@ bool initializeWorld(const std::string &path, const std::string &gameid)
 		fs::CreateAllDirs(path);
 		std::ofstream of(worldmt_path.c_str(), std::ios::binary);
 		of<<"gameid = "<<gameid<<"\n";
+		of<<"backend = "<<MAPDATABASE_DEFAULT_BACKEND<<"\n";
 	}
 	return true;
 }
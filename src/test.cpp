@@ -33,6 +33,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "mapblock.h"
+#include "mapblockindex.h"
+#include "liquidqueue.h"
+#include "nodetimer.h"
+#include "activeobjectindex.h"
+#include "genericobject.h"
+#include "pregenerate.h"
+#include "mapgen.h"
 #include "settings.h"
 #include "log.h"
 #include "util/string.h"
@@ -43,6 +51,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "noise.h" // PseudoRandom used for random data for compression
 #include "clientserver.h" // LATEST_PROTOCOL_VERSION
 #include <algorithm>
+#include <set>
+#include "mapdatabase_sqlite3.h"
 
 /*
 	Asserts that the exception occurs
@@ -474,6 +484,517 @@ struct TestCompress: public TestBase
 	}
 };
 
+struct TestNodePalette: public TestBase
+{
+	void Run()
+	{
+		const u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		std::vector<MapNode> nodes(nodecount);
+		std::vector<MapNode> result(nodecount);
+		std::vector<content_t> palette;
+		PseudoRandom pr(1234);
+		// Uniform, mostly uniform and random data
+		for(u32 round=0; round<3; round++)
+		{
+			for(u32 i=0; i<nodecount; i++)
+			{
+				if(round == 0)
+					nodes[i] = MapNode(CONTENT_AIR, 15, 0);
+				else if(round == 1)
+					nodes[i] = MapNode(i < 1000 ? 5 : 7, i / 100, 0);
+				else
+					nodes[i] = MapNode(pr.range(0, 1000), pr.range(0, 255),
+							pr.range(0, 255));
+			}
+			std::ostringstream os(std::ios_base::binary);
+			MapNode::serializeBulkPalette(os, &nodes[0], nodecount,
+					&palette, false);
+			std::istringstream is(os.str(), std::ios_base::binary);
+			MapNode::deSerializeBulkPalette(is, &result[0], nodecount);
+			for(u32 i=0; i<nodecount; i++)
+			{
+				UASSERT(result[i].getContent() == nodes[i].getContent());
+				UASSERT(result[i].param1 == nodes[i].param1);
+				UASSERT(result[i].param2 == nodes[i].param2);
+			}
+		}
+		UASSERT(palette.size() <= 1001);
+	}
+};
+
+struct TestMapDatabaseKeys: public TestBase
+{
+	void Run()
+	{
+		v3s16 ps[] = {v3s16(0,0,0), v3s16(-1,2,-3), v3s16(2047,-2048,100),
+				v3s16(-2048,2047,-2048)};
+		for(u32 i=0; i<sizeof(ps)/sizeof(ps[0]); i++)
+		{
+			UASSERT(MapDatabaseSQLite3::getIntegerAsBlock(
+					MapDatabaseSQLite3::getBlockAsInteger(ps[i])) == ps[i]);
+			UASSERT(MapDatabaseSQLite3::getMortonIntegerAsBlock(
+					MapDatabaseSQLite3::getBlockAsMortonInteger(ps[i])) == ps[i]);
+		}
+		// An aligned 4x4x4 cube has 64 consecutive Morton keys
+		v3s16 minp(-4,8,-12);
+		v3s16 maxp = minp + v3s16(3,3,3);
+		UASSERT(MapDatabaseSQLite3::getBlockAsMortonInteger(maxp) -
+				MapDatabaseSQLite3::getBlockAsMortonInteger(minp) == 63);
+	}
+};
+
+struct TestUniformMapBlock: public TestBase
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0), NULL);
+		MapNode n_ignore(CONTENT_IGNORE);
+		MapNode n_air(CONTENT_AIR);
+		UASSERT(b.isUniform());
+		UASSERT(!b.isDummy());
+		UASSERT(b.getNode(v3s16(3,4,5)).getContent() == CONTENT_IGNORE);
+
+		// Writing the uniform node keeps the block compact
+		b.setNode(v3s16(1,2,3), n_ignore);
+		UASSERT(b.isUniform());
+
+		// Writing anything else expands it
+		b.setNode(v3s16(1,2,3), n_air);
+		UASSERT(!b.isUniform());
+		UASSERT(b.getNode(v3s16(1,2,3)).getContent() == CONTENT_AIR);
+		UASSERT(b.getNode(v3s16(0,0,0)).getContent() == CONTENT_IGNORE);
+		UASSERT(!b.tryMakeUniform());
+
+		// Once all nodes are the same again it can be compacted
+		b.setNode(v3s16(1,2,3), n_ignore);
+		UASSERT(b.tryMakeUniform());
+		UASSERT(b.getUniformNode().getContent() == CONTENT_IGNORE);
+
+		bool invalid = false;
+		try{
+			b.getNode(v3s16(MAP_BLOCKSIZE,0,0));
+		}
+		catch(InvalidPositionException &e){
+			invalid = true;
+		}
+		UASSERT(invalid);
+	}
+};
+
+struct TestMapBlockContents: public TestBase
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0), NULL);
+		MapNode n_air(CONTENT_AIR);
+		MapNode n_ignore(CONTENT_IGNORE);
+		UASSERT(b.containsContent(CONTENT_IGNORE));
+		UASSERT(!b.containsContent(CONTENT_AIR));
+
+		b.setNode(v3s16(1,2,3), n_air);
+		b.setNode(v3s16(4,5,6), n_air);
+		UASSERT(b.containsContent(CONTENT_AIR));
+		UASSERT(b.containsContent(CONTENT_IGNORE));
+
+		// The content is gone only when its last node is
+		b.setNode(v3s16(1,2,3), n_ignore);
+		UASSERT(b.containsContent(CONTENT_AIR));
+		b.setNode(v3s16(4,5,6), n_ignore);
+		UASSERT(!b.containsContent(CONTENT_AIR));
+
+		std::set<content_t> filter;
+		filter.insert(CONTENT_AIR);
+		UASSERT(!b.containsAnyContent(filter));
+		filter.insert(CONTENT_IGNORE);
+		UASSERT(b.containsAnyContent(filter));
+
+		std::vector<content_t> contents;
+		b.getContents(contents);
+		UASSERT(contents.size() == 1 && contents[0] == CONTENT_IGNORE);
+	}
+};
+
+struct TestMapBlockIndex: public TestBase
+{
+	void Run()
+	{
+		// Blocks are only stored, never dereferenced
+		std::vector<char> storage(4096);
+		MapBlockIndex index;
+		std::map<v3s16, MapBlock*> reference;
+		PseudoRandom pr(4321);
+		for(u32 i=0; i<20000; i++)
+		{
+			// A small range so that positions repeat and collide
+			v3s16 p(pr.range(-12, 12), pr.range(-12, 12), pr.range(-12, 12));
+			if(pr.range(0, 2) == 0)
+			{
+				index.remove(p);
+				reference.erase(p);
+			}
+			else
+			{
+				MapBlock *block = (MapBlock*)&storage[pr.range(0, 4095)];
+				index.insert(p, block);
+				reference[p] = block;
+			}
+		}
+		UASSERT(index.size() == reference.size());
+		for(std::map<v3s16, MapBlock*>::iterator i = reference.begin();
+				i != reference.end(); ++i)
+			UASSERT(index.get(i->first) == i->second);
+		UASSERT(index.get(v3s16(100,100,100)) == NULL);
+		index.clear();
+		UASSERT(index.get(reference.begin()->first) == NULL);
+	}
+};
+
+struct TestLiquidQueue: public TestBase
+{
+	void Run()
+	{
+		LiquidQueue q;
+		// A big flood in block (0,0,0) and one node in block (1,0,0)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+			UASSERT(q.push_back(v3s16(x,0,z)));
+		UASSERT(q.push_back(v3s16(MAP_BLOCKSIZE,0,0)));
+		UASSERT(!q.push_back(v3s16(0,0,0)));
+		UASSERT(q.size() == MAP_BLOCKSIZE*MAP_BLOCKSIZE + 1);
+		UASSERT(q.getRegionCount() == 2);
+		UASSERT(q.getLongestRegion() == MAP_BLOCKSIZE*MAP_BLOCKSIZE);
+		// The first block doesn't get to keep the turn
+		bool other_found = false;
+		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+		{
+			if(q.pop_front() == v3s16(MAP_BLOCKSIZE,0,0))
+			{
+				other_found = true;
+				break;
+			}
+		}
+		UASSERT(other_found);
+		UASSERT(q.getRegionCount() == 1);
+		while(q.size() != 0)
+			UASSERT(getNodeBlockPos(q.pop_front()) == v3s16(0,0,0));
+		UASSERT(q.getRegionCount() == 0);
+
+		// Nodes pushed during an update are left for the next one
+		for(s16 x=0; x<4; x++)
+			UASSERT(q.push_back(v3s16(x,0,0)));
+		q.beginUpdate();
+		u32 popped = 0;
+		while(q.updateSize() != 0)
+		{
+			v3s16 p = q.pop_front();
+			popped++;
+			// The popped node and its neighbour, which may be queued
+			UASSERT(q.push_back(p));
+			q.push_back(p + v3s16(1,0,0));
+		}
+		UASSERT(popped == 4);
+		UASSERT(q.size() == 5);
+		q.endUpdate();
+		UASSERT(q.updateSize() == 5);
+		UASSERT(q.pop_front() == v3s16(0,0,0));
+	}
+};
+
+struct TestNodeTimerList: public TestBase
+{
+	void Run()
+	{
+		NodeTimerList l;
+		l.set(v3s16(1,0,0), NodeTimer(3, 0));
+		l.set(v3s16(2,0,0), NodeTimer(1, 0));
+		l.set(v3s16(3,0,0), NodeTimer(2, 1.5));
+		// Replaces the old timer
+		l.set(v3s16(2,0,0), NodeTimer(2, 0));
+		UASSERT(l.size() == 3);
+
+		std::map<v3s16, NodeTimer> e = l.step(1);
+		UASSERT(e.size() == 1);
+		UASSERT(e.count(v3s16(3,0,0)) == 1);
+		UASSERT(fabs(e[v3s16(3,0,0)].elapsed - 2.5) < 0.001);
+		UASSERT(fabs(l.get(v3s16(1,0,0)).elapsed - 1) < 0.001);
+
+		l.remove(v3s16(1,0,0));
+		e = l.step(1);
+		UASSERT(e.size() == 1);
+		UASSERT(e.count(v3s16(2,0,0)) == 1);
+		UASSERT(l.size() == 0);
+
+		// Elapsed time is kept over serialization
+		l.set(v3s16(4,0,0), NodeTimer(5, 1));
+		l.step(2);
+		std::ostringstream os(std::ios::binary);
+		l.serialize(os, 25);
+		NodeTimerList l2;
+		std::istringstream is(os.str(), std::ios::binary);
+		l2.deSerialize(is, 25);
+		UASSERT(fabs(l2.get(v3s16(4,0,0)).elapsed - 3) < 0.001);
+		UASSERT(l2.step(1.9).empty());
+		UASSERT(l2.step(0.2).size() == 1);
+
+		// A copy has its own index
+		NodeTimerList l3 = l;
+		l.remove(v3s16(4,0,0));
+		UASSERT(l3.size() == 1);
+		l3.remove(v3s16(4,0,0));
+		UASSERT(l3.size() == 0 && l3.step(10).empty());
+	}
+};
+
+struct TestActiveObjectIndex: public TestBase
+{
+	static bool contains(const std::vector<u16> &ids, u16 id)
+	{
+		return std::find(ids.begin(), ids.end(), id) != ids.end();
+	}
+
+	void Run()
+	{
+		ActiveObjectIndex index;
+		// Fill enough blocks that small queries look at blocks only
+		for(u16 i=0; i<100; i++)
+			index.insert(100+i, v3f(i*100*BS, 0, 0));
+		index.insert(1, v3f(0, 0, 0));
+		index.insert(2, v3f(5*BS, 0, 0));
+		index.insert(3, v3f(-40*BS, 0, 0));
+		UASSERT(index.size() == 103);
+
+		std::vector<u16> ids;
+		index.getObjectsNear(v3f(0,0,0), 10*BS, ids);
+		UASSERT(contains(ids, 1));
+		UASSERT(contains(ids, 2));
+		UASSERT(!contains(ids, 3));
+		UASSERT(!contains(ids, 101));
+
+		// Moved into range
+		index.update(3, v3f(-2*BS, 0, 0));
+		// Not in the index; ignored
+		index.update(4, v3f(0, 0, 0));
+		index.remove(2);
+		ids.clear();
+		index.getObjectsNear(v3f(0,0,0), 10*BS, ids);
+		UASSERT(contains(ids, 1));
+		UASSERT(!contains(ids, 2));
+		UASSERT(contains(ids, 3));
+		UASSERT(!contains(ids, 4));
+		UASSERT(index.size() == 102);
+
+		// A huge radius finds everything
+		ids.clear();
+		index.getObjectsNear(v3f(0,0,0), 1e6*BS, ids);
+		UASSERT(ids.size() == 102);
+
+		// Moves are recorded when an object changes blocks
+		index.takeMoved(ids);
+		UASSERT(contains(ids, 1));
+		UASSERT(contains(ids, 3));
+		index.update(1, v3f(BS, 0, 0));
+		index.takeMoved(ids);
+		UASSERT(ids.empty());
+		index.update(1, v3f(MAP_BLOCKSIZE*BS, 0, 0));
+		index.takeMoved(ids);
+		UASSERT(ids.size() == 1 && ids[0] == 1);
+	}
+};
+
+struct TestCompactPositionUpdate: public TestBase
+{
+	void Run()
+	{
+		std::string full = gob_cmd_update_position(v3f(123.456, -7, 8000),
+				v3f(12.34, 0, -5), v3f(0, 0, 0), -90, true, false, 0.2);
+		std::string compact = gob_cmd_update_position_compact(full);
+		UASSERT(compact.size() < full.size());
+		std::istringstream is(compact, std::ios::binary);
+		UASSERT(readU8(is) == GENERIC_CMD_UPDATE_POSITION_COMPACT);
+		v3f pos, vel, acc;
+		f32 yaw, interval;
+		bool interpolate, end;
+		gob_read_update_position_compact(is, pos, vel, acc, yaw,
+				interpolate, end, interval);
+		// Position is exact, the rest quantized
+		UASSERT(pos.getDistanceFrom(v3f(123.456, -7, 8000)) < 0.001);
+		UASSERT(vel.getDistanceFrom(v3f(12.3, 0, -5)) < 0.001);
+		UASSERT(acc == v3f(0,0,0));
+		UASSERT(fabs(yaw - 270) < 0.01);
+		UASSERT(interpolate && !end);
+		UASSERT(fabs(interval - 0.2) < 0.001);
+
+		// Yaw just below a full turn wraps around to 0
+		f32 yaws[2] = {-0.001, 359.999};
+		for(u32 i=0; i<2; i++)
+		{
+			full = gob_cmd_update_position(v3f(0,0,0), v3f(0,0,0),
+					v3f(0,0,0), yaws[i], false, false, 0);
+			std::istringstream is2(gob_cmd_update_position_compact(full),
+					std::ios::binary);
+			readU8(is2);
+			gob_read_update_position_compact(is2, pos, vel, acc, yaw,
+					interpolate, end, interval);
+			UASSERT(yaw == 0);
+		}
+	}
+};
+
+struct TestPregenerateOrder: public TestBase
+{
+	void Run()
+	{
+		v3s16 cmin(-2,0,-1), cmax(3,1,1);
+		std::vector<v3s16> order;
+		MapPregenerator::getChunkOrder(cmin, cmax, order);
+		UASSERT(order.size() == 6*2*3);
+		// Middle column first, then in growing rings, each chunk once
+		UASSERT(order[0] == v3s16(0,0,0) && order[1] == v3s16(0,1,0));
+		std::set<v3s16> seen;
+		s16 ring = 0;
+		for(u32 i=0; i<order.size(); i++)
+		{
+			v3s16 p = order[i];
+			UASSERT(p.X >= cmin.X && p.X <= cmax.X);
+			UASSERT(p.Y >= cmin.Y && p.Y <= cmax.Y);
+			UASSERT(p.Z >= cmin.Z && p.Z <= cmax.Z);
+			UASSERT(seen.insert(p).second);
+			s16 r = MYMAX(abs(p.X), abs(p.Z));
+			UASSERT(r >= ring);
+			ring = r;
+		}
+
+		v3s16 minp, maxp;
+		UASSERT(MapPregenerator::parseArea("(10,-5,3) (-10,5,-3)",
+				&minp, &maxp));
+		UASSERT(minp == v3s16(-10,-5,-3) && maxp == v3s16(10,5,3));
+		UASSERT(MapPregenerator::parseArea("0,0,0 1,1,1", &minp, &maxp));
+		UASSERT(!MapPregenerator::parseArea("0,0,0 1,1", &minp, &maxp));
+		UASSERT(!MapPregenerator::parseArea("0,0,0 1,1,1 2", &minp, &maxp));
+		UASSERT(!MapPregenerator::parseArea("0,0,0 40000,0,0", &minp, &maxp));
+	}
+};
+
+struct TestNoise: public TestBase
+{
+	void Run()
+	{
+		// Rows of the lattice are the same as single points
+		float row[23];
+		s32 xs[] = {0, -11, 31000, -2147483647};
+		for(u32 k=0; k<sizeof(xs)/sizeof(xs[0]); k++)
+		{
+			noise2d_row(xs[k], -7, 1337, 23, row);
+			for(s32 i=0; i<23; i++)
+			{
+				UASSERT(row[i] == noise2d(xs[k] + i, -7, 1337));
+				UASSERT(row[i] >= -1.0 && row[i] <= 1.0);
+			}
+			noise3d_row(xs[k], 5, -9, 1337, 23, row);
+			for(s32 i=0; i<23; i++)
+				UASSERT(row[i] == noise3d(xs[k] + i, 5, -9, 1337));
+		}
+
+		/*
+			Maps give the same values as single points. A spread of 4
+			makes the positions exact; the tolerance is for -ffast-math.
+		*/
+		NoiseParams np = {0, 1, v3f(4, 4, 4), 17, 3, 0.5};
+		Noise map2d(&np, 3, 11, 6);
+		float *result = map2d.perlinMap2D(-13, 42);
+		for(s32 y=0; y<6; y++)
+		for(s32 x=0; x<11; x++)
+		{
+			float v = noise2d_perlin((-13 + x) / 4.0, (42 + y) / 4.0,
+					3 + 17, 3, 0.5);
+			UASSERT(fabs(result[y * 11 + x] - v) < 0.0001);
+		}
+		Noise map3d(&np, 3, 9, 5, 7);
+		result = map3d.perlinMap3D(21, -8, 0);
+		for(s32 z=0; z<7; z++)
+		for(s32 y=0; y<5; y++)
+		for(s32 x=0; x<9; x++)
+		{
+			float v = noise3d_perlin((21 + x) / 4.0, (-8 + y) / 4.0,
+					z / 4.0, 3 + 17, 3, 0.5);
+			UASSERT(fabs(result[(z * 5 + y) * 9 + x] - v) < 0.0001);
+		}
+	}
+};
+
+struct TestMapgenColumnCache: public TestBase
+{
+	void Run()
+	{
+		MapgenColumnCache cache(2);
+		float data[3] = {1, 2, 3};
+		float out[3];
+
+		// A miss is to be filled in by the caller
+		UASSERT(!cache.get(v2s16(0,0), out, 3));
+		cache.put(v2s16(0,0), data, 3);
+		UASSERT(cache.get(v2s16(0,0), out, 3));
+		UASSERT(out[0] == 1 && out[1] == 2 && out[2] == 3);
+
+		// An abandoned column is missed again
+		UASSERT(!cache.get(v2s16(0,16), out, 3));
+		cache.abandon(v2s16(0,16));
+		UASSERT(!cache.get(v2s16(0,16), out, 3));
+		{
+			MapgenColumnCacheGuard guard(&cache, v2s16(0,16));
+		}
+		UASSERT(!cache.get(v2s16(0,16), out, 3));
+		{
+			MapgenColumnCacheGuard guard(&cache, v2s16(0,16));
+			guard.put(data, 3);
+		}
+		UASSERT(cache.get(v2s16(0,16), out, 3));
+
+		// The least recently used column goes first
+		UASSERT(cache.get(v2s16(0,0), out, 3));
+		UASSERT(!cache.get(v2s16(80,0), out, 3));
+		cache.put(v2s16(80,0), data, 3);
+		UASSERT(cache.get(v2s16(0,0), out, 3));
+		UASSERT(!cache.get(v2s16(0,80), out, 3));
+		cache.put(v2s16(0,80), data, 3);
+		UASSERT(cache.get(v2s16(0,0), out, 3));
+		UASSERT(cache.get(v2s16(0,80), out, 3));
+		UASSERT(!cache.get(v2s16(80,0), out, 3));
+		cache.put(v2s16(80,0), data, 3);
+	}
+};
+
+struct TestMapgenWorkerPool: public TestBase
+{
+	struct CountTask : public MapgenTask
+	{
+		JMutex mutex;
+		std::vector<u32> runs;
+
+		CountTask(u32 nparts): runs(nparts, 0) { mutex.Init(); }
+
+		void runPart(u32 part)
+		{
+			JMutexAutoLock lock(mutex);
+			runs[part]++;
+		}
+	};
+
+	void Run()
+	{
+		MapgenWorkerPool pool(3);
+		UASSERT(pool.getThreadCount() == 3);
+
+		// Every part runs exactly once, however many there are
+		for (u32 nparts = 0; nparts != 20; nparts++) {
+			CountTask task(nparts);
+			pool.run(&task, nparts);
+			for (u32 i = 0; i != nparts; i++)
+				UASSERT(task.runs[i] == 1);
+		}
+	}
+};
+
 struct TestMapNode: public TestBase
 {
 	void Run(INodeDefManager *nodedef)
@@ -711,6 +1232,37 @@ struct TestVoxelAlgorithms: public TestBase
 				UASSERT(unlight_from.size() == 1);
 			}
 		}
+		/*
+			VoxelManipulator::spreadLight and unspreadLight
+		*/
+		{
+			VoxelManipulator v;
+			for(u16 x=0; x<20; x++)
+				v.setNodeNoRef(v3s16(x,0,0), MapNode(CONTENT_AIR));
+			v.setNodeNoRef(v3s16(10,0,0), MapNode(CONTENT_STONE));
+			v.setNodeNoRef(v3s16(0,0,0), MapNode(CONTENT_TORCH));
+			std::set<v3s16> from_nodes;
+			from_nodes.insert(v3s16(0,0,0));
+			v.spreadLight(LIGHTBANK_NIGHT, from_nodes, ndef);
+			UASSERT(v.getNode(v3s16(1,0,0)).getLight(LIGHTBANK_NIGHT, ndef)
+					== 12);
+			UASSERT(v.getNode(v3s16(9,0,0)).getLight(LIGHTBANK_NIGHT, ndef)
+					== 4);
+			// Light does not go through the stone
+			UASSERT(v.getNode(v3s16(11,0,0)).getLight(LIGHTBANK_NIGHT, ndef)
+					== 0);
+			v.setNodeNoRef(v3s16(0,0,0), MapNode(CONTENT_AIR));
+			std::map<v3s16, u8> unlight_from;
+			unlight_from[v3s16(0,0,0)] = 13;
+			std::set<v3s16> light_sources;
+			v.unspreadLight(LIGHTBANK_NIGHT, unlight_from, light_sources, ndef);
+			UASSERT(v.getNode(v3s16(1,0,0)).getLight(LIGHTBANK_NIGHT, ndef)
+					== 0);
+			UASSERT(v.getNode(v3s16(9,0,0)).getLight(LIGHTBANK_NIGHT, ndef)
+					== 0);
+			// Nothing else lights the corridor
+			UASSERT(light_sources.empty());
+		}
 	}
 };
 
@@ -1759,6 +2311,19 @@ void run_tests()
 	TEST(TestCompress);
 	TEST(TestSerialization);
 	TEST(TestNodedefSerialization);
+	TEST(TestNodePalette);
+	TEST(TestMapDatabaseKeys);
+	TEST(TestUniformMapBlock);
+	TEST(TestMapBlockContents);
+	TEST(TestMapBlockIndex);
+	TEST(TestLiquidQueue);
+	TEST(TestNodeTimerList);
+	TEST(TestActiveObjectIndex);
+	TEST(TestCompactPositionUpdate);
+	TEST(TestPregenerateOrder);
+	TEST(TestNoise);
+	TEST(TestMapgenColumnCache);
+	TEST(TestMapgenWorkerPool);
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
 	TESTPARAMS(TestVoxelAlgorithms, ndef);
@@ -64,11 +64,16 @@ class UniqueQueue
 		return value;
 	}
 
-	u32 size()
+	u32 size() const
 	{
 		return m_map.size();
 	}
 
+	bool contains(const Value &value) const
+	{
+		return m_map.find(value) != m_map.end();
+	}
+
 private:
 	std::map<Value, u8> m_map;
 	std::list<Value> m_list;
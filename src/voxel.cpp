@@ -22,6 +22,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gettime.h"
 #include "nodedef.h"
 #include "util/timetaker.h"
+#include "util/directiontables.h"
+#include <vector>
 
 /*
 	Debug stuff
@@ -236,6 +238,19 @@ void VoxelManipulator::copyFrom(MapNode *src, VoxelArea src_area,
 	}
 }
 
+void VoxelManipulator::copyFromUniform(const MapNode &n, v3s16 to_pos,
+		v3s16 size)
+{
+	for(s16 z=0; z<size.Z; z++)
+	for(s16 y=0; y<size.Y; y++)
+	{
+		s32 i_local = m_area.index(to_pos.X, to_pos.Y+y, to_pos.Z+z);
+		for(s16 x=0; x<size.X; x++)
+			m_data[i_local + x] = n;
+		memset(&m_flags[i_local], 0, size.X);
+	}
+}
+
 void VoxelManipulator::copyTo(MapNode *dst, VoxelArea dst_area,
 		v3s16 dst_pos, v3s16 from_pos, v3s16 size)
 {
@@ -301,106 +316,40 @@ void VoxelManipulator::clearFlag(u8 flags)
 			<<volume<<" nodes"<<std::endl;*/
 }
 
-void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
-		std::set<v3s16> & light_sources, INodeDefManager *nodemgr)
-{
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-	
-	emerge(VoxelArea(p - v3s16(1,1,1), p + v3s16(1,1,1)));
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-		
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-		
-		/*
-			If the neighbor is dimmer than what was specified
-			as oldlight (the light of the previous node)
-		*/
-		u8 light2 = n2.getLight(bank, nodemgr);
-		if(light2 < oldlight)
-		{
-			/*
-				And the neighbor is transparent and it has some light
-			*/
-			if(nodemgr->get(n2).light_propagates && light2 != 0)
-			{
-				/*
-					Set light to 0 and add to queue
-				*/
-
-				n2.setLight(bank, 0, nodemgr);
-				
-				unspreadLight(bank, n2pos, light2, light_sources, nodemgr);
-				
-				/*
-					Remove from light_sources if it is there
-					NOTE: This doesn't happen nearly at all
-				*/
-				/*if(light_sources.find(n2pos))
-				{
-					std::cout<<"Removed from light_sources"<<std::endl;
-					light_sources.remove(n2pos);
-				}*/
-			}
-		}
-		else{
-			light_sources.insert(n2pos);
-		}
-	}
-}
-
-#if 1
 /*
-	Goes recursively through the neighbours of the node.
+	The light algorithms below run breadth-first over a queue instead of
+	recursing, so large areas can't overflow the stack.
 
-	Alters only transparent nodes.
+	Only the current area is touched: nodes outside it or not loaded are
+	treated as nonexistent. Emerge the area before calling these.
+*/
 
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
+// A node waiting in the queue of unspreadLight(), with its old light
+struct UnlightNode
+{
+	v3s16 p;
+	u8 light;
 
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
+	UnlightNode(v3s16 p_, u8 light_):
+		p(p_),
+		light(light_)
+	{}
+};
 
-	values of from_nodes are lighting values.
+/*
+	A single-node wrapper of the one below
 */
-void VoxelManipulator::unspreadLight(enum LightBank bank,
-		std::map<v3s16, u8> & from_nodes,
+void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
 		std::set<v3s16> & light_sources, INodeDefManager *nodemgr)
 {
-	if(from_nodes.size() == 0)
-		return;
-	
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
-	{
-		unspreadLight(bank, j->first, j->second, light_sources, nodemgr);
-	}
+	std::map<v3s16, u8> from_nodes;
+	from_nodes[p] = oldlight;
+	unspreadLight(bank, from_nodes, light_sources, nodemgr);
 }
-#endif
 
-#if 0
 /*
-	Goes recursively through the neighbours of the node.
+	Goes through the neighbours of the nodes, and on through the
+	neighbours of the neighbours that get altered.
 
 	Alters only transparent nodes.
 
@@ -417,276 +366,130 @@ void VoxelManipulator::unspreadLight(enum LightBank bank,
 	values of from_nodes are lighting values.
 */
 void VoxelManipulator::unspreadLight(enum LightBank bank,
-		core::map<v3s16, u8> & from_nodes,
-		core::map<v3s16, bool> & light_sources)
+		std::map<v3s16, u8> & from_nodes,
+		std::set<v3s16> & light_sources, INodeDefManager *nodemgr)
 {
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-	
-	if(from_nodes.size() == 0)
-		return;
-	
-	core::map<v3s16, u8> unlighted_nodes;
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
+	std::vector<UnlightNode> queue;
+	queue.reserve(from_nodes.size());
+	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
+			j != from_nodes.end(); ++j)
+		queue.push_back(UnlightNode(j->first, j->second));
 
-	for(; j.atEnd() == false; j++)
+	for(u32 head = 0; head < queue.size(); head++)
 	{
-		v3s16 pos = j.getNode()->getKey();
-		
-		emerge(VoxelArea(pos - v3s16(1,1,1), pos + v3s16(1,1,1)));
-
-		//MapNode &n = m_data[m_area.index(pos)];
-		
-		u8 oldlight = j.getNode()->getValue();
-		
+		v3s16 pos = queue[head].p;
+		u8 oldlight = queue[head].light;
+
 		// Loop through 6 neighbors
 		for(u16 i=0; i<6; i++)
 		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-			
-			u32 n2i = m_area.index(n2pos);
+			v3s16 n2pos = pos + g_6dirs[i];
 
-			if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
+			if(!m_area.contains(n2pos))
+				continue;
+			u32 n2i = m_area.index(n2pos);
+			if(m_flags[n2i] & (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED))
 				continue;
 
 			MapNode &n2 = m_data[n2i];
-			
+
 			/*
 				If the neighbor is dimmer than what was specified
-				as oldlight (the light of the previous node)
+				as oldlight (the light of the previous node), and it is
+				transparent and has some light, set its light to 0 and
+				add it to the queue
 			*/
-			if(n2.getLight(bank, nodemgr) < oldlight)
+			u8 light2 = n2.getLight(bank, nodemgr);
+			if(light2 < oldlight)
 			{
-				/*
-					And the neighbor is transparent and it has some light
-				*/
-				if(nodemgr->get(n2).light_propagates && n2.getLight(bank, nodemgr) != 0)
+				if(light2 != 0 && nodemgr->get(n2).light_propagates)
 				{
-					/*
-						Set light to 0 and add to queue
-					*/
-
-					u8 current_light = n2.getLight(bank, nodemgr);
-					n2.setLight(bank, 0);
-
-					unlighted_nodes.insert(n2pos, current_light);
-					
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						std::cout<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
+					n2.setLight(bank, 0, nodemgr);
+					queue.push_back(UnlightNode(n2pos, light2));
 				}
 			}
 			else{
-				light_sources.insert(n2pos, true);
+				light_sources.insert(n2pos);
 			}
 		}
 	}
-
-	/*dstream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-	
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources);
 }
-#endif
 
+/*
+	A single-node wrapper of the one below
+*/
 void VoxelManipulator::spreadLight(enum LightBank bank, v3s16 p,
 		INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	emerge(VoxelArea(p - v3s16(1,1,1), p + v3s16(1,1,1)));
-
-	u32 i = m_area.index(p);
-	
-	if(m_flags[i] & VOXELFLAG_INEXISTENT)
-		return;
-
-	MapNode &n = m_data[i];
-
-	u8 oldlight = n.getLight(bank, nodemgr);
-	u8 newlight = diminish_light(oldlight);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-		
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		u8 light2 = n2.getLight(bank, nodemgr);
-		
-		/*
-			If the neighbor is brighter than the current node,
-			add to list (it will light up this node on its turn)
-		*/
-		if(light2 > undiminish_light(oldlight))
-		{
-			spreadLight(bank, n2pos, nodemgr);
-		}
-		/*
-			If the neighbor is dimmer than how much light this node
-			would spread on it, add to list
-		*/
-		if(light2 < newlight)
-		{
-			if(nodemgr->get(n2).light_propagates)
-			{
-				n2.setLight(bank, newlight, nodemgr);
-				spreadLight(bank, n2pos, nodemgr);
-			}
-		}
-	}
+	std::set<v3s16> from_nodes;
+	from_nodes.insert(p);
+	spreadLight(bank, from_nodes, nodemgr);
 }
 
-#if 0
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
-
-	NOTE: This is faster on small areas but will overflow the
-	      stack on large areas. Thus it is not used.
-*/
-void VoxelManipulator::spreadLight(enum LightBank bank,
-		core::map<v3s16, bool> & from_nodes)
-{
-	if(from_nodes.size() == 0)
-		return;
-	
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
-
-	for(; j.atEnd() == false; j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-
-		spreadLight(bank, pos);
-	}
-}
-#endif
+	Lights neighbors of from_nodes, and on through the neighbours that
+	get brighter.
 
-#if 1
-/*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	A node can be queued again when it gets brighter after it was
+	handled; it is then handled again with its new light.
 */
 void VoxelManipulator::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes, INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.size() == 0)
-		return;
-	
-	std::set<v3s16> lighted_nodes;
+	std::vector<v3s16> queue(from_nodes.begin(), from_nodes.end());
 
-	for(std::set<v3s16>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	for(u32 head = 0; head < queue.size(); head++)
 	{
-		v3s16 pos = *j;
-
-		emerge(VoxelArea(pos - v3s16(1,1,1), pos + v3s16(1,1,1)));
+		v3s16 pos = queue[head];
 
+		if(!m_area.contains(pos))
+			continue;
 		u32 i = m_area.index(pos);
-		
-		if(m_flags[i] & VOXELFLAG_INEXISTENT)
+		if(m_flags[i] & (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED))
 			continue;
 
-		MapNode &n = m_data[i];
-
-		u8 oldlight = n.getLight(bank, nodemgr);
+		u8 oldlight = m_data[i].getLight(bank, nodemgr);
 		u8 newlight = diminish_light(oldlight);
 
 		// Loop through 6 neighbors
 		for(u16 i=0; i<6; i++)
 		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-			
-			try
-			{
-				u32 n2i = m_area.index(n2pos);
+			v3s16 n2pos = pos + g_6dirs[i];
 
-				if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
-					continue;
+			if(!m_area.contains(n2pos))
+				continue;
+			u32 n2i = m_area.index(n2pos);
+			if(m_flags[n2i] & (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED))
+				continue;
 
-				MapNode &n2 = m_data[n2i];
+			MapNode &n2 = m_data[n2i];
 
-				u8 light2 = n2.getLight(bank, nodemgr);
-				
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(light2 > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos);
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(light2 < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						lighted_nodes.insert(n2pos);
-					}
-				}
+			u8 light2 = n2.getLight(bank, nodemgr);
+
+			/*
+				If the neighbor is brighter than the current node,
+				add to queue (it will light up this node on its turn)
+			*/
+			if(light2 > undiminish_light(oldlight))
+			{
+				queue.push_back(n2pos);
 			}
-			catch(InvalidPositionException &e)
+			/*
+				If the neighbor is dimmer than how much light this node
+				would spread on it, light it and add to queue
+			*/
+			else if(light2 < newlight)
 			{
-				continue;
+				if(nodemgr->get(n2).light_propagates)
+				{
+					n2.setLight(bank, newlight, nodemgr);
+					queue.push_back(n2pos);
+				}
 			}
 		}
 	}
-
-	/*dstream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-	
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, nodemgr);
 }
-#endif
 
 //END
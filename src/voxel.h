@@ -507,6 +507,8 @@ class VoxelManipulator /*: public NodeContainer*/
 	*/
 	void copyFrom(MapNode *src, VoxelArea src_area,
 			v3s16 from_pos, v3s16 to_pos, v3s16 size);
+	// Same as copyFrom() with every source node being n
+	void copyFromUniform(const MapNode &n, v3s16 to_pos, v3s16 size);
 
 	// Copy data
 	void copyTo(MapNode *dst, VoxelArea dst_area,